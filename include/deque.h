@@ -0,0 +1,46 @@
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct job_info;
+
+// The circular array of a deque. When a deque grows, its old arrays are kept in a list until the deque is destroyed,
+// because thieves that loaded them before the swap may still be reading from them.
+typedef struct deque_array {
+  int64_t capacity;  // Always a power of 2
+  struct deque_array *previous;
+  _Atomic(struct job_info *) slots[];
+} DequeArray;
+
+// A Chase-Lev work-stealing deque (see "Correct and Efficient Work-Stealing for Weak Memory Models", Lê et al.).
+// Only its owner may push jobs to and take jobs from its bottom, while any thread may steal jobs from its top.
+typedef struct work_deque {
+  _Atomic int64_t top;
+  char top_padding[64 - sizeof(int64_t)];  // Keep thieves and the owner from invalidating each other's cache line
+
+  _Atomic int64_t bottom;
+  char bottom_padding[64 - sizeof(int64_t)];
+
+  _Atomic(DequeArray *) array;
+} WorkDeque;
+
+void initializeDeque(WorkDeque *deque, int64_t capacity);
+
+// Owner only: pushes a job to the bottom of the deque, growing it if it's full.
+void pushBottom(WorkDeque *deque, struct job_info *job_info);
+
+// Owner only: takes the most recently pushed job, or returns NULL if the deque is empty.
+struct job_info *takeBottom(WorkDeque *deque);
+
+// Steals the least recently pushed job. Returns NULL if the deque is empty or if another thread took the job first.
+struct job_info *stealTop(WorkDeque *deque);
+
+// Returns true iff the deque seems to be empty (another thread may push or take a job right after the check).
+bool dequeIsEmpty(WorkDeque *deque);
+
+void destroyDeque(WorkDeque *deque);
+
+#endif  // DEQUE_H
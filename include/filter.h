@@ -0,0 +1,137 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "relation.h"
+
+// The comparison of a filter predicate, e.g. the ">" of 0.1 > 3000
+typedef enum { LT, GT, EQ } Operator;
+
+// The instruction sets the filter kernels come in. The widest one the CPU supports is picked at runtime (see
+// detectFilterIsa), so the library itself is compiled for the baseline architecture.
+typedef enum { FILTER_SCALAR, FILTER_AVX2, FILTER_AVX512 } FilterIsa;
+
+// The most columns a fused filter can check (a query has at most as many filters)
+#define MAX_FUSED_COLUMNS 16
+
+// The values a column has to fall in: [low, high], both inclusive
+typedef struct column_range {
+  const uint64_t *column;
+  uint64_t low;
+  uint64_t high;
+
+  // The column's zone map, or NULL if it doesn't have one
+  const Zone *zones;
+} ColumnRange;
+
+// Whether none, some or all of the rows of a zone can pass a filter, judging by the zone maps of its columns
+typedef enum { ZONE_NONE, ZONE_SOME, ZONE_ALL } ZoneMatch;
+
+// The conjunction of the filter predicates on the columns of a single relation, compiled into one range per column.
+// Predicates on the same column are merged into its range (e.g. 0.1>3000&0.1<5000 into [3001, 4999]), so each
+// column is checked with a single comparison, and all the columns are checked in the same pass over the rows.
+typedef struct fused_filter {
+  uint32_t num_ranges;
+  ColumnRange ranges[MAX_FUSED_COLUMNS];
+
+  // Set if some column's range is empty (e.g. for 0.1<3&0.1>5), in which case no row can pass
+  bool never_holds;
+} FusedFilter;
+
+// Initializes a filter without any predicates, which every row passes.
+void initializeFusedFilter(FusedFilter *filter);
+
+// Adds the predicate "value op constant" on the given column, whose zone map may be NULL, to the filter.
+void addFilterPredicate(
+    FusedFilter *filter, const uint64_t *column, const Zone *zones, Operator op, uint64_t constant);
+
+// Returns whether none, some or all of the rows of the given zone can pass the filter. Columns without a zone map could
+// go either way, so they never rule out a zone, and only let it be accepted as a whole if it has no other ranges.
+ZoneMatch matchZone(const FusedFilter *filter, uint32_t zone);
+
+// Narrows the rows [*start, *end) down to the ones whose values fall in the given range, which are contiguous if the
+// range's column is sorted (in nondecreasing order), by binary searching for the first and the last of them. The
+// range's filter must not be one that never holds, since those aren't narrowed down.
+void findSortedRows(const ColumnRange *range, uint32_t *start, uint32_t *end);
+
+// Returns the widest instruction set that the CPU supports (FILTER_SCALAR on anything but x86-64).
+FilterIsa detectFilterIsa(void);
+
+// Returns true if the CPU supports the given instruction set.
+bool filterIsaSupported(FilterIsa isa);
+
+// Writes the IDs of the rows in [start, end) that pass the filter to selection, in increasing order, and returns how
+// many there are. The kernels are branch-free, and selection must have room for end - start IDs, since the
+// vectorized ones may write past the last selected row (but never past that bound).
+uint32_t selectFusedRows(const FusedFilter *filter, uint32_t start, uint32_t end, uint32_t *selection);
+
+// Same as selectFusedRows, but goes over the rows zone by zone (see matchZone): zones where no row can pass are
+// skipped, the rows of zones where they all pass are selected without being checked, and only the rest are scanned.
+// If zone_counts isn't NULL, the number of zones of each kind is added to zone_counts[ZONE_NONE], [ZONE_SOME] and
+// [ZONE_ALL].
+uint32_t selectFusedRowsByZone(
+    const FusedFilter *filter, uint32_t start, uint32_t end, uint32_t *selection, uint64_t *zone_counts);
+
+// Same as selectFusedRows, but only considers the count rows of selection (in their order), and writes the ones that
+// pass to refined, which may be selection itself. The vectorized kernels gather the values with 32-bit signed
+// indices, so row IDs must be smaller than 2^31.
+uint32_t refineFusedSelection(const FusedFilter *filter, const uint32_t *selection, uint32_t count, uint32_t *refined);
+
+// Writes the positions i in [start, end) where left_column[left_ids[i]] == right_column[right_ids[i]] to selection, in
+// increasing order, and returns how many there are, e.g. to apply a join on two relations whose row IDs are columns of
+// the same intermediate result. As with refineFusedSelection, the row IDs must be smaller than 2^31, and as with
+// selectFusedRows, selection must have room for end - start positions.
+uint32_t selectEqualRows(const uint64_t *left_column,
+                         const uint32_t *left_ids,
+                         const uint64_t *right_column,
+                         const uint32_t *right_ids,
+                         uint32_t start,
+                         uint32_t end,
+                         uint32_t *selection);
+
+// Same as the above, with a given instruction set (which must be supported), so that the kernels can be compared.
+uint32_t selectFusedRowsWith(
+    FilterIsa isa, const FusedFilter *filter, uint32_t start, uint32_t end, uint32_t *selection);
+
+uint32_t refineFusedSelectionWith(
+    FilterIsa isa, const FusedFilter *filter, const uint32_t *selection, uint32_t count, uint32_t *refined);
+
+uint32_t selectEqualRowsWith(FilterIsa isa,
+                             const uint64_t *left_column,
+                             const uint32_t *left_ids,
+                             const uint64_t *right_column,
+                             const uint32_t *right_ids,
+                             uint32_t start,
+                             uint32_t end,
+                             uint32_t *selection);
+
+// Shorthands for filters with a single predicate, "value op constant" on the given column.
+uint32_t selectRows(
+    const uint64_t *column, uint32_t start, uint32_t end, Operator op, uint64_t constant, uint32_t *selection);
+
+uint32_t refineSelection(const uint64_t *column,
+                         const uint32_t *selection,
+                         uint32_t count,
+                         Operator op,
+                         uint64_t constant,
+                         uint32_t *refined);
+
+uint32_t selectRowsWith(FilterIsa isa,
+                        const uint64_t *column,
+                        uint32_t start,
+                        uint32_t end,
+                        Operator op,
+                        uint64_t constant,
+                        uint32_t *selection);
+
+uint32_t refineSelectionWith(FilterIsa isa,
+                             const uint64_t *column,
+                             const uint32_t *selection,
+                             uint32_t count,
+                             Operator op,
+                             uint64_t constant,
+                             uint32_t *refined);
+
+#endif  // FILTER_H
@@ -23,6 +23,21 @@ typedef struct row_ids {
 // Extracts the nbits least-significant bits of number right-shifted by shamt.
 #define LSBITS(number, nbits, shamt) (((number) >> (shamt)) & ~(~((uint32_t)0) << (nbits)))
 
+// Prints profiling information to stderr (so that it doesn't mix with the results), if the code is compiled with
+// PROFILE defined (e.g. make CFLAGS=-DPROFILE). The arguments are always compiled, so that they never go stale.
+#ifdef PROFILE
+#define PROFILE_ENABLED 1
+#else
+#define PROFILE_ENABLED 0
+#endif
+
+#define PROFILE_PRINT(...)          \
+  do {                              \
+    if (PROFILE_ENABLED) {          \
+      fprintf(stderr, __VA_ARGS__); \
+    }                               \
+  } while (0)
+
 // Allocates a chunk of memory, possibly zero-initialized or containing the contents of a previously
 // allocated chunk. This is essentially a "safe" version of malloc, calloc and realloc: it asserts
 // that we'll never get NULL back from them. Mainly used to avoid repeating the same assert checks.
@@ -47,12 +62,18 @@ void* memAlloc(uint32_t size, uint32_t count, bool set_zeros, void* source);
 
 void addRowID(uint32_t id, RowIDs** row_ids);
 
+// Appends count row IDs to a RowIDs object at once, in the same way as addRowID, but growing its array at most once.
+void appendRowIDs(const uint32_t* ids, uint32_t count, RowIDs** row_ids);
+
 // Returns the nearest power of 2 that's greater than or equal to number.
 uint32_t gtePow2(uint32_t number);
 
 // Returns the L2 cache's size (tested in Linux and MacOS).
 uint32_t getL2CacheSize(void);
 
+// Returns the number of online CPU cores (logical ones, if the system has simultaneous multithreading).
+uint32_t getNumCores(void);
+
 // Returns the maximum element in an array.
 uint32_t maxArray(uint32_t* array, uint32_t length);
 
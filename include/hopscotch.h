@@ -22,6 +22,7 @@ typedef struct hash_table {
 
   uint32_t size;                // Number of payloads in the table
   uint32_t capacity;            // Number of total buckets in the hash table
+  uint32_t num_allocated;       // Number of buckets actually allocated (at least capacity, see resetHashTable)
   uint32_t neighbourhood_size;  // Number of buckets that consitute a neighbourhood
 } HashTable;
 
@@ -36,6 +37,11 @@ typedef struct hash_table {
 
 HashTable *createHashTable(uint32_t capacity, uint32_t neighbourhood_size);
 
+// Empties a hash table so that it can be reused with the given capacity (a power of 2). Unlike destroying the table and
+// creating a new one, this keeps the buckets and their row ID chains around, so it only allocates memory if the table
+// never had that many buckets before.
+void resetHashTable(HashTable *table, uint32_t capacity);
+
 // Reclaims all memory used by a HashTable object.
 void destroyHashTable(HashTable *table);
 
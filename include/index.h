@@ -0,0 +1,78 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdint.h>
+
+#include "filter.h"
+#include "relation.h"
+
+// How much memory the point indexes of all the relations may take by default (see setPointIndexBudget)
+#define DEFAULT_POINT_INDEX_BUDGET ((uint64_t)1 << 30)
+
+// Maps each distinct value of a column to the rows that hold it, in compressed sparse row form: the rows of values[i]
+// are row_ids[offsets[i]], ..., row_ids[offsets[i + 1] - 1], in increasing order. The values are sorted, so a lookup
+// is a binary search, which lets equality filters on the column skip scanning it.
+typedef struct point_index {
+  uint64_t *values;
+  uint32_t *offsets;
+  uint32_t *row_ids;
+  uint32_t num_values;
+
+  // The memory the index takes, in bytes
+  uint64_t size;
+} PointIndex;
+
+// Columns with at most this many distinct values get bitmap indexes by default (see buildBitmapIndexes)
+#define DEFAULT_BITMAP_MAX_VALUES 32
+
+// Holds a bitmap per distinct value of a column, whose i-th bit is set iff the i-th row holds that value. The values
+// are sorted, so the rows of a range of values are the union of a run of bitmaps, and a conjunction of filters on
+// several indexed columns is the intersection of those unions, which takes a word operation per 64 rows.
+typedef struct bitmap_index {
+  uint64_t *values;
+  uint64_t *bitmaps;  // The bitmap of values[i] is bitmaps[i * num_words], ..., bitmaps[(i + 1) * num_words - 1]
+  uint32_t num_values;
+  uint32_t num_words;
+} BitmapIndex;
+
+// Sets how much memory the point indexes that getPointIndex builds may take in total, in bytes.
+void setPointIndexBudget(uint64_t budget);
+
+// Returns the number of bytes that the point indexes that getPointIndex has built take.
+uint64_t pointIndexMemory(void);
+
+// Builds the point index of the given column, with num_tuples rows.
+PointIndex *buildPointIndex(const uint64_t *column, uint32_t num_tuples);
+
+// Returns the point index of the given column of a relation, building it if this is the first time it's needed.
+// Returns NULL if the index would exceed the memory budget, in which case the column has to be scanned. Queries can
+// call it concurrently: if several of them build the same index at once, one of them is kept and shared by all.
+PointIndex *getPointIndex(Relation *relation, uint32_t column);
+
+// Points row_ids to the rows that hold the given value, in increasing order, and returns how many there are.
+uint32_t lookupPointIndex(const PointIndex *index, uint64_t value, const uint32_t **row_ids);
+
+// Builds the bitmap index of the given column, with num_tuples rows, or returns NULL if the column has more than
+// max_values distinct values (which is found out as soon as they're seen, so high-cardinality columns cost little).
+BitmapIndex *buildBitmapIndex(const uint64_t *column, uint32_t num_tuples, uint32_t max_values);
+
+// Builds the bitmap index of every column of a relation that has at most max_values distinct values.
+void buildBitmapIndexes(Relation *relation, uint32_t max_values);
+
+// Writes the IDs of the rows [0, num_tuples) that pass the filter to selection, in increasing order, and returns how
+// many there are. Every range of the filter is evaluated with the bitmap index of its column, indexes[r] for the r-th
+// one, and the rows are only converted to IDs once all the ranges have been intersected.
+uint32_t selectRowsByBitmaps(
+    const FusedFilter *filter, BitmapIndex *const *indexes, uint32_t num_tuples, uint32_t *selection);
+
+// Reclaims all memory used by the point and bitmap indexes of a relation, giving the point indexes' memory back to
+// the budget (destroyRelation calls it).
+void destroyRelationIndexes(Relation *relation);
+
+// Reclaims all memory used by a PointIndex object that was returned by buildPointIndex.
+void destroyPointIndex(PointIndex *index);
+
+// Reclaims all memory used by a BitmapIndex object.
+void destroyBitmapIndex(BitmapIndex *index);
+
+#endif  // INDEX_H
@@ -1,6 +1,7 @@
 #ifndef OPTIMIZER_H
 #define OPTIMIZER_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -16,6 +17,8 @@ typedef struct column_statistics {
   uint32_t max;       // Maximum value of this column
   uint32_t count;     // Number of tuples
   uint32_t distinct;  // Number of distinct values of tuples
+  bool unique;        // Whether its values are all distinct, i.e. whether it's a key of its relation
+  bool dense;         // Whether it's unique and holds every value between its min and max
 } ColumnStats;
 
 typedef struct relation_statistics {
@@ -24,10 +27,32 @@ typedef struct relation_statistics {
   uint32_t count;  // Number of columns of relation
 } RelationStats;
 
-// Function that collects statistcs of a Relation
+// Function that collects statistcs of a Relation, including which of its columns are unique and dense (see ColumnStats).
+// Which ones are sorted is taken from the relation's zone maps (see Relation.sorted) rather than kept twice.
 RelationStats* gatherStatistics(Relation* relation);
 
-// Function that transforms the query based on the statistics of the relations
+// Estimates the fraction of a column's tuples that satisfy "value op constant", assuming that its values are spread
+// uniformly between its min and max
+double estimateSelectivity(const ColumnStats* stats, Operator op, uint64_t constant);
+
+// Estimates the selectivity of every filter of a query and reorders them, so that the relations expected to keep the
+// fewest tuples are filtered first (which gives an empty result away as early as possible), and the filters on each
+// relation go from the most to the least selective one
+void orderFilters(Query* query, RelationStats** data_statistics);
+
+// Estimates the cost of executing a join (whether handled as a filter, when both columns are of the same alias, or as
+// an actual join) and narrows the joined columns' stats down to the range of values they share, updating the counts
+// and distinct values of their relations' columns
+uint32_t estimateJoinCost(uint32_t left_relation,
+                          uint32_t left_column,
+                          uint32_t left_alias,
+                          uint32_t right_relation,
+                          uint32_t right_column,
+                          uint32_t right_alias,
+                          RelationStats** stats);
+
+// Function that transforms the query based on the statistics of the relations. It also marks the join columns that are
+// keys of their relations (see JoinPredicate), and treats them as such when estimating the joins' cardinalities.
 void optimizeQuery(Query* query_original, RelationStats** data_statistics, uint32_t num_relations, bool dynamic);
 
 // Creates a deep copy of Relation Statistics
@@ -8,6 +8,16 @@
 #include "relation.h"
 #include "scheduler.h"
 
+#define NEIGHBOURHOOD_SIZE 48  // Parameter used for the hopscotch tables
+
+// The least amount of work, in units of scanning or probing a single tuple, that's worth handing to another thread.
+// Operators engage one thread per MIN_WORK_PER_TASK units of their estimated cost (see chooseParallelism).
+#define MIN_WORK_PER_TASK 32768
+
+// Returns the full join value of a tuple, given the wide payloads of its relation (see JoinRelation).
+#define FULL_PAYLOAD(wide_payloads, tuple) \
+  ((wide_payloads) != NULL ? (wide_payloads)[(tuple).key] : (uint64_t)(tuple).payload)
+
 // The L2 cache's size, measured in bytes.
 extern uint32_t l2size;
 
@@ -18,7 +28,19 @@ extern uint32_t l2size;
 extern uint8_t nbits1;
 extern uint8_t nbits2;
 
-// Joins two relations on their tuple's "payload" field.
+// The algorithms phjoin can choose from, depending on the size of its inputs.
+typedef enum {
+  NESTED_LOOP_JOIN,       // Tiny inputs: compare every pair of tuples inline
+  SMALL_HASH_JOIN,        // Small inputs: build an L1-resident table and probe it inline
+  DENSE_KEY_JOIN,         // One input is a key with closely packed values: index it by value and probe it inline
+  PARTITIONED_HASH_JOIN,  // (Possibly) partition both relations, build all tables, then probe them all
+
+  // Same as above, but once both relations are partitioned, each partition's table is built and probed by the same job
+  // while it's still hot in the cache, and then destroyed. This is the default for large inputs.
+  FUSED_PARTITIONED_HASH_JOIN,
+} JoinStrategy;
+
+// Joins two relations on their tuple's "payload" field (or their wide payloads, if either relation has them).
 //
 // Args:
 //     relation_R: the left relation.
@@ -26,10 +48,34 @@ extern uint8_t nbits2;
 //     scheduler: the job scheduler to be used for multi-threading purposes.
 //
 // Returns:
-//     A new, heap-allocated relation that represents the join result for relation_R and relation_S.
+//     A new, heap-allocated relation that represents the join result for relation_R and relation_S. If the
+//     scheduler's group is cancelled while the join runs (see cancelJobGroup), its jobs stop early and the result is
+//     empty.
 
 JoinRelation *phjoin(JoinRelation *relation_R, JoinRelation *relation_S, JobScheduler *scheduler);
 
+// A relation whose values are all distinct (see JoinRelation) and span fewer than DENSE_KEY_MAX_SPREAD values per
+// tuple is a dense key, whose tuples can be indexed by value in a plain array instead of a hash table. phjoin does so
+// whenever the join would run on a single thread anyway. Its values are only assumed to be distinct, so if two of them
+// turn out to be equal, the relations are hashed instead.
+#define DENSE_KEY_MAX_SPREAD 4
+
+// Same as phjoin, but uses the given strategy instead of picking one based on the relations' sizes. DENSE_KEY_JOIN
+// needs one of the relations to be a dense key (see DENSE_KEY_MAX_SPREAD).
+JoinRelation *phjoinWithStrategy(JoinRelation *relation_R,
+                                 JoinRelation *relation_S,
+                                 JoinStrategy strategy,
+                                 JobScheduler *scheduler);
+
+// Returns the strategy phjoin uses for two relations with the given number of tuples.
+JoinStrategy chooseJoinStrategy(uint32_t num_tuples_R, uint32_t num_tuples_S);
+
+// Returns how many threads an operator with the given estimated cost should engage: one per MIN_WORK_PER_TASK units
+// of work, but at least one (the calling thread) and at most all of the scheduler's execution_threads.
+uint32_t chooseParallelism(uint64_t cost, uint64_t execution_threads);
+
+const char *joinStrategyName(JoinStrategy strategy);
+
 // Partitions a relation so that tuples with same hash values are contiguous.
 //
 // Args:
@@ -40,7 +86,8 @@ JoinRelation *phjoin(JoinRelation *relation_R, JoinRelation *relation_S, JobSche
 //     scheduler: the job scheduler to be used for multi-threading purposes.
 //
 // Returns:
-//     A pointer to a new, heap-allocated partitioned relation.
+//     A pointer to a new, heap-allocated partitioned relation. If the scheduler's group is cancelled while the
+//     relation is being partitioned, the order (and values) of its tuples are undefined.
 
 JoinRelation *partition(
     JoinRelation *relation, bool is_smallest, bool two_passes, uint8_t *num_partition_passes, JobScheduler *scheduler);
@@ -56,6 +103,7 @@ typedef struct histogram_job_args {
   uint32_t nbits;
   uint8_t shamt;
   uint32_t **hist;
+  CancellationToken *cancellation;  // The token of the job's group, checked between morsels (may be NULL)
 } HistogramJobArgs;
 
 typedef void (*HistogramJob)(void *args);
@@ -63,15 +111,45 @@ typedef void (*HistogramJob)(void *args);
 // Creates a histogram.
 void histogramJob(void *args);
 
-// Merges a number of histograms into one by adding their frequencies.
-uint32_t *mergeHistograms(uint32_t **histograms, uint32_t num_threads, uint8_t nbits);
+// Scatter job: the first partitioning pass over a chunk of a relation
+typedef struct scatter_job_args {
+  Tuple *tuples;
+  Tuple *partitioned_tuples;
+  uint32_t start;
+  uint32_t end;
+  uint32_t *offsets;  // The chunk's next position in each of the 2^nbits1 partitions (advanced by the job)
+  CancellationToken *cancellation;
+} ScatterJobArgs;
+
+typedef void (*ScatterJob)(void *args);
+
+void scatterJob(void *args);
+
+// Subpartition job: the second partitioning pass over one of the first pass' partitions
+typedef struct subpartition_job_args {
+  Tuple *tuples;  // The first pass' output
+  Tuple *partitioned_tuples;
+  uint32_t start;
+  uint32_t end;
+  uint32_t *offsets;  // Where the job writes the start of each of the partition's 2^nbits2 subpartitions but the first
+  CancellationToken *cancellation;
+} SubpartitionJobArgs;
+
+typedef void (*SubpartitionJob)(void *args);
+
+void subpartitionJob(void *args);
 
 // Building job
 typedef struct building_job_args {
-  HashTable *index;
+  // Where the table to insert the tuples to is. If it's NULL, the job creates it with the given capacity, so that it's
+  // first touched (and allocated on the NUMA node of) the thread that builds it, rather than the one that submits it.
+  HashTable **index;
+  uint32_t capacity;
+
   Tuple *tuples;
   uint32_t start;
   uint32_t end;
+  CancellationToken *cancellation;
 } BuildingJobArgs;
 
 typedef void (*BuildingJob)(void *args);
@@ -87,12 +165,50 @@ typedef struct join_job_args {
   uint32_t end;
   uint32_t *joined_rows_capacity;
   bool relation_R_is_smallest;
+
+  // The wide payloads of the original (unpartitioned) relations, if any
+  uint64_t *smallest_wide_payloads;
+  uint64_t *largest_wide_payloads;
+
+  CancellationToken *cancellation;
 } JoinJobArgs;
 
 typedef void (*JoinJob)(void *args);
 
 void joinJob(void *args);
 
+// Build & probe job
+typedef struct build_probe_job_args {
+  JoinRelation *result;
+  JoinRelation *smallest_rel;
+  JoinRelation *largest_rel;
+
+  // The start of each partition in the partitioned relations, followed by their sizes. These are only read when
+  // the job runs, as they may be written by the jobs it depends on.
+  uint32_t *smallest_offsets;
+  uint32_t *largest_offsets;
+
+  // The partitions to join, one after the other: [first_partition, end_partition)
+  uint32_t first_partition;
+  uint32_t end_partition;
+
+  uint32_t *joined_rows_capacity;
+  bool relation_R_is_smallest;
+  uint64_t *smallest_wide_payloads;
+  uint64_t *largest_wide_payloads;
+
+  // One reusable table per scheduler thread (indexed by currentWorkerId), allocated lazily by its first job
+  HashTable **table_pool;
+  uint32_t table_pool_size;
+
+  CancellationToken *cancellation;
+} BuildProbeJobArgs;
+
+typedef void (*BuildProbeJob)(void *args);
+
+// Builds each partition's table and probes it right away (used by FUSED_PARTITIONED_HASH_JOIN).
+void buildProbeJob(void *args);
+
 JoinRelation *mergeResults(JoinRelation **results, uint32_t num_results);
 
 #endif  // PHJOIN_H
@@ -1,9 +1,11 @@
 #ifndef QUERY_H
 #define QUERY_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#include "filter.h"
 #include "helpers.h"
 #include "relation.h"
 #include "scheduler.h"
@@ -22,8 +24,6 @@
 // The former is what we're interested in parsing, so the following definitions will allow
 // us to convert it into a representation we can easily handle.
 
-typedef enum { LT, GT, EQ } Operator;
-
 typedef struct column {
   uint32_t table;  // The actual table, e.g. in the above example "r4", represented by the value 4
   uint32_t alias;  // The alias of the table in the context of a query, e.g. the value 2 for "r4"
@@ -33,14 +33,28 @@ typedef struct column {
 // Represents expressions like 0.1 > 3000
 typedef struct filter_predicate {
   Column column;
-  uint32_t value;
+  uint64_t value;
   Operator operator;
+  double selectivity;  // The estimated fraction of the relation's rows that satisfy it (1 until estimated)
 } FilterPredicate;
 
+// Gathering the value of a selected row costs about as much as reading a cache line's worth of values sequentially.
+// So the rest of a relation's columns are only gathered for the rows that pass its most selective filter if that's
+// expected to leave fewer than 1 in GATHER_COST of them, and otherwise they're all read in the same sequential pass.
+#define GATHER_COST 8
+
+// Filters are evaluated in morsels of this many rows, which the scheduler's threads pick up in parallel
+#define FILTER_MORSEL_SIZE 65536
+
 // Represents expressions like 0.1 = 1.1
 typedef struct join_predicate {
   Column left;
   Column right;
+
+  // Whether each side's column is unique in its relation (see optimizeQuery), so that each of its rows matches at most
+  // one row of the other side, as long as they haven't been joined with another relation before
+  bool left_key;
+  bool right_key;
 } JoinPredicate;
 
 typedef struct query {
@@ -54,62 +68,88 @@ typedef struct query {
   Column projections[MAX_PROJECTIONS];
 } Query;
 
+// The intermediate result of a query's joins, stored by column: its i-th row is made up of the rows columns[alias][i]
+// of the aliases that have been joined so far, and columns[alias] is NULL for the rest. Every join knows how many rows
+// it produces before writing them, so it creates a new intermediate that holds exactly that many IDs per column, in a
+// single allocation, and fills each column in one pass (see gatherRowIDs).
+typedef struct intermediate {
+  uint32_t num_rows;
+  uint32_t num_aliases;
+  uint32_t *columns[];
+} Intermediate;
+
 // Parses the next query in the stream fp and returns a new, heap-allocated Query object that represents it.
 Query *parseQuery(FILE *fp);
 
 // -------------------
 // Note: in the following functions, "inters" refers to intermediate results produced by either a filter or a join.
 
-// Applies a number of filters to a given relation (filter_inters needs to be allocated beforehand).
+// Applies a number of filters to a given relation (filter_inters needs to be allocated beforehand). The filters on
+// each relation are fused into a single predicate (see FusedFilter), which is evaluated in one pass over its columns,
+// unless its first filter is selective enough for the rest to be checked on the remaining rows alone (see GATHER_COST).
+// The relations are filtered in the order of their first filters, which orderFilters sets up from the statistics.
 //
 // Args:
 //     relations: the source relations, as obtained by the call to mmap in loadRelation.
-//     filter_inters: the current intermediate filter results.
+//     filter_inters: where the selection of each alias is stored, with an entry per alias that's still NULL.
 //     query: the source query that contains the filters to be applied.
 //     empty_result: a write-only flag that's used to propagate nullability information to the caller.
+//     scheduler: the job scheduler whose threads scan the relations' morsels (see FILTER_MORSEL_SIZE) in parallel.
+//         If its group gets cancelled, the result is reported as empty.
 //
 // Returns:
-//     The updated intermediate results produced after applying each filter.
+//     The updated intermediate results produced after applying each filter. The row IDs of each relation are in
+//     increasing order, just as if it had been scanned by a single thread.
 
-RowIDs **applyFilters(Relation **relations, RowIDs **filter_inters, Query *query, bool *empty_result);
+RowIDs **applyFilters(
+    Relation **relations, RowIDs **filter_inters, Query *query, bool *empty_result, JobScheduler *scheduler);
 
-// Applies a number of joins to a given relation (filter_inters and join_inters need to be allocated beforehand).
+// Applies a number of joins to a given relation (filter_inters needs to be allocated beforehand).
 //
 // Args:
 //     relations: the source relations, as obtained by the call to mmap in loadRelation.
-//     join_inters: the current intermediate join results.
 //     filter_inters: the current intermediate filter results.
 //     query: the source query that contains the joins to be applied.
 //     empty_result: a write-only flag that's used to propagate nullability information to the caller.
-//     scheduler: the job scheduler to be used for multi-threading purposes.
+//     scheduler: the job scheduler to be used for multi-threading purposes. If its group gets cancelled (e.g. because
+//         the query ran out of time), the remaining joins are abandoned and the result is reported as empty.
 //
 // Returns:
-//     The updated intermediate results produced after applying each join.
+//     The intermediate result produced after applying every join, or NULL if the result is empty (or there are no
+//     joins).
 
-RowIDs **applyJoins(Relation **relations,
-                    RowIDs **join_inters,
-                    RowIDs **filter_inters,
-                    Query *query,
-                    bool *empty_result,
-                    JobScheduler *scheduler);
+Intermediate *applyJoins(
+    Relation **relations, RowIDs **filter_inters, Query *query, bool *empty_result, JobScheduler *scheduler);
 
 // Converts a sequence of row IDs into a JoinRelation object that can be used as a phjoin argument.
 //
 // Args:
-//     joined_row_ids: the current intermediate join results.
-//     filtered_row_ids: the current intermediate filter results.
+//     row_ids: the rows to read, i.e. the intermediate join or filter results of the relation, or NULL to read all of
+//         its rows.
+//     num_rows: the number of row IDs (ignored if row_ids is NULL).
 //     relation: the source relation to read for building the JoinRelation object.
 //     column: the index of the column of interest.
 //
 // Returns:
 //     A new, heap-allocated JoinRelation object with the corresponding row IDs and values for the given column.
 
-JoinRelation *buildJoinRelation(RowIDs *joined_row_ids, RowIDs *filtered_row_ids, Relation *relation, uint32_t column);
+JoinRelation *buildJoinRelation(const uint32_t *row_ids, uint32_t num_rows, Relation *relation, uint32_t column);
+
+// Returns a new, heap-allocated Intermediate object with num_rows rows, whose columns are allocated (but not filled)
+// for the aliases whose bits are set in aliases, i.e. alias i is included iff POW2(i) & aliases != 0.
+Intermediate *createIntermediate(uint32_t num_aliases, uint32_t aliases, uint32_t num_rows);
+
+// Sets target[i] to source[positions[i]] for every i < count, or to positions[i] itself if source is NULL (which stands
+// for the identity, e.g. the rows of a relation that hasn't been filtered).
+void gatherRowIDs(uint32_t *target, const uint32_t *source, const uint32_t *positions, uint32_t count);
+
+// Same as gatherRowIDs, but the positions are the keys of the given join result tuples, or their payloads.
+void gatherJoinedRowIDs(uint32_t *target, const uint32_t *source, const Tuple *tuples, uint32_t count, bool payloads);
 
 // Computes the target checksums (projections) for a given query.
 //
 // Args:
-//     join_inters: the current intermediate join results.
+//     join_inter: the intermediate join result, as returned by applyJoins.
 //     relations: the source relations, as obtained by the call to mmap in loadRelation.
 //     query: the query of interest.
 //     empty_result: a flag that's used to determine whether we should print NULL for all checksums or not.
@@ -118,7 +158,7 @@ JoinRelation *buildJoinRelation(RowIDs *joined_row_ids, RowIDs *filtered_row_ids
 //     An array of all the computed checksums, in the same order as in query. A NULL checksum is represented by 0,
 //     so it's silently assumed that we'll never have a checksum that's actually equal to this value.
 
-uint64_t *calculateChecksums(RowIDs **join_inters, Relation **relations, Query *query, bool empty_result);
+uint64_t *calculateChecksums(const Intermediate *join_inter, Relation **relations, Query *query, bool empty_result);
 
 // Writes a sequence of checksums in stream, separated by newlines, according to the SIGMOD format.
 // More info about the format can be found here: https://db.in.tum.de/sigmod18contest/task.shtml
@@ -128,4 +168,16 @@ void printChecksums(FILE *stream, uint64_t *checksums, uint32_t size);
 // Reclaims all memory used by a an intermediate result object (array of RowIDs).
 void destroyInters(RowIDs **inters, uint32_t num_relations);
 
+// Reclaims all memory used by an Intermediate object.
+void destroyIntermediate(Intermediate *inter);
+
+// A job that executes a whole query on the job scheduler, submitting its joins' jobs through its own job group.
+typedef void (*QueryJob)(void *args);
+
+// A job that evaluates a filter on a morsel of a relation.
+typedef void (*FilterJob)(void *args);
+
+// A job that applies a join on two relations that have been joined before to a morsel of their intermediate result.
+typedef void (*JoinFilterJob)(void *args);
+
 #endif  // QUERY_H
\ No newline at end of file
@@ -1,8 +1,12 @@
 #ifndef RELATION_H
 #define RELATION_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "topology.h"
+
 // This is a hard-coded value that represents the number of relations in the *small* SIGMOD workload.
 #define NUM_RELATIONS 14
 
@@ -15,18 +19,57 @@ typedef struct tuple {
   uint32_t payload;
 } Tuple;
 
+// Folds a 64-bit column value into a 32-bit tuple payload. Values that fit in 32 bits are left unchanged, so narrow
+// columns are joined exactly as before, and equal values always produce equal payloads.
+#define FOLD_PAYLOAD(value) ((uint32_t)((value) ^ ((value) >> 32)))
+
 // Temporary structure used to avoid fully materializing intermediate join results.
 typedef struct join_relation {
   Tuple *tuples;
   uint32_t num_tuples;
+
+  // If some join value doesn't fit in 32 bits, the payloads hold folded values (see FOLD_PAYLOAD) and this array holds
+  // the full ones, indexed by tuple key, so that phjoin can tell apart different values with the same payload. It's
+  // NULL for relations whose values all fit in their payloads, which is what keeps their tuples compact.
+  uint64_t *wide_payloads;
+
+  // Whether its values are all distinct, e.g. because they're the rows of a key that haven't been joined yet, which
+  // lets phjoin index them by value (see DENSE_KEY_JOIN)
+  bool unique;
 } JoinRelation;
 
+// The number of rows that each entry of a zone map covers
+#define ZONE_SIZE 4096
+
+// The smallest and largest value of a block of ZONE_SIZE rows of a column (the last block may be shorter)
+typedef struct zone {
+  uint64_t min;
+  uint64_t max;
+} Zone;
+
 // This is a wrapper around a relation that's been mapped to the process' address space.
 // Leaving these as uint64_t as they are in the original
 typedef struct relation {
   uint64_t **columns;
   uint64_t num_tuples;
   uint64_t num_columns;
+
+  // The zone map of each column (see buildZoneMaps), or NULL if they haven't been built
+  Zone **zones;
+
+  // Whether the values of each column are in nondecreasing order (see buildZoneMaps), or NULL if that's unknown
+  bool *sorted;
+
+  // The copy of the columns, if they've been copied out of the file's mapping (see interleaveRelation), or NULL
+  uint64_t *column_copy;
+
+  // The point index of each column, which is built the first time an equality filter needs it (see getPointIndex),
+  // or NULL if the relation can't have any
+  _Atomic(struct point_index *) *point_indexes;
+
+  // The bitmap index of each column (NULL for the columns with too many distinct values), or NULL if they haven't been
+  // built (see buildBitmapIndexes)
+  struct bitmap_index **bitmap_indexes;
 } Relation;
 
 // Loads a relation that corresponds to a given filename.
@@ -39,6 +82,20 @@ typedef struct relation {
 
 Relation *loadRelation(char *filename);
 
+// Builds the zone map of every column of a relation, i.e. the min and max of each of its blocks of ZONE_SIZE rows,
+// which lets filters skip the blocks where no row can pass and accept the ones where every row does without checking
+// them. Columns that are sorted, or just clustered, like the first ones of the SIGMOD relations, benefit the most.
+// Which columns are sorted is found out along the way, so that filters on them can binary search for their rows.
+void buildZoneMaps(Relation *relation);
+
+// Copies the columns of a relation to memory that's interleaved over the NUMA nodes of the given topology, so that
+// the threads of every node read them through all the nodes' memory controllers, instead of through the one of the
+// node that first read the relation's file. The copy is freed along with the relation.
+void interleaveRelation(Relation *relation, const CpuTopology *topology);
+
+// Reclaims all memory used by a Relation object that was returned by loadRelation (the file stays mapped).
+void destroyRelation(Relation *relation);
+
 // Reclaims all memory used by a JoinRelation object.
 void destroyJoinRelation(JoinRelation *join_relation);
 
@@ -2,58 +2,256 @@
 #define SCHEDULER_H
 
 #include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "deque.h"
+#include "topology.h"
+
 typedef void (*Job)(void* args);
 
-typedef enum { HISTOGRAM_JOB, BUILDING_JOB, JOIN_JOB } JobKind;
+// The largest arguments a job can have, which are stored inline in its JobInfo
+#define JOB_ARGS_SIZE 128
+
+// The number of successors a job can have before it needs to allocate an array for them
+#define INLINE_SUCCESSORS 2
+
+// The number of jobs that a group allocates at once, whenever it runs out of recycled ones
+#define JOBS_PER_SLAB 128
+
+typedef enum {
+  HISTOGRAM_JOB,
+  SCATTER_JOB,
+  SUBPARTITION_JOB,
+  BUILDING_JOB,
+  JOIN_JOB,
+  BUILD_PROBE_JOB,
+  QUERY_JOB,
+  FILTER_JOB,
+  JOIN_FILTER_JOB
+} JobKind;
 
 typedef struct job_info {
   Job job;
   void* args;
   JobKind kind;
+
+  // The group that created the job
+  struct job_scheduler* group;
+
+  // The NUMA node whose threads should preferably run the job, or -1 if any thread will do (see setJobNode)
+  int32_t node;
+
+  // The number of predecessors that haven't completed yet, plus one until the job is submitted. The job becomes
+  // runnable when this drops to zero.
+  _Atomic uint32_t pending;
+
+  // The jobs that depend on this one (see addDependency). Points to inline_successors until they don't fit.
+  struct job_info** successors;
+  uint32_t num_successors;
+  uint32_t successors_capacity;
+  struct job_info* inline_successors[INLINE_SUCCESSORS];
+
+  // Links the job in its group's lists of recycled jobs, once it has completed
+  struct job_info* next_free;
+
+  // Where args points to
+  alignas(max_align_t) unsigned char args_storage[JOB_ARGS_SIZE];
 } JobInfo;
 
+// Where a group's jobs come from, so that creating and completing jobs doesn't call malloc or free. Jobs are
+// allocated JOBS_PER_SLAB at a time, and completed jobs are pushed (by any thread, without locking) to
+// returned_jobs, which the group's client takes over as a whole once it runs out of free_jobs.
+typedef struct job_slab {
+  JobInfo* free_jobs;  // Only accessed by the thread that creates the group's jobs
+  _Atomic(JobInfo*) returned_jobs;
+
+  // Every slab of JOBS_PER_SLAB jobs, freed along with the group
+  JobInfo** slabs;
+  uint32_t num_slabs;
+  uint32_t slabs_capacity;
+} JobSlab;
+
+// Tells the jobs of a group that their work is no longer needed, e.g. because another part of their query already
+// turned out to be empty, or because it ran out of time (see cancelJobGroup and setJobGroupDeadline). Cancellation is
+// cooperative: long jobs check the token (see isCancelled) between morsels of their work and return early, so that
+// their threads are freed for other groups. Cancelled jobs still complete as usual, so waitAllJobs works the same.
+typedef struct cancellation_token {
+  _Atomic bool cancelled;
+
+  // When the token gets cancelled on its own, in nanoseconds since the epoch, or 0 if never
+  _Atomic uint64_t deadline_ns;
+} CancellationToken;
+
 typedef struct job_queue {
   JobInfo** jobs;
   uint64_t capacity;
   uint64_t front;
   uint64_t back;
+
+  // Updated under the queue's mutex, but work-stealing threads read it without locking to skip empty queues
+  _Atomic uint64_t count;
 } JobQueue;
 
-typedef struct job_scheduler {
+// How the pool's threads get their jobs:
+//
+// - SHARED_QUEUE_SCHEDULER: every job goes through a single queue, guarded by a mutex.
+// - WORK_STEALING_SCHEDULER: every thread has its own deque. Jobs submitted from outside the pool still go through
+//   the shared queue, but threads move them to their deques in batches, and idle threads steal jobs from the deques
+//   of random other threads without taking any lock. Jobs submitted by a pool thread go straight to its own deque.
+typedef enum { SHARED_QUEUE_SCHEDULER, WORK_STEALING_SCHEDULER } SchedulerBackend;
+
+typedef struct scheduler_options {
+  uint64_t execution_threads;
+  SchedulerBackend backend;
+
+  // How the threads are pinned to the CPUs. Unless it's AFFINITY_NONE, each thread is also assigned to the NUMA node
+  // of its CPU, according to the given topology (or the detected one, if it's NULL).
+  AffinityPolicy affinity;
+  const CpuTopology* topology;
+
+  // How long (in nanoseconds) an idle thread, or a thread in waitAllJobs, keeps polling before it goes to sleep.
+  // Spinning saves the cost of a wake-up when new work is only microseconds away (e.g. between the stages of a
+  // join), at the price of a busy core. With 0, threads go to sleep right away.
+  uint64_t spin_time_ns;
+} SchedulerOptions;
+
+// The spin time initializeScheduler uses: about the cost of a few wake-ups
+#define DEFAULT_SPIN_TIME_NS 50000
+
+// The threads and the job queue that are shared by all the groups of a scheduler.
+typedef struct job_pool {
   JobQueue jobs;
+  SchedulerBackend backend;
   uint64_t execution_threads;
   pthread_t* thread_ids;
-
-  // This tracks the number of jobs submitted before execute_all_jobs is called.
-  // It's useful for synchronizing the threads upon calling wait_all_tasks.
-  uint64_t job_count;
+  struct worker_args* worker_args;
 
   // When set to true, all threads will unblock and terminate their execution.
   bool terminate;
 
-  // Signifies that a thread may enter the critical section and process a batch of jobs.
-  bool is_available;
-
   // Queue synchronization
   pthread_mutex_t queue_mutex;
   pthread_cond_t queue_available;
 
+  // The number of NUMA nodes the threads are spread over, and a queue per node for the jobs that should run on it
+  // (see setJobNode). The latter is NULL if there's a single node, in which case the node of a job is ignored.
+  uint32_t num_nodes;
+  JobQueue* node_jobs;
+
+  // The topology the threads were placed on, restricted to the nodes they run on (see keepPlacedNodes), or NULL if they
+  // aren't pinned. Jobs can use it to place the memory they work on (see bindMemoryToNode) on the same node as the
+  // threads that run them.
+  CpuTopology* topology;
+
+  // Work stealing only: one deque per thread
+  WorkDeque* deques;
+
+  // The number of threads sleeping on queue_available. It's only changed under queue_mutex, but it's read without
+  // it to skip needless wake-ups (threads that are still spinning don't need one).
+  _Atomic uint64_t sleepers;
+  uint64_t spin_time_ns;
+} JobPool;
+
+// A job group: a handle through which a single client (e.g. a query) submits jobs and waits for them. Every group
+// of a scheduler feeds the same pool of threads, so jobs of concurrent groups run side by side, but waitAllJobs only
+// waits for the jobs of the group it's called with.
+typedef struct job_scheduler {
+  JobPool* pool;
+
+  // The number of threads of the pool, which jobs are usually split by
+  uint64_t execution_threads;
+
+  // This tracks the number of submitted jobs of the group that haven't completed yet.
+  // It's useful for synchronizing the threads upon calling wait_all_tasks.
+  _Atomic uint64_t job_count;
+
+  // True for the group returned by initializeScheduler, which owns the pool
+  bool owns_pool;
+
+  JobSlab job_slab;
+
+  CancellationToken cancellation;
+
   // Job count synchronization
   pthread_mutex_t job_count_mutex;
   pthread_cond_t jobs_completed;
 } JobScheduler;
 
+// Starts a pool of execution_threads threads and returns its first job group. The pool lives until destroyScheduler
+// is called with that group, so it's meant to be created once and shared, through createJobGroup.
 JobScheduler* initializeScheduler(uint64_t execution_threads);
 
+// Same as initializeScheduler, with a choice of backend (which initializeScheduler sets to SHARED_QUEUE_SCHEDULER,
+// with a spin time of defaultSpinTime()).
+JobScheduler* initializeSchedulerWithOptions(const SchedulerOptions* options);
+
+// Returns DEFAULT_SPIN_TIME_NS, or 0 on single-CPU machines, where a spinning thread would only delay the threads
+// it's waiting for.
+uint64_t defaultSpinTime(void);
+
+// Returns a new job group that shares the pool of the given scheduler (which may be any of its groups).
+// Creating a group is cheap: no threads are created.
+JobScheduler* createJobGroup(JobScheduler* scheduler);
+
+// Returns a new job of the given group that calls job(job_info->args), where args points to args_size bytes
+// (at most JOB_ARGS_SIZE) stored in the job itself, for the caller to fill in. The job is recycled by the group
+// once it completes, so neither the job nor its args should be accessed after it's submitted. A group's jobs must
+// be created by one thread at a time (e.g. the group's client, or one of its jobs while the client waits).
+JobInfo* createJob(JobScheduler* scheduler, Job job, size_t args_size, JobKind kind);
+
+// Asks for the job to run on a thread of the given NUMA node (modulo the number of nodes of the pool), e.g. because
+// it works on memory that was allocated there. The job is queued for that node's threads, which run it before the
+// jobs of other nodes, but other threads may still run it if they run out of jobs. Has no effect on pools whose
+// threads aren't pinned, or that only span a single node.
+void setJobNode(JobInfo* job_info, uint32_t node);
+
+// Declares that successor can't start before predecessor has completed. This has to be done before predecessor
+// is submitted, as it may be freed at any point after that. The two jobs may belong to different groups of the
+// same scheduler.
+void addDependency(JobInfo* predecessor, JobInfo* successor);
+
+// Queues a job of the given group (the one it was created with). Jobs without pending predecessors are picked up by
+// the pool's threads once they're woken up by executeAllJobs (or by any other group's call to it). The rest are queued
+// by the thread that completes their last predecessor, without any further calls.
 void submitJob(JobScheduler* scheduler, JobInfo* job_info);
 
 void executeAllJobs(JobScheduler* scheduler);
 
+// Blocks until all the jobs submitted through the given group have completed. When it's called by one of the pool's
+// own threads (i.e. from within a job, such as a query job waiting for its joins), the thread runs other jobs of the
+// pool while it waits, so that jobs can wait for other jobs without ever running out of threads. It never runs another
+// QUERY_JOB though, since it couldn't return until that whole query was done.
 void waitAllJobs(JobScheduler* scheduler);
 
+// Cancels the group's jobs, including the ones that are already running (see CancellationToken). It can be called
+// from any thread, including the group's own jobs. A group can't be un-cancelled, so it should be destroyed once its
+// jobs have completed.
+//
+// The joiner itself only uses deadlines: its queries run their operators one after the other, and each operator waits
+// for all of its jobs before its result (and whether it's empty) is known, so an empty result never leaves any of the
+// query's jobs behind to cancel. This is for clients that run a query's operators concurrently.
+void cancelJobGroup(JobScheduler* scheduler);
+
+// Cancels the group's jobs once time_budget_ns nanoseconds have passed from now.
+void setJobGroupDeadline(JobScheduler* scheduler, uint64_t time_budget_ns);
+
+// Returns true if the token (which may be NULL, for jobs that run outside of any group) has been cancelled, or its
+// deadline has passed. It's cheap enough to be called once per morsel of work.
+bool isCancelled(CancellationToken* token);
+
+// Returns the index (in [0, execution_threads)) of the scheduler thread that calls it, or -1 if the caller
+// wasn't created by a scheduler. Jobs can use it to access per-thread state without synchronization.
+int64_t currentWorkerId(void);
+
+// Destroys a group created by createJobGroup, whose jobs must have all completed.
+void destroyJobGroup(JobScheduler* scheduler);
+
+// Stops the pool's threads and destroys the group returned by initializeScheduler. All the other groups must have
+// been destroyed before.
 void destroyScheduler(JobScheduler* scheduler);
 
 #endif  // SCHEDULER_H
@@ -0,0 +1,92 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Where the kernel exposes the CPU and NUMA topology (see loadTopology).
+#define SYSFS_SYSTEM_ROOT "/sys/devices/system"
+
+// A logical CPU. SMT siblings share the same (package, core) pair, and rank tells them apart: the first sibling of
+// each core has rank 0, the second one rank 1 and so on.
+typedef struct cpu_info {
+  uint32_t cpu;
+  uint32_t node;  // The index of the CPU's NUMA node (see CpuTopology)
+  uint32_t package;
+  uint32_t core;
+  uint32_t rank;
+} CpuInfo;
+
+typedef struct cpu_topology {
+  uint32_t num_cpus;
+  uint32_t num_physical_cores;
+
+  // Nodes are indexed from 0 to num_nodes - 1, and node_ids holds the kernel's ID of each one (which may have gaps)
+  uint32_t num_nodes;
+  uint32_t* node_ids;
+
+  CpuInfo* cpus;  // Sorted by CPU number
+
+  // True for topologies made up by simulateTopology, whose nodes don't exist. Memory is never bound to them.
+  bool simulated;
+} CpuTopology;
+
+// How the threads of a pool are placed on the CPUs (see placeThreads):
+//
+// - AFFINITY_NONE: threads aren't pinned, and the OS is free to migrate them.
+// - AFFINITY_COMPACT: threads fill one core after the other (SMT siblings included), and one node after the other.
+// - AFFINITY_SCATTER: threads are spread over the nodes round-robin, and over the cores of each node before any
+//   core gets a second thread.
+// - AFFINITY_PHYSICAL_CORES: a thread per physical core, so that no two threads share a core (and its L2 cache).
+//   SMT siblings are only used once there are more threads than cores.
+typedef enum { AFFINITY_NONE, AFFINITY_COMPACT, AFFINITY_SCATTER, AFFINITY_PHYSICAL_CORES } AffinityPolicy;
+
+// Reads the topology of the online CPUs from a sysfs tree rooted at sysfs_root (normally SYSFS_SYSTEM_ROOT, but
+// tests can point it to a fake one). Missing information is filled in with defaults: CPUs without a core ID are
+// assumed to be cores of their own, and if there are no NUMA nodes, all CPUs belong to node 0. Returns NULL if the
+// list of online CPUs can't be read.
+CpuTopology* loadTopology(const char* sysfs_root);
+
+// Returns the topology of the CPUs the process is allowed to run on. If sysfs isn't available, every online CPU is
+// assumed to be a core of its own, on a single node.
+CpuTopology* detectTopology(void);
+
+// Returns a simulated topology with the given number of NUMA nodes, so that NUMA-aware code can be exercised on
+// single-node machines. Every CPU of the given topology becomes a core of its own, and the CPUs are split evenly
+// between the nodes. If there are fewer CPUs than nodes, they're reused, so that every node has at least one.
+CpuTopology* simulateTopology(const CpuTopology* topology, uint32_t num_nodes);
+
+CpuTopology* copyTopology(const CpuTopology* topology);
+
+// Parses a kernel CPU list (e.g. "0-3,8,10-11") into cpus, which holds up to capacity entries. Returns the number
+// of CPUs in the list, which may be larger than capacity (the rest are left out).
+uint32_t parseCpuList(const char* list, uint32_t* cpus, uint32_t capacity);
+
+// Parses the name of a policy ("none", "compact", "scatter" or "cores"). Returns false if the name isn't known.
+bool parseAffinityPolicy(const char* name, AffinityPolicy* policy);
+
+// Fills placement with the CPU that each of num_threads threads should run on, according to the policy (which
+// can't be AFFINITY_NONE). If there are more threads than CPUs, the CPUs are reused in the same order.
+void placeThreads(const CpuTopology* topology, AffinityPolicy policy, uint32_t num_threads, CpuInfo* placement);
+
+// Drops the nodes of a topology that none of the num_threads threads of a placement (see placeThreads) runs on, along
+// with their CPUs, and renumbers the rest in both, so that each node of the topology has at least one of the threads.
+void keepPlacedNodes(CpuTopology* topology, CpuInfo* placement, uint32_t num_threads);
+
+// Binds the pages that lie entirely within [memory, memory + size) to the given node of the topology, so that
+// they're allocated there when they're first touched (and moved there, if they already were). Binding is only a
+// preference: if the node runs out of memory, the pages are allocated elsewhere. Returns false if the pages couldn't
+// be bound, e.g. because the topology is simulated, or because the system doesn't support it.
+bool bindMemoryToNode(void* memory, size_t size, const CpuTopology* topology, uint32_t node);
+
+// Same as bindMemoryToNode, but spreads the pages over all the nodes of the topology, round-robin.
+bool interleaveMemory(void* memory, size_t size, const CpuTopology* topology);
+
+// Restricts the calling thread to the given CPU. Returns false if that's not possible (e.g. on systems without
+// thread affinity, or if the CPU isn't available to the process).
+bool pinCurrentThread(uint32_t cpu);
+
+void destroyTopology(CpuTopology* topology);
+
+#endif  // TOPOLOGY_H
@@ -0,0 +1,557 @@
+#include "filter.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+void initializeFusedFilter(FusedFilter *filter) {
+  filter->num_ranges = 0;
+  filter->never_holds = false;
+}
+
+void addFilterPredicate(
+    FusedFilter *filter, const uint64_t *column, const Zone *zones, Operator op, uint64_t constant) {
+  ColumnRange *range = NULL;
+
+  for (uint32_t r = 0; r < filter->num_ranges; r++) {
+    if (filter->ranges[r].column == column) {
+      range = &filter->ranges[r];
+    }
+  }
+
+  if (range == NULL) {
+    assert(filter->num_ranges < MAX_FUSED_COLUMNS);
+
+    range = &filter->ranges[filter->num_ranges++];
+    range->column = column;
+    range->zones = zones;
+    range->low = 0;
+    range->high = UINT64_MAX;
+  }
+
+  // Nothing is smaller than 0 or greater than UINT64_MAX, so those predicates can't hold for any row
+  if ((op == LT && constant == 0) || (op == GT && constant == UINT64_MAX)) {
+    filter->never_holds = true;
+    return;
+  }
+
+  uint64_t low = op == GT ? constant + 1 : op == EQ ? constant : 0;
+  uint64_t high = op == LT ? constant - 1 : op == EQ ? constant : UINT64_MAX;
+
+  range->low = low > range->low ? low : range->low;
+  range->high = high < range->high ? high : range->high;
+
+  if (range->low > range->high) {
+    filter->never_holds = true;
+  }
+}
+
+// Returns the first of the rows [start, end) of a sorted column whose value is at least the given one (end if none)
+static uint32_t lowerBound(const uint64_t *column, uint32_t start, uint32_t end, uint64_t value) {
+  while (start < end) {
+    uint32_t middle = start + (end - start) / 2;
+
+    if (column[middle] < value) {
+      start = middle + 1;
+    } else {
+      end = middle;
+    }
+  }
+
+  return start;
+}
+
+void findSortedRows(const ColumnRange *range, uint32_t *start, uint32_t *end) {
+  if (range->low > range->high) {
+    *end = *start;
+    return;
+  }
+
+  uint32_t first = lowerBound(range->column, *start, *end, range->low);
+  *end = range->high == UINT64_MAX ? *end : lowerBound(range->column, first, *end, range->high + 1);
+  *start = first;
+}
+
+ZoneMatch matchZone(const FusedFilter *filter, uint32_t zone) {
+  if (filter->never_holds) {
+    return ZONE_NONE;
+  }
+
+  ZoneMatch match = ZONE_ALL;
+
+  for (uint32_t r = 0; r < filter->num_ranges; r++) {
+    const ColumnRange *range = &filter->ranges[r];
+
+    if (range->zones == NULL) {
+      match = ZONE_SOME;
+      continue;
+    }
+
+    const Zone *values = &range->zones[zone];
+
+    if (values->max < range->low || values->min > range->high) {
+      return ZONE_NONE;
+    }
+
+    if (values->min < range->low || values->max > range->high) {
+      match = ZONE_SOME;
+    }
+  }
+
+  return match;
+}
+
+// Every kernel writes the ID of each row it looks at to the next position of the selection, and only advances that
+// position if the row passes the filter. This trades a store per row for the branch mispredictions that filters of
+// medium selectivity would otherwise cause. All the columns are checked for every row (rather than stopping at the
+// first range that fails), so that each of them is read sequentially, in a single pass.
+//
+// A value is in [low, high] iff value - low <= high - low (in unsigned arithmetic, where values below low wrap around
+// to large ones), so each range is checked with a single comparison.
+
+static inline uint32_t passes(const FusedFilter *filter, uint32_t row_id) {
+  uint32_t pass = 1;
+
+  for (uint32_t r = 0; r < filter->num_ranges; r++) {
+    const ColumnRange *range = &filter->ranges[r];
+    pass &= range->column[row_id] - range->low <= range->high - range->low;
+  }
+
+  return pass;
+}
+
+static uint32_t selectScalar(const FusedFilter *filter, uint32_t start, uint32_t end, uint32_t *selection) {
+  uint32_t n = 0;
+
+  for (uint32_t i = start; i < end; i++) {
+    selection[n] = i;
+    n += passes(filter, i);
+  }
+
+  return n;
+}
+
+static uint32_t refineScalar(const FusedFilter *filter, const uint32_t *selection, uint32_t count, uint32_t *refined) {
+  uint32_t n = 0;
+
+  // The row ID is read before it's written, so that refined can be selection itself
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t row_id = selection[i];
+
+    refined[n] = row_id;
+    n += passes(filter, row_id);
+  }
+
+  return n;
+}
+
+// The rows of a join on two columns that have both been joined before line up by position, so the join is checked on
+// each position, by gathering its pair of values through the two columns' row IDs. Those values are already in the
+// caches if the same rows were gathered for the join's inputs, but the row IDs are random, so there's no order to
+// exploit, and the kernels only vectorize the gathers and the comparisons.
+
+static uint32_t selectEqualScalar(const uint64_t *left_column,
+                                  const uint32_t *left_ids,
+                                  const uint64_t *right_column,
+                                  const uint32_t *right_ids,
+                                  uint32_t start,
+                                  uint32_t end,
+                                  uint32_t *selection) {
+  uint32_t n = 0;
+
+  for (uint32_t i = start; i < end; i++) {
+    selection[n] = i;
+    n += left_column[left_ids[i]] == right_column[right_ids[i]];
+  }
+
+  return n;
+}
+
+#if defined(__x86_64__)
+
+// AVX2: 4 rows at a time. AVX2 has no unsigned 64-bit comparisons, so both sides of the range check get their sign bit
+// flipped and are compared as signed integers, which preserves their unsigned order. The selected lanes are packed
+// with a permutation looked up by the mask of the rows that passed, and stored all at once.
+
+// The lanes of the set bits of each 4-bit mask, followed by don't-cares
+static const int32_t compress_lanes[16][4] = {{0, 0, 0, 0}, {0, 0, 0, 0}, {1, 0, 0, 0}, {0, 1, 0, 0},
+                                              {2, 0, 0, 0}, {0, 2, 0, 0}, {1, 2, 0, 0}, {0, 1, 2, 0},
+                                              {3, 0, 0, 0}, {0, 3, 0, 0}, {1, 3, 0, 0}, {0, 1, 3, 0},
+                                              {2, 3, 0, 0}, {0, 2, 3, 0}, {1, 2, 3, 0}, {0, 1, 2, 3}};
+
+// The lows and the (flipped) widths of a filter's ranges, broadcast to every lane
+typedef struct {
+  __m256i lows[MAX_FUSED_COLUMNS];
+  __m256i widths[MAX_FUSED_COLUMNS];
+} Avx2Ranges;
+
+__attribute__((target("avx2"))) static inline void broadcastAvx2(const FusedFilter *filter, Avx2Ranges *ranges) {
+  for (uint32_t r = 0; r < filter->num_ranges; r++) {
+    ranges->lows[r] = _mm256_set1_epi64x((int64_t)filter->ranges[r].low);
+    ranges->widths[r] =
+        _mm256_set1_epi64x((int64_t)((filter->ranges[r].high - filter->ranges[r].low) ^ ((uint64_t)1 << 63)));
+  }
+}
+
+// Returns the mask of the lanes whose values are in the range
+__attribute__((target("avx2"))) static inline uint32_t inRangeAvx2(__m256i values, __m256i low, __m256i width) {
+  __m256i offsets = _mm256_xor_si256(_mm256_sub_epi64(values, low), _mm256_set1_epi64x(INT64_MIN));
+  __m256i outside = _mm256_cmpgt_epi64(offsets, width);
+
+  return ~(uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(outside)) & 0xF;
+}
+
+__attribute__((target("avx2"))) static uint32_t selectAvx2(const FusedFilter *filter,
+                                                           uint32_t start,
+                                                           uint32_t end,
+                                                           uint32_t *selection) {
+  Avx2Ranges ranges;
+  broadcastAvx2(filter, &ranges);
+
+  uint32_t n = 0, i = start;
+
+  for (; end - i >= 4; i += 4) {
+    uint32_t mask = 0xF;
+
+    for (uint32_t r = 0; r < filter->num_ranges; r++) {
+      __m256i values = _mm256_loadu_si256((const __m256i *)(filter->ranges[r].column + i));
+      mask &= inRangeAvx2(values, ranges.lows[r], ranges.widths[r]);
+    }
+
+    __m128i lanes = _mm_loadu_si128((const __m128i *)compress_lanes[mask]);
+    _mm_storeu_si128((__m128i *)(selection + n), _mm_add_epi32(_mm_set1_epi32((int32_t)i), lanes));
+
+    n += (uint32_t)__builtin_popcount(mask);
+  }
+
+  return n + selectScalar(filter, i, end, selection + n);
+}
+
+__attribute__((target("avx2"))) static uint32_t refineAvx2(const FusedFilter *filter,
+                                                           const uint32_t *selection,
+                                                           uint32_t count,
+                                                           uint32_t *refined) {
+  Avx2Ranges ranges;
+  broadcastAvx2(filter, &ranges);
+
+  uint32_t n = 0, i = 0;
+
+  // The stores only reach the row IDs that were already loaded, so refined can be selection itself
+  for (; count - i >= 4; i += 4) {
+    __m128i row_ids = _mm_loadu_si128((const __m128i *)(selection + i));
+    uint32_t mask = 0xF;
+
+    for (uint32_t r = 0; r < filter->num_ranges; r++) {
+      __m256i values = _mm256_i32gather_epi64((const long long *)filter->ranges[r].column, row_ids, 8);
+      mask &= inRangeAvx2(values, ranges.lows[r], ranges.widths[r]);
+    }
+
+    __m128i lanes = _mm_loadu_si128((const __m128i *)compress_lanes[mask]);
+    __m128 packed = _mm_permutevar_ps(_mm_castsi128_ps(row_ids), lanes);
+    _mm_storeu_si128((__m128i *)(refined + n), _mm_castps_si128(packed));
+
+    n += (uint32_t)__builtin_popcount(mask);
+  }
+
+  return n + refineScalar(filter, selection + i, count - i, refined + n);
+}
+
+// AVX-512: 8 rows at a time, with native unsigned comparisons that produce a mask, and a compress instruction that
+// packs the selected lanes. The packed IDs are stored with a plain store, which is much faster than a compressing
+// store on some CPUs.
+
+typedef struct {
+  __m512i lows[MAX_FUSED_COLUMNS];
+  __m512i widths[MAX_FUSED_COLUMNS];
+} Avx512Ranges;
+
+__attribute__((target("avx512f,avx512vl"))) static inline void broadcastAvx512(const FusedFilter *filter,
+                                                                                Avx512Ranges *ranges) {
+  for (uint32_t r = 0; r < filter->num_ranges; r++) {
+    ranges->lows[r] = _mm512_set1_epi64((int64_t)filter->ranges[r].low);
+    ranges->widths[r] = _mm512_set1_epi64((int64_t)(filter->ranges[r].high - filter->ranges[r].low));
+  }
+}
+
+__attribute__((target("avx512f,avx512vl"))) static uint32_t selectAvx512(const FusedFilter *filter,
+                                                                         uint32_t start,
+                                                                         uint32_t end,
+                                                                         uint32_t *selection) {
+  Avx512Ranges ranges;
+  broadcastAvx512(filter, &ranges);
+
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  uint32_t n = 0, i = start;
+
+  for (; end - i >= 8; i += 8) {
+    __mmask8 mask = 0xFF;
+
+    for (uint32_t r = 0; r < filter->num_ranges; r++) {
+      __m512i offsets = _mm512_sub_epi64(_mm512_loadu_si512(filter->ranges[r].column + i), ranges.lows[r]);
+      mask = _mm512_mask_cmple_epu64_mask(mask, offsets, ranges.widths[r]);
+    }
+
+    __m256i row_ids = _mm256_add_epi32(_mm256_set1_epi32((int32_t)i), lanes);
+    _mm256_storeu_si256((__m256i *)(selection + n), _mm256_maskz_compress_epi32(mask, row_ids));
+
+    n += (uint32_t)__builtin_popcount(mask);
+  }
+
+  return n + selectScalar(filter, i, end, selection + n);
+}
+
+__attribute__((target("avx512f,avx512vl"))) static uint32_t refineAvx512(const FusedFilter *filter,
+                                                                         const uint32_t *selection,
+                                                                         uint32_t count,
+                                                                         uint32_t *refined) {
+  Avx512Ranges ranges;
+  broadcastAvx512(filter, &ranges);
+
+  uint32_t n = 0, i = 0;
+
+  for (; count - i >= 8; i += 8) {
+    __m256i row_ids = _mm256_loadu_si256((const __m256i *)(selection + i));
+    __mmask8 mask = 0xFF;
+
+    for (uint32_t r = 0; r < filter->num_ranges; r++) {
+      __m512i values = _mm512_i32gather_epi64(row_ids, filter->ranges[r].column, 8);
+      mask = _mm512_mask_cmple_epu64_mask(mask, _mm512_sub_epi64(values, ranges.lows[r]), ranges.widths[r]);
+    }
+
+    _mm256_storeu_si256((__m256i *)(refined + n), _mm256_maskz_compress_epi32(mask, row_ids));
+
+    n += (uint32_t)__builtin_popcount(mask);
+  }
+
+  return n + refineScalar(filter, selection + i, count - i, refined + n);
+}
+
+__attribute__((target("avx2"))) static uint32_t selectEqualAvx2(const uint64_t *left_column,
+                                                                const uint32_t *left_ids,
+                                                                const uint64_t *right_column,
+                                                                const uint32_t *right_ids,
+                                                                uint32_t start,
+                                                                uint32_t end,
+                                                                uint32_t *selection) {
+  uint32_t n = 0, i = start;
+
+  for (; end - i >= 4; i += 4) {
+    __m128i left_row_ids = _mm_loadu_si128((const __m128i *)(left_ids + i));
+    __m128i right_row_ids = _mm_loadu_si128((const __m128i *)(right_ids + i));
+
+    __m256i left_values = _mm256_i32gather_epi64((const long long *)left_column, left_row_ids, 8);
+    __m256i right_values = _mm256_i32gather_epi64((const long long *)right_column, right_row_ids, 8);
+    __m256i equal = _mm256_cmpeq_epi64(left_values, right_values);
+    uint32_t mask = (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(equal));
+
+    __m128i lanes = _mm_loadu_si128((const __m128i *)compress_lanes[mask]);
+    _mm_storeu_si128((__m128i *)(selection + n), _mm_add_epi32(_mm_set1_epi32((int32_t)i), lanes));
+
+    n += (uint32_t)__builtin_popcount(mask);
+  }
+
+  return n + selectEqualScalar(left_column, left_ids, right_column, right_ids, i, end, selection + n);
+}
+
+__attribute__((target("avx512f,avx512vl"))) static uint32_t selectEqualAvx512(const uint64_t *left_column,
+                                                                              const uint32_t *left_ids,
+                                                                              const uint64_t *right_column,
+                                                                              const uint32_t *right_ids,
+                                                                              uint32_t start,
+                                                                              uint32_t end,
+                                                                              uint32_t *selection) {
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  uint32_t n = 0, i = start;
+
+  for (; end - i >= 8; i += 8) {
+    __m256i left_row_ids = _mm256_loadu_si256((const __m256i *)(left_ids + i));
+    __m256i right_row_ids = _mm256_loadu_si256((const __m256i *)(right_ids + i));
+
+    __m512i left_values = _mm512_i32gather_epi64(left_row_ids, left_column, 8);
+    __m512i right_values = _mm512_i32gather_epi64(right_row_ids, right_column, 8);
+    __mmask8 mask = _mm512_cmpeq_epu64_mask(left_values, right_values);
+
+    __m256i positions = _mm256_add_epi32(_mm256_set1_epi32((int32_t)i), lanes);
+    _mm256_storeu_si256((__m256i *)(selection + n), _mm256_maskz_compress_epi32(mask, positions));
+
+    n += (uint32_t)__builtin_popcount(mask);
+  }
+
+  return n + selectEqualScalar(left_column, left_ids, right_column, right_ids, i, end, selection + n);
+}
+
+#endif  // defined(__x86_64__)
+
+FilterIsa detectFilterIsa(void) {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")) {
+    return FILTER_AVX512;
+  }
+
+  if (__builtin_cpu_supports("avx2")) {
+    return FILTER_AVX2;
+  }
+#endif
+
+  return FILTER_SCALAR;
+}
+
+bool filterIsaSupported(FilterIsa isa) {
+  return isa <= detectFilterIsa();
+}
+
+uint32_t selectFusedRowsWith(
+    FilterIsa isa, const FusedFilter *filter, uint32_t start, uint32_t end, uint32_t *selection) {
+  assert(filterIsaSupported(isa));
+
+  if (filter->never_holds) {
+    return 0;
+  }
+
+  switch (isa) {
+#if defined(__x86_64__)
+    case FILTER_AVX512:
+      return selectAvx512(filter, start, end, selection);
+    case FILTER_AVX2:
+      return selectAvx2(filter, start, end, selection);
+#endif
+    default:
+      return selectScalar(filter, start, end, selection);
+  }
+}
+
+uint32_t refineFusedSelectionWith(
+    FilterIsa isa, const FusedFilter *filter, const uint32_t *selection, uint32_t count, uint32_t *refined) {
+  assert(filterIsaSupported(isa));
+
+  if (filter->never_holds) {
+    return 0;
+  }
+
+  switch (isa) {
+#if defined(__x86_64__)
+    case FILTER_AVX512:
+      return refineAvx512(filter, selection, count, refined);
+    case FILTER_AVX2:
+      return refineAvx2(filter, selection, count, refined);
+#endif
+    default:
+      return refineScalar(filter, selection, count, refined);
+  }
+}
+
+uint32_t selectEqualRowsWith(FilterIsa isa,
+                             const uint64_t *left_column,
+                             const uint32_t *left_ids,
+                             const uint64_t *right_column,
+                             const uint32_t *right_ids,
+                             uint32_t start,
+                             uint32_t end,
+                             uint32_t *selection) {
+  assert(filterIsaSupported(isa));
+
+  switch (isa) {
+#if defined(__x86_64__)
+    case FILTER_AVX512:
+      return selectEqualAvx512(left_column, left_ids, right_column, right_ids, start, end, selection);
+    case FILTER_AVX2:
+      return selectEqualAvx2(left_column, left_ids, right_column, right_ids, start, end, selection);
+#endif
+    default:
+      return selectEqualScalar(left_column, left_ids, right_column, right_ids, start, end, selection);
+  }
+}
+
+uint32_t selectFusedRows(const FusedFilter *filter, uint32_t start, uint32_t end, uint32_t *selection) {
+  return selectFusedRowsWith(detectFilterIsa(), filter, start, end, selection);
+}
+
+uint32_t refineFusedSelection(const FusedFilter *filter, const uint32_t *selection, uint32_t count, uint32_t *refined) {
+  return refineFusedSelectionWith(detectFilterIsa(), filter, selection, count, refined);
+}
+
+uint32_t selectEqualRows(const uint64_t *left_column,
+                         const uint32_t *left_ids,
+                         const uint64_t *right_column,
+                         const uint32_t *right_ids,
+                         uint32_t start,
+                         uint32_t end,
+                         uint32_t *selection) {
+  return selectEqualRowsWith(detectFilterIsa(), left_column, left_ids, right_column, right_ids, start, end, selection);
+}
+
+uint32_t selectFusedRowsByZone(
+    const FusedFilter *filter, uint32_t start, uint32_t end, uint32_t *selection, uint64_t *zone_counts) {
+  FilterIsa isa = detectFilterIsa();
+  uint32_t n = 0;
+
+  for (uint32_t zone_start = start; zone_start < end;) {
+    uint32_t zone = zone_start / ZONE_SIZE;
+    uint64_t next_zone_start = (uint64_t)(zone + 1) * ZONE_SIZE;
+    uint32_t zone_end = next_zone_start < end ? (uint32_t)next_zone_start : end;
+    ZoneMatch match = matchZone(filter, zone);
+
+    // Whatever a kernel writes past the zone's selected rows is still within the rows that were looked at
+    if (match == ZONE_SOME) {
+      n += selectFusedRowsWith(isa, filter, zone_start, zone_end, selection + n);
+    } else if (match == ZONE_ALL) {
+      for (uint32_t i = zone_start; i < zone_end; i++) {
+        selection[n++] = i;
+      }
+    }
+
+    if (zone_counts != NULL) {
+      zone_counts[match]++;
+    }
+
+    zone_start = zone_end;
+  }
+
+  return n;
+}
+
+uint32_t selectRowsWith(FilterIsa isa,
+                        const uint64_t *column,
+                        uint32_t start,
+                        uint32_t end,
+                        Operator op,
+                        uint64_t constant,
+                        uint32_t *selection) {
+  FusedFilter filter;
+  initializeFusedFilter(&filter);
+  addFilterPredicate(&filter, column, NULL, op, constant);
+
+  return selectFusedRowsWith(isa, &filter, start, end, selection);
+}
+
+uint32_t refineSelectionWith(FilterIsa isa,
+                             const uint64_t *column,
+                             const uint32_t *selection,
+                             uint32_t count,
+                             Operator op,
+                             uint64_t constant,
+                             uint32_t *refined) {
+  FusedFilter filter;
+  initializeFusedFilter(&filter);
+  addFilterPredicate(&filter, column, NULL, op, constant);
+
+  return refineFusedSelectionWith(isa, &filter, selection, count, refined);
+}
+
+uint32_t selectRows(
+    const uint64_t *column, uint32_t start, uint32_t end, Operator op, uint64_t constant, uint32_t *selection) {
+  return selectRowsWith(detectFilterIsa(), column, start, end, op, constant, selection);
+}
+
+uint32_t refineSelection(const uint64_t *column,
+                         const uint32_t *selection,
+                         uint32_t count,
+                         Operator op,
+                         uint64_t constant,
+                         uint32_t *refined) {
+  return refineSelectionWith(detectFilterIsa(), column, selection, count, op, constant, refined);
+}
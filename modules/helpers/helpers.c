@@ -42,6 +42,28 @@ void addRowID(uint32_t id, RowIDs **row_ids) {
   (*row_ids)->ids[(*row_ids)->count++] = id;
 }
 
+void appendRowIDs(const uint32_t *ids, uint32_t count, RowIDs **row_ids) {
+  if (count == 0) {
+    return;
+  }
+
+  if (*row_ids == NULL) {
+    *row_ids = memAlloc(sizeof(RowIDs), 1, false, NULL);
+    (*row_ids)->count = 0;
+    (*row_ids)->capacity = count > 512 ? count : 512;
+    (*row_ids)->ids = memAlloc(sizeof(uint32_t), (*row_ids)->capacity, false, NULL);
+  } else if ((*row_ids)->capacity - (*row_ids)->count < count) {
+    while ((*row_ids)->capacity - (*row_ids)->count < count) {
+      (*row_ids)->capacity *= 2;
+    }
+
+    (*row_ids)->ids = memAlloc(sizeof(uint32_t), (*row_ids)->capacity, false, (*row_ids)->ids);
+  }
+
+  memcpy((*row_ids)->ids + (*row_ids)->count, ids, count * sizeof(uint32_t));
+  (*row_ids)->count += count;
+}
+
 uint32_t gtePow2(uint32_t number) {
   // If the number is already a power of two, return it
   if (number != 0 && (number & (number - 1)) == 0)
@@ -78,6 +100,13 @@ uint32_t getL2CacheSize(void) {
 #endif
 }
 
+uint32_t getNumCores(void) {
+  long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  // Default to a single core if the number can't be determined
+  return num_cores > 0 ? (uint32_t)num_cores : 1;
+}
+
 uint32_t maxArray(uint32_t *array, uint32_t length) {
   uint32_t max = 0;
 
@@ -90,15 +119,15 @@ uint32_t maxArray(uint32_t *array, uint32_t length) {
 
 void destroyRowIDs(RowIDs *row_ids) {
   if (row_ids != NULL) {
-    if (row_ids->count > 0) {
-      free(row_ids->ids);
-    }
+    free(row_ids->ids);
     free(row_ids);
   }
 }
 
 int compareUints(const void *a, const void *b) {
-  return (*(uint64_t *)a - *(uint64_t *)b);
+  // The difference of the values may not fit in an int (or may wrap around), so they're compared instead
+  uint64_t value_a = *(const uint64_t *)a, value_b = *(const uint64_t *)b;
+  return (value_a > value_b) - (value_a < value_b);
 }
 
 // Distinct function with nlogn instead of n^2 complexity
@@ -78,7 +78,11 @@ static void rehash(HashTable *table) {
   table->size = 0;       // Reset the size so that insert updates it accordingly
   table->capacity *= 2;  // Double the number of buckets upon rehashing
 
+  uint32_t old_num_allocated = table->num_allocated;
+
   table->buckets = memAlloc(sizeof(Bucket), table->capacity, true, NULL);
+  table->num_allocated = table->capacity;
+
   for (uint32_t i = 0; i < old_capacity; i++) {
     uint32_t num_payloads = numPayloads(old_buckets[i].row_ids);
 
@@ -86,11 +90,11 @@ static void rehash(HashTable *table) {
       Tuple tuple = {.key = old_buckets[i].row_ids->ids[j], .payload = old_buckets[i].payload};
       insert(table, &tuple);
     }
+  }
 
-    if (num_payloads > 0) {
-      free(old_buckets[i].row_ids->ids);
-    }
-    free(old_buckets[i].row_ids);  // No problem here; if row_ids is NULL then this is a no-op
+  // Buckets past the old capacity may still hold (empty) row ID chains from before the table was last reset
+  for (uint32_t i = 0; i < old_num_allocated; i++) {
+    destroyRowIDs(old_buckets[i].row_ids);
   }
 
   free(old_buckets);
@@ -102,18 +106,45 @@ HashTable *createHashTable(uint32_t capacity, uint32_t neighbourhood_size) {
 
   table->size = 0;
   table->capacity = capacity;
+  table->num_allocated = capacity;
   table->neighbourhood_size = neighbourhood_size;
 
   return table;
 }
 
-void destroyHashTable(HashTable *table) {
-  for (uint32_t i = 0; i < table->capacity; i++) {
-    if (numPayloads(table->buckets[i].row_ids) > 0) {
-      free(table->buckets[i].row_ids->ids);
+void resetHashTable(HashTable *table, uint32_t capacity) {
+  // Not enough buckets for the requested capacity, so replace them altogether
+  if (capacity > table->num_allocated) {
+    for (uint32_t i = 0; i < table->num_allocated; i++) {
+      destroyRowIDs(table->buckets[i].row_ids);
     }
 
-    free(table->buckets[i].row_ids);  // No problem here; if row_ids is NULL then this is a no-op
+    free(table->buckets);
+
+    table->buckets = memAlloc(sizeof(Bucket), capacity, true, NULL);
+    table->num_allocated = capacity;
+
+    // Otherwise, only the buckets that were in use need to be emptied. Their row ID chains are kept around (with a
+    // count of zero, which marks a bucket as empty) so that the next insertions into them don't need to allocate
+  } else {
+    for (uint32_t i = 0; i < table->capacity; i++) {
+      if (table->buckets[i].row_ids != NULL) {
+        table->buckets[i].row_ids->count = 0;
+      }
+
+      table->buckets[i].key = 0;
+      table->buckets[i].payload = 0;
+      table->buckets[i].bitmap = 0;
+    }
+  }
+
+  table->size = 0;
+  table->capacity = capacity;
+}
+
+void destroyHashTable(HashTable *table) {
+  for (uint32_t i = 0; i < table->num_allocated; i++) {
+    destroyRowIDs(table->buckets[i].row_ids);  // No problem here; if row_ids is NULL then this is a no-op
   }
 
   free(table->buckets);
@@ -134,6 +165,9 @@ static void swap(HashTable *table, uint32_t empty_slot) {
 
     // If key is within the range of the neighbourhood of the empty slot
     if (bucket_distance < table->neighbourhood_size) {
+      // The empty bucket might hold an unused row ID chain after a reset, so hand it over to the bucket we're emptying
+      RowIDs *spare_row_ids = table->buckets[empty_slot].row_ids;
+
       // Fill the empty bucket
       table->buckets[empty_slot].key = table->buckets[examine_slot].key;
       table->buckets[empty_slot].payload = table->buckets[examine_slot].payload;
@@ -149,7 +183,7 @@ static void swap(HashTable *table, uint32_t empty_slot) {
 
       // For house keeping "empty" the bucket information
       table->buckets[examine_slot].key = 0;
-      table->buckets[examine_slot].row_ids = NULL;
+      table->buckets[examine_slot].row_ids = spare_row_ids;
 
       break;
     }
@@ -270,10 +304,8 @@ RowIDs *search(HashTable *table, uint32_t value) {
     Bucket *bucket = &table->buckets[i % table->capacity];
     uint32_t num_payloads = numPayloads(bucket->row_ids);
 
-    if (bucket->payload == value) {
-      for (uint32_t j = 0; j < num_payloads; j++) {
-        addRowID(bucket->row_ids->ids[j], &matches);
-      }
+    if (bucket->payload == value && num_payloads > 0) {
+      appendRowIDs(bucket->row_ids->ids, num_payloads, &matches);
     }
   }
 
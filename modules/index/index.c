@@ -0,0 +1,304 @@
+#include "index.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "helpers.h"
+
+// The memory that the point indexes may take, and how much of it has been reserved by the ones that were built (or
+// are being built)
+static _Atomic uint64_t point_index_budget = DEFAULT_POINT_INDEX_BUDGET;
+static _Atomic uint64_t point_index_memory = 0;
+
+// The number of words of the bitmaps that are combined at a time (see selectRowsByBitmaps)
+#define BITMAP_BLOCK_WORDS 64
+
+typedef struct index_entry {
+  uint64_t value;
+  uint32_t row_id;
+} IndexEntry;
+
+static int compareEntries(const void *a, const void *b) {
+  const IndexEntry *entry_a = a, *entry_b = b;
+
+  if (entry_a->value != entry_b->value) {
+    return entry_a->value < entry_b->value ? -1 : 1;
+  }
+
+  return entry_a->row_id < entry_b->row_id ? -1 : entry_a->row_id > entry_b->row_id;
+}
+
+// The most memory that the index of a column with num_tuples rows can take, i.e. if all its values are distinct
+static uint64_t maxIndexSize(uint32_t num_tuples) {
+  return (uint64_t)num_tuples * (sizeof(uint64_t) + 2 * sizeof(uint32_t)) + sizeof(uint32_t);
+}
+
+// Returns the position of the first of the sorted values that's not smaller than the given one (num_values if none)
+static uint32_t findValue(const uint64_t *values, uint32_t num_values, uint64_t value) {
+  uint32_t low = 0, high = num_values;
+
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+
+    if (values[middle] < value) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+void setPointIndexBudget(uint64_t budget) {
+  point_index_budget = budget;
+}
+
+uint64_t pointIndexMemory(void) {
+  return point_index_memory;
+}
+
+PointIndex *buildPointIndex(const uint64_t *column, uint32_t num_tuples) {
+  PointIndex *index = memAlloc(sizeof(PointIndex), 1, false, NULL);
+
+  // Sort the rows by value, and then by row ID, so that each value's rows end up next to each other, in order
+  IndexEntry *entries = memAlloc(sizeof(IndexEntry), num_tuples > 0 ? num_tuples : 1, false, NULL);
+  for (uint32_t i = 0; i < num_tuples; i++) {
+    entries[i] = (IndexEntry){.value = column[i], .row_id = i};
+  }
+
+  qsort(entries, num_tuples, sizeof(IndexEntry), compareEntries);
+
+  index->num_values = 0;
+  for (uint32_t i = 0; i < num_tuples; i++) {
+    index->num_values += i == 0 || entries[i].value != entries[i - 1].value;
+  }
+
+  index->values = memAlloc(sizeof(uint64_t), index->num_values > 0 ? index->num_values : 1, false, NULL);
+  index->offsets = memAlloc(sizeof(uint32_t), index->num_values + 1, false, NULL);
+  index->row_ids = memAlloc(sizeof(uint32_t), num_tuples > 0 ? num_tuples : 1, false, NULL);
+
+  for (uint32_t i = 0, value = 0; i < num_tuples; i++) {
+    if (i == 0 || entries[i].value != entries[i - 1].value) {
+      index->values[value] = entries[i].value;
+      index->offsets[value++] = i;
+    }
+
+    index->row_ids[i] = entries[i].row_id;
+  }
+
+  index->offsets[index->num_values] = num_tuples;
+  index->size = (uint64_t)index->num_values * (sizeof(uint64_t) + sizeof(uint32_t)) + sizeof(uint32_t) +
+                (uint64_t)num_tuples * sizeof(uint32_t);
+
+  free(entries);
+
+  return index;
+}
+
+PointIndex *getPointIndex(Relation *relation, uint32_t column) {
+  assert(column < relation->num_columns && relation->num_tuples <= UINT32_MAX);
+
+  if (relation->point_indexes == NULL) {
+    return NULL;
+  }
+
+  PointIndex *index = atomic_load(&relation->point_indexes[column]);
+  if (index != NULL) {
+    return index;
+  }
+
+  // Reserve as much memory as the index might take before building it, so that concurrent builds can't exceed the
+  // budget together, and give back what it didn't need afterwards
+  uint32_t num_tuples = (uint32_t)relation->num_tuples;
+  uint64_t reserved = maxIndexSize(num_tuples);
+
+  if (atomic_fetch_add(&point_index_memory, reserved) + reserved > point_index_budget) {
+    atomic_fetch_sub(&point_index_memory, reserved);
+    return NULL;
+  }
+
+  PointIndex *built = buildPointIndex(relation->columns[column], num_tuples);
+  atomic_fetch_sub(&point_index_memory, reserved - built->size);
+
+  // Another query may have built the same index in the meantime, in which case that one is used instead
+  if (!atomic_compare_exchange_strong(&relation->point_indexes[column], &index, built)) {
+    atomic_fetch_sub(&point_index_memory, built->size);
+    destroyPointIndex(built);
+    return index;
+  }
+
+  return built;
+}
+
+uint32_t lookupPointIndex(const PointIndex *index, uint64_t value, const uint32_t **row_ids) {
+  uint32_t low = findValue(index->values, index->num_values, value);
+
+  if (low == index->num_values || index->values[low] != value) {
+    *row_ids = index->row_ids;
+    return 0;
+  }
+
+  *row_ids = index->row_ids + index->offsets[low];
+  return index->offsets[low + 1] - index->offsets[low];
+}
+
+BitmapIndex *buildBitmapIndex(const uint64_t *column, uint32_t num_tuples, uint32_t max_values) {
+  // Find the distinct values, keeping them sorted, and give up as soon as there are too many of them
+  uint64_t *values = memAlloc(sizeof(uint64_t), max_values + 1, false, NULL);
+  uint32_t num_values = 0;
+
+  for (uint32_t i = 0; i < num_tuples; i++) {
+    uint32_t position = findValue(values, num_values, column[i]);
+
+    if (position < num_values && values[position] == column[i]) {
+      continue;
+    }
+
+    if (num_values == max_values) {
+      free(values);
+      return NULL;
+    }
+
+    memmove(values + position + 1, values + position, (num_values - position) * sizeof(uint64_t));
+    values[position] = column[i];
+    num_values++;
+  }
+
+  BitmapIndex *index = memAlloc(sizeof(BitmapIndex), 1, false, NULL);
+  index->values = values;
+  index->num_values = num_values;
+  index->num_words = (num_tuples + 63) / 64;
+  index->bitmaps = memAlloc(sizeof(uint64_t), num_values * index->num_words + 1, true, NULL);
+
+  for (uint32_t i = 0; i < num_tuples; i++) {
+    uint32_t value = findValue(values, num_values, column[i]);
+    index->bitmaps[value * index->num_words + i / 64] |= (uint64_t)1 << (i % 64);
+  }
+
+  return index;
+}
+
+void buildBitmapIndexes(Relation *relation, uint32_t max_values) {
+  assert(relation->num_tuples <= UINT32_MAX);
+
+  relation->bitmap_indexes = memAlloc(sizeof(BitmapIndex *), relation->num_columns, false, NULL);
+
+  for (uint64_t column = 0; column < relation->num_columns; column++) {
+    relation->bitmap_indexes[column] =
+        buildBitmapIndex(relation->columns[column], (uint32_t)relation->num_tuples, max_values);
+  }
+}
+
+uint32_t selectRowsByBitmaps(
+    const FusedFilter *filter, BitmapIndex *const *indexes, uint32_t num_tuples, uint32_t *selection) {
+  if (filter->never_holds) {
+    return 0;
+  }
+
+  // The first and last value of each range that are in its column
+  uint32_t first[MAX_FUSED_COLUMNS], last[MAX_FUSED_COLUMNS];
+
+  for (uint32_t r = 0; r < filter->num_ranges; r++) {
+    first[r] = findValue(indexes[r]->values, indexes[r]->num_values, filter->ranges[r].low);
+    last[r] = first[r];
+
+    while (last[r] < indexes[r]->num_values && indexes[r]->values[last[r]] <= filter->ranges[r].high) {
+      last[r]++;
+    }
+  }
+
+  // The bitmaps are combined a block of words at a time, which stays in the L1 cache, and each block is converted to
+  // row IDs right away
+  uint32_t num_words = (num_tuples + 63) / 64;
+  uint64_t block[BITMAP_BLOCK_WORDS], column_block[BITMAP_BLOCK_WORDS];
+  uint32_t n = 0;
+
+  for (uint32_t start = 0; start < num_words; start += BITMAP_BLOCK_WORDS) {
+    uint32_t end = num_words - start > BITMAP_BLOCK_WORDS ? start + BITMAP_BLOCK_WORDS : num_words;
+
+    for (uint32_t w = start; w < end; w++) {
+      block[w - start] = UINT64_MAX;
+    }
+
+    for (uint32_t r = 0; r < filter->num_ranges; r++) {
+      for (uint32_t w = start; w < end; w++) {
+        column_block[w - start] = 0;
+      }
+
+      for (uint32_t value = first[r]; value < last[r]; value++) {
+        const uint64_t *bitmap = indexes[r]->bitmaps + (uint64_t)value * indexes[r]->num_words;
+
+        for (uint32_t w = start; w < end; w++) {
+          column_block[w - start] |= bitmap[w];
+        }
+      }
+
+      for (uint32_t w = start; w < end; w++) {
+        block[w - start] &= column_block[w - start];
+      }
+    }
+
+    for (uint32_t w = start; w < end; w++) {
+      // The bits past the last row are never set in the bitmaps, but a filter without ranges would keep them
+      uint64_t bits = block[w - start];
+      if (w + 1 == num_words && num_tuples % 64 != 0) {
+        bits &= ((uint64_t)1 << (num_tuples % 64)) - 1;
+      }
+
+      for (; bits != 0; bits &= bits - 1) {
+        selection[n++] = w * 64 + (uint32_t)__builtin_ctzll(bits);
+      }
+    }
+  }
+
+  return n;
+}
+
+void destroyRelationIndexes(Relation *relation) {
+  if (relation->bitmap_indexes != NULL) {
+    for (uint64_t column = 0; column < relation->num_columns; column++) {
+      destroyBitmapIndex(relation->bitmap_indexes[column]);
+    }
+
+    free(relation->bitmap_indexes);
+    relation->bitmap_indexes = NULL;
+  }
+
+  if (relation->point_indexes == NULL) {
+    return;
+  }
+
+  for (uint64_t column = 0; column < relation->num_columns; column++) {
+    PointIndex *index = atomic_load(&relation->point_indexes[column]);
+
+    if (index != NULL) {
+      atomic_fetch_sub(&point_index_memory, index->size);
+      destroyPointIndex(index);
+    }
+  }
+
+  free(relation->point_indexes);
+  relation->point_indexes = NULL;
+}
+
+void destroyPointIndex(PointIndex *index) {
+  if (index != NULL) {
+    free(index->values);
+    free(index->offsets);
+    free(index->row_ids);
+    free(index);
+  }
+}
+
+void destroyBitmapIndex(BitmapIndex *index) {
+  if (index != NULL) {
+    free(index->values);
+    free(index->bitmaps);
+    free(index);
+  }
+}
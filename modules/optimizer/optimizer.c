@@ -24,6 +24,11 @@ RelationStats *gatherStatistics(Relation *relation) {
     relation_stats->column_stats[i].max = 0;
     relation_stats->column_stats[i].count = (uint32_t)relation->num_tuples;
 
+    // The full values' bounds and, for a column that buildZoneMaps found to be sorted, whether they're increasing,
+    // which tell whether the column is unique and dense
+    uint64_t min = UINT64_MAX, max = 0;
+    bool sorted = relation->sorted != NULL && relation->sorted[i], increasing = true;
+
     for (uint32_t j = 0; j < (uint32_t)relation->num_tuples; j++) {
       // Update the min and max when needed
       if ((uint32_t)relation->columns[i][j] > relation_stats->column_stats[i].max) {
@@ -32,16 +37,98 @@ RelationStats *gatherStatistics(Relation *relation) {
       if ((uint32_t)relation->columns[i][j] < relation_stats->column_stats[i].min) {
         relation_stats->column_stats[i].min = (uint32_t)relation->columns[i][j];
       }
+
+      min = relation->columns[i][j] < min ? relation->columns[i][j] : min;
+      max = relation->columns[i][j] > max ? relation->columns[i][j] : max;
+
+      if (sorted && j > 0) {
+        increasing &= relation->columns[i][j - 1] < relation->columns[i][j];
+      }
     }
 
     // Find the distinct count of the values. Here beware pass them as they are not casted
     uint64_t length = (relation_stats->column_stats[i].count > MAX_COUNT ? MAX_COUNT : relation->num_tuples);
     relation_stats->column_stats[i].distinct = distinctCount(relation->columns[i], length);
+
+    // A sorted column is unique iff its values are increasing, and any other one iff all its values were counted as
+    // distinct
+    bool unique =
+        sorted ? increasing : length == relation->num_tuples && relation_stats->column_stats[i].distinct == length;
+
+    relation_stats->column_stats[i].unique = unique;
+    relation_stats->column_stats[i].dense = unique && relation->num_tuples > 0 && max - min == relation->num_tuples - 1;
   }
 
   return relation_stats;
 }
 
+double estimateSelectivity(const ColumnStats *stats, Operator op, uint64_t constant) {
+  if (stats->count == 0) {
+    return 0;
+  }
+
+  // The statistics are kept in 32 bits, so larger constants are clamped to their maximum value
+  uint32_t value = constant > UINT32_MAX ? UINT32_MAX : (uint32_t)constant;
+  double range = (double)stats->max - (double)stats->min + 1;
+
+  if (op == LT) {
+    return value <= stats->min ? 0 : value > stats->max ? 1 : (double)(value - stats->min) / range;
+  } else if (op == GT) {
+    return value >= stats->max ? 0 : value < stats->min ? 1 : (double)(stats->max - value) / range;
+  } else {
+    // A key's values are all distinct, even if there are too many of them to count (see MAX_COUNT)
+    uint32_t distinct = stats->unique ? stats->count : stats->distinct;
+    return (value < stats->min || value > stats->max) ? 0 : 1 / (double)(distinct > 0 ? distinct : 1);
+  }
+}
+
+void orderFilters(Query *query, RelationStats **data_statistics) {
+  // The number of tuples that each relation (alias) is expected to keep after all of its filters, assuming that
+  // they're independent
+  double expected_tuples[MAX_FILTERS];
+
+  for (uint32_t i = 0; i < query->num_filters; i++) {
+    FilterPredicate *filter = &query->filters[i];
+    ColumnStats *stats = &data_statistics[filter->column.table]->column_stats[filter->column.index];
+
+    filter->selectivity = estimateSelectivity(stats, filter->operator, filter->value);
+  }
+
+  for (uint32_t i = 0; i < query->num_filters; i++) {
+    expected_tuples[i] = data_statistics[query->filters[i].column.table]->column_stats[0].count;
+
+    for (uint32_t j = 0; j < query->num_filters; j++) {
+      if (query->filters[j].column.alias == query->filters[i].column.alias) {
+        expected_tuples[i] *= query->filters[j].selectivity;
+      }
+    }
+  }
+
+  // Insertion sort (there are only a few filters), which keeps the filters that tie in their original order
+  for (uint32_t i = 1; i < query->num_filters; i++) {
+    FilterPredicate filter = query->filters[i];
+    double tuples = expected_tuples[i];
+    uint32_t j = i;
+
+    for (; j > 0; j--) {
+      FilterPredicate *previous = &query->filters[j - 1];
+
+      bool goes_before = tuples < expected_tuples[j - 1] ||
+                         (filter.column.alias == previous->column.alias && filter.selectivity < previous->selectivity);
+
+      if (!goes_before) {
+        break;
+      }
+
+      query->filters[j] = *previous;
+      expected_tuples[j] = expected_tuples[j - 1];
+    }
+
+    query->filters[j] = filter;
+    expected_tuples[j] = tuples;
+  }
+}
+
 // The transformer determines whether it is helpful to change the form of the query
 static bool transform(Query *query_original) {
   // If there are less than 2 joins no reason for optimisation since
@@ -66,8 +153,19 @@ static bool transform(Query *query_original) {
   return true;
 }
 
-// Estimates the cost of executing a join(whether handled as filter or actual join) and updates relevant stats
-static uint32_t estimateJoinCost(uint32_t left_relation,
+// Estimates the number of tuples of a join with a key (a unique column), given the estimate for any other join: each of
+// the count tuples of the other side, spread over spread values, matches at most one of the key's tuples, and exactly
+// one if the key is dense and the tuple's value is among the shared values that both sides have in common
+static uint32_t estimateKeyJoinCount(
+    uint32_t estimate, bool dense_key, uint32_t count, uint64_t spread, uint32_t shared) {
+  if (dense_key) {
+    return (uint32_t)((double)count * (shared < spread ? shared : spread) / (double)spread);
+  }
+
+  return estimate < count ? estimate : count;
+}
+
+uint32_t estimateJoinCost(uint32_t left_relation,
                                  uint32_t left_column,
                                  uint32_t left_alias,
                                  uint32_t right_relation,
@@ -99,16 +197,14 @@ static uint32_t estimateJoinCost(uint32_t left_relation,
     // Beware: Alias is handled as a filter (as per Piazza) not the actual table
     else {
       // Also here careful we put the smaller(min) for the max
-      if (compareUints(&stats[left_relation]->column_stats[left_column].max,
-                       &stats[left_relation]->column_stats[right_column].max) > 0) {
+      if (stats[left_relation]->column_stats[left_column].max > stats[left_relation]->column_stats[right_column].max) {
         stats[left_relation]->column_stats[left_column].max = stats[left_relation]->column_stats[right_column].max;
       } else {
         stats[left_relation]->column_stats[right_column].max = stats[left_relation]->column_stats[left_column].max;
       }
 
       // And here we put the bigger(max) of the min
-      if (compareUints(&stats[left_relation]->column_stats[left_column].min,
-                       &stats[left_relation]->column_stats[right_column].min) > 0) {
+      if (stats[left_relation]->column_stats[left_column].min > stats[left_relation]->column_stats[right_column].min) {
         stats[left_relation]->column_stats[right_column].min = stats[left_relation]->column_stats[left_column].min;
       } else {
         stats[left_relation]->column_stats[left_column].min = stats[left_relation]->column_stats[right_column].min;
@@ -143,17 +239,28 @@ static uint32_t estimateJoinCost(uint32_t left_relation,
     }
   }
 
-  // Finally, the Join case between different "relations" (aliases)
-  if (compareUints(&stats[left_relation]->column_stats[left_column].max, &stats[right_relation]->column_stats[right_column].max) >
-      0) {
+  // Finally, the Join case between different "relations" (aliases). Whether either column is a key, and how the other
+  // side's values are spread before the ranges are narrowed down, is needed for joins with keys (a dense key has to
+  // hold as many tuples as values, which its filters may have changed).
+  ColumnStats *left_stats = &stats[left_relation]->column_stats[left_column];
+  ColumnStats *right_stats = &stats[right_relation]->column_stats[right_column];
+
+  uint64_t left_spread = (uint64_t)left_stats->max - left_stats->min + 1;
+  uint64_t right_spread = (uint64_t)right_stats->max - right_stats->min + 1;
+  uint32_t left_count = left_stats->count, right_count = right_stats->count;
+
+  bool left_key = left_stats->unique, right_key = right_stats->unique;
+  bool left_dense = left_key && left_stats->dense && left_count == left_spread;
+  bool right_dense = right_key && right_stats->dense && right_count == right_spread;
+
+  if (stats[left_relation]->column_stats[left_column].max > stats[right_relation]->column_stats[right_column].max) {
     stats[left_relation]->column_stats[left_column].max = stats[right_relation]->column_stats[right_column].max;
   } else {
     stats[right_relation]->column_stats[right_column].max = stats[left_relation]->column_stats[left_column].max;
   }
 
   // And here we put the bigger(max) of the min
-  if (compareUints(&stats[left_relation]->column_stats[left_column].min, &stats[right_relation]->column_stats[right_column].min) >
-      0) {
+  if (stats[left_relation]->column_stats[left_column].min > stats[right_relation]->column_stats[right_column].min) {
     stats[right_relation]->column_stats[right_column].min = stats[left_relation]->column_stats[left_column].min;
   } else {
     stats[left_relation]->column_stats[left_column].min = stats[right_relation]->column_stats[right_column].min;
@@ -163,6 +270,15 @@ static uint32_t estimateJoinCost(uint32_t left_relation,
   uint32_t n = stats[left_relation]->column_stats[left_column].max - stats[left_relation]->column_stats[left_column].min + 1;
   uint32_t newcount =
       (stats[left_relation]->column_stats[left_column].count * stats[right_relation]->column_stats[right_column].count) / n;
+
+  if (right_key) {
+    newcount = estimateKeyJoinCount(newcount, right_dense, left_count, left_spread, n);
+  }
+
+  if (left_key) {
+    newcount = estimateKeyJoinCount(newcount, left_dense, right_count, right_spread, n);
+  }
+
   uint32_t old_distinct_left = stats[left_relation]->column_stats[left_column].distinct;
   uint32_t old_distinct_right = stats[right_relation]->column_stats[right_column].distinct;
 
@@ -185,6 +301,9 @@ static uint32_t estimateJoinCost(uint32_t left_relation,
 
     // This after distinct cause we need the old count above
     stats[left_relation]->column_stats[j].count = newcount;
+
+    // Its rows are only repeated if they match several tuples of the other side, which a key's tuples don't
+    stats[left_relation]->column_stats[j].unique &= right_key;
   }
 
   // Informing the counts of all and distincts of right relation
@@ -198,6 +317,7 @@ static uint32_t estimateJoinCost(uint32_t left_relation,
 
     // This after distinct cause we need the old count above
     stats[right_relation]->column_stats[j].count = newcount;
+    stats[right_relation]->column_stats[j].unique &= left_key;
   }
 
   return newcount;
@@ -302,6 +422,14 @@ void destroyStats(RelationStats **stats, uint32_t num_relations) {
 }
 
 void optimizeQuery(Query *query_original, RelationStats **relation_stats, uint32_t num_relations, bool dynamic) {
+  // Mark the join columns that are keys, whose rows applyJoins can then index by value (see DENSE_KEY_JOIN)
+  for (uint32_t i = 0; i < query_original->num_joins; i++) {
+    JoinPredicate *join = &query_original->joins[i];
+
+    join->left_key = relation_stats[join->left.table]->column_stats[join->left.index].unique;
+    join->right_key = relation_stats[join->right.table]->column_stats[join->right.index].unique;
+  }
+
   // Create a copy so we don't alter original statistics needed for other queries
   RelationStats *data_statistics[num_relations];
   copyStats(data_statistics, relation_stats, num_relations);
@@ -316,7 +444,8 @@ void optimizeQuery(Query *query_original, RelationStats **relation_stats, uint32
       uint32_t filter_idx = query_original->filters[i].column.table;
       uint32_t column_idx = query_original->filters[i].column.index;
       uint32_t op = query_original->filters[i].operator;
-      uint32_t value = query_original->filters[i].value;
+      // The statistics are kept in 32 bits, so larger constants are clamped to their maximum value
+      uint32_t value = query_original->filters[i].value > UINT32_MAX ? UINT32_MAX : (uint32_t)query_original->filters[i].value;
 
       // Needed later in the calculations
       uint32_t oldcount = data_statistics[filter_idx]->column_stats[column_idx].count;
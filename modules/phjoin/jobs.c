@@ -1,49 +1,100 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "helpers.h"
 #include "inttypes.h"
 #include "phjoin.h"
 #include "relation.h"
+#include "scheduler.h"
+
+// The number of tuples a job processes between two checks of its cancellation token
+#define MORSEL_SIZE 16384
+
+// Returns the end of the morsel that starts at start, in a range that ends at end.
+static inline uint32_t morselEnd(uint32_t start, uint32_t end) {
+  return end - start > MORSEL_SIZE ? start + MORSEL_SIZE : end;
+}
 
 void histogramJob(void *args_) {
   HistogramJobArgs *args = args_;
 
+  // The histogram is always allocated, even if the job is cancelled, so that it can be freed like any other
   *(args->hist) = memAlloc(sizeof(uint32_t), POW2(args->nbits), true, NULL);
 
-  for (uint32_t i = args->start; i < args->end; i++) {
-    uint32_t hash_val = LSBITS(args->tuples[i].payload, args->nbits, args->shamt);
-    (*(args->hist))[hash_val]++;
+  for (uint32_t start = args->start; start < args->end && !isCancelled(args->cancellation); start += MORSEL_SIZE) {
+    for (uint32_t i = start, end = morselEnd(start, args->end); i < end; i++) {
+      uint32_t hash_val = LSBITS(args->tuples[i].payload, args->nbits, args->shamt);
+      (*(args->hist))[hash_val]++;
+    }
   }
 }
 
-uint32_t *mergeHistograms(uint32_t **histograms, uint32_t num_threads, uint8_t nbits) {
-  uint32_t hist_size = POW2((uint32_t)nbits);
-  uint32_t *hist = memAlloc(sizeof(uint32_t), hist_size, true, NULL);
+void scatterJob(void *args_) {
+  ScatterJobArgs *args = args_;
 
-  for (uint32_t thread = 0; thread < num_threads; thread++) {
-    for (uint32_t i = 0; i < hist_size; i++) {
-      hist[i] += histograms[thread][i];
+  // If the histograms were cancelled, the offsets may be wrong, but then the token is already cancelled
+  for (uint32_t start = args->start; start < args->end && !isCancelled(args->cancellation); start += MORSEL_SIZE) {
+    for (uint32_t i = start, end = morselEnd(start, args->end); i < end; i++) {
+      uint32_t hash_val = LSBITS(args->tuples[i].payload, nbits1, 0);
+      args->partitioned_tuples[args->offsets[hash_val]++] = args->tuples[i];
     }
   }
+}
+
+void subpartitionJob(void *args_) {
+  SubpartitionJobArgs *args = args_;
+
+  // The partition may not be complete if the scatter jobs were cancelled. The subpartitions' offsets are then left
+  // as they were, with the whole partition in the last one.
+  if (isCancelled(args->cancellation)) {
+    return;
+  }
+
+  uint32_t hash_value_count = POW2(nbits2);
+  uint32_t *psum = memAlloc(sizeof(uint32_t), hash_value_count, true, NULL);
+
+  for (uint32_t i = args->start; i < args->end; i++) {
+    psum[LSBITS(args->tuples[i].payload, nbits2, nbits1)]++;
+  }
 
-  for (uint32_t i = 0; i < num_threads; i++) {
-    free(histograms[i]);
+  for (uint32_t counter = args->start, i = 0; i < hash_value_count; i++) {
+    uint32_t hist_val = psum[i];
+    psum[i] = counter;
+    counter += hist_val;
   }
 
-  free(histograms);
+  // The first subpartition starts with the partition itself, which is known beforehand. It's not written here
+  // because the jobs of the previous partition read it as their end, without depending on this job.
+  memcpy(args->offsets + 1, psum + 1, sizeof(uint32_t) * (hash_value_count - 1));
+
+  for (uint32_t i = args->start; i < args->end; i++) {
+    uint32_t hash_val = LSBITS(args->tuples[i].payload, nbits2, nbits1);
+    args->partitioned_tuples[psum[hash_val]++] = args->tuples[i];
+  }
 
-  return hist;
+  free(psum);
 }
 
 void buildingJob(void *args_) {
   BuildingJobArgs *args = args_;
 
-  for (uint32_t i = args->start; i < args->end; i++) {
-    Tuple tuple = {.key = args->tuples[i].key, .payload = args->tuples[i].payload};
+  // A cancelled job doesn't create its table, which the join jobs treat like an empty partition
+  if (isCancelled(args->cancellation)) {
+    return;
+  }
+
+  if (*(args->index) == NULL) {
+    *(args->index) = createHashTable(args->capacity, NEIGHBOURHOOD_SIZE);
+  }
+
+  for (uint32_t start = args->start; start < args->end && !isCancelled(args->cancellation); start += MORSEL_SIZE) {
+    for (uint32_t i = start, end = morselEnd(start, args->end); i < end; i++) {
+      Tuple tuple = {.key = args->tuples[i].key, .payload = args->tuples[i].payload};
 
-    insert(args->index, &tuple);
+      insert(*(args->index), &tuple);
+    }
   }
 }
 
@@ -53,23 +104,48 @@ void joinJob(void *args_) {
     return;
   }
 
+  bool wide = args->smallest_wide_payloads != NULL || args->largest_wide_payloads != NULL;
+
   for (uint32_t i = args->start; i < args->end; i++) {
-    RowIDs *matches = search(args->table, args->largest_rel->tuples[i].payload);
+    if ((i - args->start) % MORSEL_SIZE == 0 && isCancelled(args->cancellation)) {
+      return;
+    }
+
+    Tuple probe = args->largest_rel->tuples[i];
+
+    RowIDs *matches = search(args->table, probe.payload);
     if (matches != NULL) {
       if (args->result->num_tuples + matches->count >= *(args->joined_rows_capacity)) {
-        *(args->joined_rows_capacity) *= 2;
+        while (args->result->num_tuples + matches->count >= *(args->joined_rows_capacity)) {
+          *(args->joined_rows_capacity) = 2 * *(args->joined_rows_capacity) + 1;
+        }
+
         args->result->tuples = memAlloc(sizeof(Tuple), *(args->joined_rows_capacity), false, args->result->tuples);
       }
 
-      for (uint32_t j = 0; j < matches->count; j++, args->result->num_tuples++) {
+      uint64_t probe_value = FULL_PAYLOAD(args->largest_wide_payloads, probe);
+
+      for (uint32_t j = 0; j < matches->count; j++) {
+        // Equal payloads only imply equal values if neither relation has wide payloads. A narrow match's value is
+        // the payload itself, which is equal to the probing tuple's payload.
+        if (wide) {
+          uint64_t match_value = args->smallest_wide_payloads != NULL ? args->smallest_wide_payloads[matches->ids[j]]
+                                                                      : (uint64_t)probe.payload;
+          if (match_value != probe_value) {
+            continue;
+          }
+        }
+
         // Make sure we save the row ID of the left (R) relation in the key field of the result's tuples
         if (args->relation_R_is_smallest) {
           args->result->tuples[args->result->num_tuples].key = matches->ids[j];
-          args->result->tuples[args->result->num_tuples].payload = args->largest_rel->tuples[i].key;
+          args->result->tuples[args->result->num_tuples].payload = probe.key;
         } else {
-          args->result->tuples[args->result->num_tuples].key = args->largest_rel->tuples[i].key;
+          args->result->tuples[args->result->num_tuples].key = probe.key;
           args->result->tuples[args->result->num_tuples].payload = matches->ids[j];
         }
+
+        args->result->num_tuples++;
       }
       free(matches->ids);
       free(matches);
@@ -77,6 +153,61 @@ void joinJob(void *args_) {
   }
 }
 
+void buildProbeJob(void *args_) {
+  BuildProbeJobArgs *args = args_;
+
+  int64_t worker_id = currentWorkerId();
+
+  // Reuse the calling thread's table, if it has one, instead of allocating a new one for every partition
+  bool pooled = worker_id >= 0 && worker_id < args->table_pool_size;
+  HashTable *table = pooled ? args->table_pool[worker_id] : NULL;
+
+  for (uint32_t i = args->first_partition; i < args->end_partition && !isCancelled(args->cancellation); i++) {
+    uint32_t build_start = args->smallest_offsets[i], build_end = args->smallest_offsets[i + 1];
+    uint32_t probe_start = args->largest_offsets[i], probe_end = args->largest_offsets[i + 1];
+
+    // A partition that's empty on either side can't produce any results
+    if (build_start == build_end || probe_start == probe_end) {
+      continue;
+    }
+
+    uint32_t capacity = gtePow2(build_end - build_start);
+
+    if (table == NULL) {
+      table = createHashTable(capacity, NEIGHBOURHOOD_SIZE);
+    } else {
+      resetHashTable(table, capacity);
+    }
+
+    BuildingJobArgs building_args = {.index = &table,
+                                     .tuples = args->smallest_rel->tuples,
+                                     .start = build_start,
+                                     .end = build_end,
+                                     .cancellation = args->cancellation};
+
+    buildingJob(&building_args);
+
+    JoinJobArgs join_args = {.result = args->result,
+                             .largest_rel = args->largest_rel,
+                             .table = table,
+                             .start = probe_start,
+                             .end = probe_end,
+                             .joined_rows_capacity = args->joined_rows_capacity,
+                             .relation_R_is_smallest = args->relation_R_is_smallest,
+                             .smallest_wide_payloads = args->smallest_wide_payloads,
+                             .largest_wide_payloads = args->largest_wide_payloads,
+                             .cancellation = args->cancellation};
+
+    joinJob(&join_args);
+  }
+
+  if (pooled) {
+    args->table_pool[worker_id] = table;
+  } else if (table != NULL) {
+    destroyHashTable(table);
+  }
+}
+
 JoinRelation *mergeResults(JoinRelation **results, uint32_t num_results) {
   uint32_t total_tuples = 0;
 
@@ -8,179 +8,657 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "hash.h"
 #include "helpers.h"
 #include "hopscotch.h"
 #include "relation.h"
 #include "scheduler.h"
+#include "topology.h"
+
+// Number of tuples of the largest relation that a single join job probes when the relations aren't partitioned
+#define PROBE_MORSEL_SIZE 16384
+
+// Size thresholds for the small-input fast paths, which run inline on the calling thread. A join that needs at most
+// NESTED_LOOP_MAX_COMPARISONS comparisons uses a nested loop. Otherwise, if the smallest relation has at most
+// SMALL_JOIN_MAX_BUILD tuples (so that its table stays L1-resident) and the largest at most SMALL_JOIN_MAX_PROBE,
+// we build a small bucket-chained table instead of going through the scheduler and the partitioning phase.
+
+#define NESTED_LOOP_MAX_COMPARISONS 4096
+#define SMALL_JOIN_MAX_BUILD 1024
+#define SMALL_JOIN_MAX_PROBE 32768
+
+// Inserting a tuple into a hash table costs about as much as scanning or probing this many tuples (see joinCost)
+#define BUILD_COST_PER_TUPLE 2
+
+// The state of a relation's partitioning. It's split into phases, so that the partitioning jobs of both relations,
+// and the jobs that consume their partitions, can be scheduled together as a single graph of jobs:
+//
+// 1. submitHistogramJobs: each of the threads that partition the relation (see chooseParallelism) counts the first
+//    pass' partition sizes of a chunk of it.
+// 2. planPartitioning: once the histograms are ready, decide on the number of passes and compute where each chunk
+//    writes its tuples in each partition.
+// 3. createPartitioningJobs: a scatter job per chunk does the first pass and, if there's a second one, a job per
+//    (non-empty) first pass partition splits it further, after all the scatter jobs have completed.
+// 4. submitPartitioningJobs, along with any jobs that were made to depend on the partitions (see dependOnPartition).
+//
+// All the jobs that work on the i-th first pass partition (and the scatter job of the i-th chunk) ask to run on the
+// i-th NUMA node (see setJobNode), so that each partition is split, built and probed by the threads of one node.
+
+typedef struct partitioning {
+  JoinRelation *relation;
+  JoinRelation *partitioned_relation;
+
+  // Where the first pass writes to: the partitioned relation itself or, if there's a second pass, a scratch array
+  Tuple *first_pass_tuples;
+
+  uint8_t num_passes;
+  uint8_t total_nbits;
+
+  // Each chunk's histogram, and then each chunk's starting position in each partition (2^nbits1 entries per chunk)
+  uint32_t num_chunks;
+  uint32_t **histograms;
+  uint32_t *chunk_offsets;
+
+  // The start of each of the first pass' partitions, followed by the number of tuples
+  uint32_t *first_pass_offsets;
+
+  // The start of each final partition, followed by the number of tuples (the second pass' jobs fill this in)
+  uint32_t *offsets;
+
+  JobInfo **scatter_jobs;
+  JobInfo **subpartition_jobs;  // NULL for single-pass partitionings, or for empty partitions
+} Partitioning;
+
+// Which of a join's relations is a dense key (see DENSE_KEY_MAX_SPREAD), the smallest of its values and the number of
+// values they span
+typedef struct dense_key {
+  bool relation_R_is_key;
+  uint64_t min;
+  uint64_t spread;
+} DenseKey;
+
+static void submitHistogramJobs(Partitioning *partitioning,
+                                JoinRelation *relation,
+                                uint32_t num_chunks,
+                                JobScheduler *scheduler) {
+  partitioning->relation = relation;
+  partitioning->num_chunks = num_chunks;
+  partitioning->histograms = memAlloc(sizeof(uint32_t *), partitioning->num_chunks, false, NULL);
+
+  uint32_t tuples_per_chunk = relation->num_tuples / partitioning->num_chunks;
+
+  for (uint32_t i = 0; i < partitioning->num_chunks; i++) {
+    JobInfo *job_info = createJob(scheduler, histogramJob, sizeof(HistogramJobArgs), HISTOGRAM_JOB);
+    HistogramJobArgs *args = job_info->args;
+
+    args->tuples = relation->tuples;
+    args->start = i * tuples_per_chunk;
+    args->end = (i + 1 == partitioning->num_chunks) ? relation->num_tuples : (i + 1) * tuples_per_chunk;
+    args->nbits = nbits1;
+    args->shamt = 0;
+    args->hist = &partitioning->histograms[i];
+    args->cancellation = &scheduler->cancellation;
 
-#define NEIGHBOURHOOD_SIZE 48  // Parameter used for the hopscotch tables
-
-static uint8_t _partition(Tuple *tuples,              // The original relation's tuples
-                          Tuple *partitioned_tuples,  // The resulting (partitioned) tuples
-                          uint32_t start,             // Starting index of sub-array we want to partition
-                          uint32_t end,               // Ending index of sub-array we want to partition
-                          bool called_recursively,    // Whether this function has been called recursively or not
-                          bool is_smallest,           // Whether we're currently partitioning the smallest relation
-                          bool two_passes,            // Whether to use two passes or not, if not partitioning smallest
-                          JobScheduler *scheduler     // The job scheduler to be used for multi-threading purposes
-) {
-  // Number of bits to use for hashing in the current partitioning pass
-  uint8_t nbits = called_recursively ? nbits2 : nbits1;
+    submitJob(scheduler, job_info);
+  }
+}
 
-  // How much the payload should be right-shifted before extracting its least-significant bits as its hash value
-  uint8_t shamt = called_recursively ? nbits1 : 0;
+// If is_smallest is set, a second pass is done iff the first pass' largest partition doesn't fit in the L2 cache.
+// Otherwise, it's done iff two_passes is set, so that the largest relation is partitioned like the smallest one.
+static void planPartitioning(Partitioning *partitioning, bool is_smallest, bool two_passes) {
+  uint32_t num_tuples = partitioning->relation->num_tuples;
+  uint32_t num_partitions = POW2(nbits1);
 
-  // How many tuples we're currently partitioning
-  uint32_t num_tuples = end - start;
+  partitioning->first_pass_offsets = memAlloc(sizeof(uint32_t), num_partitions + 1, false, NULL);
+  partitioning->chunk_offsets = memAlloc(sizeof(uint32_t), partitioning->num_chunks * num_partitions, false, NULL);
 
-  // This is needed to determine whether we need to partition the relation using two passes or one
+  // Each partition holds the tuples of the first chunk, followed by those of the second one, and so on, so that
+  // the tuples within a partition keep their original order
   uint32_t max_tuples_in_partition = 0;
 
-  // Number of possible hash values for the given "nbits" parameter
-  uint32_t hash_value_count = POW2(nbits);
+  for (uint32_t counter = 0, i = 0; i < num_partitions; i++) {
+    partitioning->first_pass_offsets[i] = counter;
 
-  // Step 1: build a histogram for counting hash value frequencies
-  uint32_t **histograms = memAlloc(sizeof(uint32_t *), scheduler->execution_threads, false, NULL);
+    for (uint32_t chunk = 0; chunk < partitioning->num_chunks; chunk++) {
+      partitioning->chunk_offsets[chunk * num_partitions + i] = counter;
+      counter += partitioning->histograms[chunk][i];
+    }
 
-  uint32_t tuples_per_thread = num_tuples / scheduler->execution_threads;
+    uint32_t partition_size = counter - partitioning->first_pass_offsets[i];
+    max_tuples_in_partition = partition_size > max_tuples_in_partition ? partition_size : max_tuples_in_partition;
+  }
 
-  for (uint32_t i = 0; i < scheduler->execution_threads; i++) {
-    uint32_t start_ = i * tuples_per_thread;
-    uint32_t end_ = (i + 1 == scheduler->execution_threads) ? num_tuples : (i + 1) * tuples_per_thread;
+  partitioning->first_pass_offsets[num_partitions] = num_tuples;
 
-    HistogramJobArgs *args = memAlloc(sizeof(HistogramJobArgs), 1, false, NULL);
+  for (uint32_t chunk = 0; chunk < partitioning->num_chunks; chunk++) {
+    free(partitioning->histograms[chunk]);
+  }
 
-    args->tuples = tuples;
-    args->start = start_;
-    args->end = end_;
-    args->nbits = nbits;
-    args->shamt = shamt;
-    args->hist = &histograms[i];
+  free(partitioning->histograms);
 
-    JobInfo *job_info = memAlloc(sizeof(JobInfo), 1, false, NULL);
-    job_info->job = histogramJob;
-    job_info->args = args;
-    job_info->kind = HISTOGRAM_JOB;
+  bool second_pass = is_smallest ? max_tuples_in_partition * sizeof(Tuple) > l2size : two_passes;
 
-    submitJob(scheduler, job_info);
+  partitioning->num_passes = second_pass + 1;
+  partitioning->total_nbits = nbits1 + second_pass * nbits2;
+
+  partitioning->partitioned_relation = memAlloc(sizeof(JoinRelation), 1, false, NULL);
+  partitioning->partitioned_relation->num_tuples = num_tuples;
+  partitioning->partitioned_relation->tuples = memAlloc(sizeof(Tuple), num_tuples, false, NULL);
+  partitioning->partitioned_relation->wide_payloads = NULL;  // Tuples keep their keys, so the source's still apply
+
+  partitioning->first_pass_tuples = partitioning->partitioned_relation->tuples;
+
+  if (!second_pass) {
+    partitioning->offsets = memAlloc(sizeof(uint32_t), num_partitions + 1, false, NULL);
+    memcpy(partitioning->offsets, partitioning->first_pass_offsets, sizeof(uint32_t) * (num_partitions + 1));
+
+    return;
+  }
+
+  partitioning->first_pass_tuples = memAlloc(sizeof(Tuple), num_tuples, false, NULL);
+
+  // The subpartitions of empty partitions don't get a job, so they're empty from the start
+  uint32_t num_subpartitions = POW2(nbits2);
+  partitioning->offsets = memAlloc(sizeof(uint32_t), num_partitions * num_subpartitions + 1, false, NULL);
+
+  for (uint32_t i = 0; i < num_partitions; i++) {
+    for (uint32_t j = 0; j < num_subpartitions; j++) {
+      partitioning->offsets[i * num_subpartitions + j] = partitioning->first_pass_offsets[i];
+    }
+  }
+
+  partitioning->offsets[num_partitions * num_subpartitions] = num_tuples;
+}
+
+// Places each first pass partition of the partitioned relation (and of the first pass' scratch array) on the NUMA node
+// whose threads will process it, before any of it is written to. Only needed if the pool spans more than one node.
+static void placePartitions(Partitioning *partitioning, JobScheduler *scheduler) {
+  const CpuTopology *topology = scheduler->pool->topology;
+
+  if (topology == NULL || topology->num_nodes < 2) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < POW2(nbits1); i++) {
+    uint32_t start = partitioning->first_pass_offsets[i];
+    uint32_t size = (partitioning->first_pass_offsets[i + 1] - start) * sizeof(Tuple);
+
+    // Partitions smaller than a page are left to the first thread that touches them
+    bindMemoryToNode(partitioning->partitioned_relation->tuples + start, size, topology, i);
+
+    if (partitioning->num_passes == 2) {
+      bindMemoryToNode(partitioning->first_pass_tuples + start, size, topology, i);
+    }
+  }
+}
+
+static void createPartitioningJobs(Partitioning *partitioning, JobScheduler *scheduler) {
+  uint32_t num_partitions = POW2(nbits1);
+  uint32_t tuples_per_chunk = partitioning->relation->num_tuples / partitioning->num_chunks;
+
+  partitioning->scatter_jobs = memAlloc(sizeof(JobInfo *), partitioning->num_chunks, false, NULL);
+  partitioning->subpartition_jobs = NULL;
+
+  for (uint32_t i = 0; i < partitioning->num_chunks; i++) {
+    partitioning->scatter_jobs[i] = createJob(scheduler, scatterJob, sizeof(ScatterJobArgs), SCATTER_JOB);
+    ScatterJobArgs *args = partitioning->scatter_jobs[i]->args;
+    setJobNode(partitioning->scatter_jobs[i], i);
+
+    args->tuples = partitioning->relation->tuples;
+    args->partitioned_tuples = partitioning->first_pass_tuples;
+    args->start = i * tuples_per_chunk;
+    args->end = (i + 1 == partitioning->num_chunks) ? partitioning->relation->num_tuples : (i + 1) * tuples_per_chunk;
+    args->offsets = &partitioning->chunk_offsets[i * num_partitions];
+    args->cancellation = &scheduler->cancellation;
+  }
+
+  if (partitioning->num_passes == 1) {
+    return;
+  }
+
+  partitioning->subpartition_jobs = memAlloc(sizeof(JobInfo *), num_partitions, true, NULL);
+
+  for (uint32_t i = 0; i < num_partitions; i++) {
+    uint32_t start = partitioning->first_pass_offsets[i];
+    uint32_t end = partitioning->first_pass_offsets[i + 1];
+
+    if (start == end) {
+      continue;  // The current partition is empty
+    }
+
+    partitioning->subpartition_jobs[i] =
+        createJob(scheduler, subpartitionJob, sizeof(SubpartitionJobArgs), SUBPARTITION_JOB);
+    SubpartitionJobArgs *args = partitioning->subpartition_jobs[i]->args;
+    setJobNode(partitioning->subpartition_jobs[i], i);
+
+    args->tuples = partitioning->first_pass_tuples;
+    args->partitioned_tuples = partitioning->partitioned_relation->tuples;
+    args->start = start;
+    args->end = end;
+    args->offsets = &partitioning->offsets[i * POW2(nbits2)];
+    args->cancellation = &scheduler->cancellation;
+
+    // Every chunk may have tuples in this partition
+    for (uint32_t chunk = 0; chunk < partitioning->num_chunks; chunk++) {
+      addDependency(partitioning->scatter_jobs[chunk], partitioning->subpartition_jobs[i]);
+    }
   }
+}
 
+// Makes job wait until the tuples of the first pass' i-th partition have reached their final positions.
+static void dependOnPartition(JobInfo *job, Partitioning *partitioning, uint32_t i) {
+  if (partitioning->num_passes == 2) {
+    if (partitioning->subpartition_jobs[i] != NULL) {
+      addDependency(partitioning->subpartition_jobs[i], job);
+    }
+
+    return;
+  }
+
+  for (uint32_t chunk = 0; chunk < partitioning->num_chunks; chunk++) {
+    addDependency(partitioning->scatter_jobs[chunk], job);
+  }
+}
+
+static void submitPartitioningJobs(Partitioning *partitioning, JobScheduler *scheduler) {
+  for (uint32_t i = 0; i < partitioning->num_chunks; i++) {
+    submitJob(scheduler, partitioning->scatter_jobs[i]);
+  }
+
+  if (partitioning->num_passes == 2) {
+    for (uint32_t i = 0; i < POW2(nbits1); i++) {
+      if (partitioning->subpartition_jobs[i] != NULL) {
+        submitJob(scheduler, partitioning->subpartition_jobs[i]);
+      }
+    }
+  }
+}
+
+// Frees everything but the partitioned relation and its offsets, once the partitioning jobs have completed.
+static void finishPartitioning(Partitioning *partitioning) {
+  if (partitioning->num_passes == 2) {
+    free(partitioning->first_pass_tuples);
+  }
+
+  free(partitioning->chunk_offsets);
+  free(partitioning->first_pass_offsets);
+  free(partitioning->scatter_jobs);
+  free(partitioning->subpartition_jobs);
+}
+
+JoinRelation *partition(
+    JoinRelation *relation, bool is_smallest, bool two_passes, uint8_t *num_partition_passes, JobScheduler *scheduler) {
+  Partitioning partitioning;
+
+  uint32_t num_chunks = chooseParallelism(relation->num_tuples, scheduler->execution_threads);
+  PROFILE_PRINT("partition: %" PRIu32 " tuples, %" PRIu32 " workers\n", relation->num_tuples, num_chunks);
+
+  submitHistogramJobs(&partitioning, relation, num_chunks, scheduler);
+  executeAllJobs(scheduler);
+  waitAllJobs(scheduler);
+
+  planPartitioning(&partitioning, is_smallest, two_passes);
+  placePartitions(&partitioning, scheduler);
+  createPartitioningJobs(&partitioning, scheduler);
+  submitPartitioningJobs(&partitioning, scheduler);
   executeAllJobs(scheduler);
   waitAllJobs(scheduler);
 
-  uint32_t *hist = mergeHistograms(histograms, scheduler->execution_threads, nbits);
+  finishPartitioning(&partitioning);
+  free(partitioning.offsets);
 
-  max_tuples_in_partition = maxArray(hist, hash_value_count);
+  *num_partition_passes = partitioning.num_passes;
+  return partitioning.partitioned_relation;
+}
 
-  // This check takes care of two things:
-  // 1. Use the correct number of passes for the smallest relation, depending on the L2 cache's size
-  // 2. Use the same number of passes for the largest relation as we did for the smallest one
-  bool should_partition = is_smallest ? max_tuples_in_partition * sizeof(Tuple) > l2size : two_passes;
+// Returns the number of tuples in each partition, given their offsets.
+static uint32_t *offsetsToHistogram(uint32_t *offsets, uint32_t num_partitions) {
+  uint32_t *hist = memAlloc(sizeof(uint32_t), num_partitions, false, NULL);
 
-  // Step 2: convert the histogram to the corresponding prefix sum array (in-place)
-  uint32_t *psum = hist;
-  for (uint32_t counter = 0, i = 0; i < hash_value_count; i++) {
-    uint32_t hist_val = hist[i];
-    psum[i] = counter;
-    counter += hist_val;
+  for (uint32_t i = 0; i < num_partitions; i++) {
+    hist[i] = offsets[i + 1] - offsets[i];
   }
 
-  // This will be used if we need to partition using two passes instead of one
-  uint32_t *psum_copy = NULL;
+  return hist;
+}
 
-  if (should_partition) {
-    psum_copy = memAlloc(sizeof(uint32_t), hash_value_count, false, NULL);
-    memcpy(psum_copy, psum, sizeof(uint32_t) * hash_value_count);
+// Appends the (row ID of R, row ID of S) pair to result, growing its tuples array if needed.
+static void appendResult(JoinRelation *result, uint32_t *capacity, uint32_t key_R, uint32_t key_S) {
+  if (result->num_tuples == *capacity) {
+    *capacity *= 2;
+    result->tuples = memAlloc(sizeof(Tuple), *capacity, false, result->tuples);
   }
 
-  // Step 3: partition the tuples with respect to their hash values
-  // Note: psum determines the offset of the next available position for a tuple in each partition
-  for (uint32_t i = 0; i < num_tuples; i++) {
-    uint32_t hash_val = LSBITS(tuples[i].payload, nbits, shamt);
-    partitioned_tuples[start + psum[hash_val]++] = tuples[i];
+  result->tuples[result->num_tuples].key = key_R;
+  result->tuples[result->num_tuples].payload = key_S;
+  result->num_tuples++;
+}
+
+static JoinRelation *nestedLoopJoin(JoinRelation *relation_R, JoinRelation *relation_S) {
+  uint32_t capacity = relation_R->num_tuples + relation_S->num_tuples + 1;
+
+  JoinRelation *result = memAlloc(sizeof(JoinRelation), 1, true, NULL);
+  result->tuples = memAlloc(sizeof(Tuple), capacity, false, NULL);
+
+  for (uint32_t i = 0; i < relation_R->num_tuples; i++) {
+    for (uint32_t j = 0; j < relation_S->num_tuples; j++) {
+      if (FULL_PAYLOAD(relation_R->wide_payloads, relation_R->tuples[i]) ==
+          FULL_PAYLOAD(relation_S->wide_payloads, relation_S->tuples[j])) {
+        appendResult(result, &capacity, relation_R->tuples[i].key, relation_S->tuples[j].key);
+      }
+    }
   }
 
-  // Step 4: recursively partition all partitions if needed (but don't do more than two passes)
-  if (should_partition && !called_recursively) {
-    for (uint32_t i = 0; i < hash_value_count; i++) {
-      uint32_t partition_end = i + 1 == hash_value_count ? end : psum_copy[i + 1];
+  return result;
+}
+
+static JoinRelation *smallHashJoin(JoinRelation *relation_R, JoinRelation *relation_S) {
+  bool relation_R_is_smallest = relation_R->num_tuples <= relation_S->num_tuples;
+
+  JoinRelation *smallest_rel = relation_R_is_smallest ? relation_R : relation_S;
+  JoinRelation *largest_rel = relation_R_is_smallest ? relation_S : relation_R;
+
+  // Bucket-chained table: heads[slot] is 1 + the index of the last tuple inserted in slot and next[i] is 1 + the index
+  // of the tuple inserted in the same slot before tuple i, so that 0 always marks the end of a chain. Both arrays are
+  // laid out in a single allocation that fits in the L1 cache for the sizes we accept here.
+
+  uint32_t num_slots = gtePow2(2 * smallest_rel->num_tuples);
+  uint32_t *heads = memAlloc(sizeof(uint32_t), num_slots + smallest_rel->num_tuples, true, NULL);
+  uint32_t *next = heads + num_slots;
+
+  for (uint32_t i = 0; i < smallest_rel->num_tuples; i++) {
+    uint32_t slot = (uint32_t)(ranHash((uint64_t)smallest_rel->tuples[i].payload) & (num_slots - 1));
+
+    next[i] = heads[slot];
+    heads[slot] = i + 1;
+  }
+
+  uint32_t capacity = largest_rel->num_tuples + 1;
+
+  JoinRelation *result = memAlloc(sizeof(JoinRelation), 1, true, NULL);
+  result->tuples = memAlloc(sizeof(Tuple), capacity, false, NULL);
+
+  for (uint32_t i = 0; i < largest_rel->num_tuples; i++) {
+    Tuple probe = largest_rel->tuples[i];
+    uint32_t slot = (uint32_t)(ranHash((uint64_t)probe.payload) & (num_slots - 1));
+
+    for (uint32_t entry = heads[slot]; entry != 0; entry = next[entry - 1]) {
+      Tuple match = smallest_rel->tuples[entry - 1];
 
-      if (psum_copy[i] == partition_end) {
-        continue;  // The current partition is empty
+      if (match.payload == probe.payload && FULL_PAYLOAD(smallest_rel->wide_payloads, match) ==
+                                                FULL_PAYLOAD(largest_rel->wide_payloads, probe)) {
+        // Make sure we save the row ID of the left (R) relation in the key field of the result's tuples
+        if (relation_R_is_smallest) {
+          appendResult(result, &capacity, match.key, probe.key);
+        } else {
+          appendResult(result, &capacity, probe.key, match.key);
+        }
       }
+    }
+  }
+
+  free(heads);
+
+  return result;
+}
+
+// Returns whether a relation is a dense key (see DENSE_KEY_MAX_SPREAD), in which case min and spread are set to the
+// smallest of its values and the number of values they span.
+static bool findDenseKey(const JoinRelation *relation, uint64_t *min, uint64_t *spread) {
+  if (!relation->unique || relation->num_tuples == 0) {
+    return false;
+  }
+
+  uint64_t low = UINT64_MAX, high = 0;
+
+  for (uint32_t i = 0; i < relation->num_tuples; i++) {
+    uint64_t value = FULL_PAYLOAD(relation->wide_payloads, relation->tuples[i]);
+    low = value < low ? value : low;
+    high = value > high ? value : high;
+  }
+
+  *min = low;
+  *spread = high - low + 1;
+
+  // The array's size has to fit in 32 bits too
+  return high - low < (uint64_t)DENSE_KEY_MAX_SPREAD * relation->num_tuples && high - low < UINT32_MAX;
+}
+
+// Returns whether either relation is a dense key, preferring R, and if so describes it in dense_key
+static bool findDenseKeyOf(const JoinRelation *relation_R, const JoinRelation *relation_S, DenseKey *dense_key) {
+  dense_key->relation_R_is_key = findDenseKey(relation_R, &dense_key->min, &dense_key->spread);
+  return dense_key->relation_R_is_key || findDenseKey(relation_S, &dense_key->min, &dense_key->spread);
+}
+
+// Joins the relations by indexing the dense key that findDenseKeyOf found among them by value
+static JoinRelation *denseKeyJoin(JoinRelation *relation_R, JoinRelation *relation_S, const DenseKey *dense_key) {
+  bool relation_R_is_key = dense_key->relation_R_is_key;
+  uint64_t min = dense_key->min, spread = dense_key->spread;
 
-      uint32_t partition_num_tuples = partition_end - psum_copy[i];
+  JoinRelation *keys = relation_R_is_key ? relation_R : relation_S;
+  JoinRelation *probes = relation_R_is_key ? relation_S : relation_R;
 
-      // This is used so that the internal ordering in each partition is as determined in the first pass
-      Tuple *partitioned_tuples_copy = memAlloc(sizeof(Tuple), partition_num_tuples, false, NULL);
-      memcpy(partitioned_tuples_copy, partitioned_tuples + psum_copy[i], sizeof(Tuple) * partition_num_tuples);
+  // slots[value - min] is 1 + the index of the key's tuple with that value, so that 0 marks the values it doesn't have
+  uint32_t *slots = memAlloc(sizeof(uint32_t), (uint32_t)spread, true, NULL);
 
-      _partition(partitioned_tuples_copy, partitioned_tuples, psum_copy[i], partition_end, true, is_smallest, two_passes,
-                 scheduler);
-      free(partitioned_tuples_copy);
+  for (uint32_t i = 0; i < keys->num_tuples; i++) {
+    uint64_t offset = FULL_PAYLOAD(keys->wide_payloads, keys->tuples[i]) - min;
+
+    // The key's values were only estimated to be distinct, so if two of them turn out to be equal, the second one
+    // would overwrite the first one's slot and lose its matches, and the relations are hashed instead
+    if (slots[offset] != 0) {
+      free(slots);
+      return smallHashJoin(relation_R, relation_S);
     }
+
+    slots[offset] = i + 1;
   }
 
-  free(hist);
-  if (psum_copy != NULL) {
-    free(psum_copy);
+  // Every probing tuple matches at most one key
+  uint32_t capacity = probes->num_tuples + 1;
+
+  JoinRelation *result = memAlloc(sizeof(JoinRelation), 1, true, NULL);
+  result->tuples = memAlloc(sizeof(Tuple), capacity, false, NULL);
+
+  for (uint32_t i = 0; i < probes->num_tuples; i++) {
+    Tuple probe = probes->tuples[i];
+    uint64_t offset = FULL_PAYLOAD(probes->wide_payloads, probe) - min;
+
+    if (offset < spread && slots[offset] != 0) {
+      Tuple match = keys->tuples[slots[offset] - 1];
+
+      // Make sure we save the row ID of the left (R) relation in the key field of the result's tuples
+      if (relation_R_is_key) {
+        appendResult(result, &capacity, match.key, probe.key);
+      } else {
+        appendResult(result, &capacity, probe.key, match.key);
+      }
+    }
   }
 
-  return should_partition + 1;
+  free(slots);
+
+  return result;
 }
 
-JoinRelation *partition(
-    JoinRelation *relation, bool is_smallest, bool two_passes, uint8_t *num_partition_passes, JobScheduler *scheduler) {
-  JoinRelation *partitioned_relation = memAlloc(sizeof(JoinRelation), 1, false, NULL);
-  partitioned_relation->num_tuples = relation->num_tuples;
-  partitioned_relation->tuples = memAlloc(sizeof(Tuple), partitioned_relation->num_tuples, false, NULL);
+// Builds and probes the tables of all the partitions (steps 3, 4 and 6 in one go), with a job per first pass
+// partition that starts as soon as both relations' tuples of that partition are in place. The jobs depend on the
+// partitioning jobs, so everything is submitted at once and waited for a single time.
+static JoinRelation *buildAndProbePartitions(Partitioning *smallest,
+                                             Partitioning *largest,
+                                             bool relation_R_is_smallest,
+                                             uint64_t *smallest_wide_payloads,
+                                             uint64_t *largest_wide_payloads,
+                                             JobScheduler *scheduler) {
+  uint32_t num_partitions = POW2(nbits1);
+  uint32_t num_subpartitions = POW2(smallest->total_nbits - nbits1);
+
+  uint32_t *joined_rows_capacity = memAlloc(sizeof(uint32_t), num_partitions, true, NULL);
+  JoinRelation **results = memAlloc(sizeof(JoinRelation *), num_partitions, true, NULL);
 
-  *num_partition_passes = _partition(relation->tuples, partitioned_relation->tuples, 0, relation->num_tuples, false, is_smallest,
-                                     two_passes, scheduler);
+  uint32_t table_pool_size = (uint32_t)scheduler->execution_threads;
+  HashTable **table_pool = memAlloc(sizeof(HashTable *), table_pool_size, true, NULL);
 
-  return partitioned_relation;
+  JobInfo **build_probe_jobs = memAlloc(sizeof(JobInfo *), num_partitions, true, NULL);
+
+  for (uint32_t i = 0; i < num_partitions; i++) {
+    uint32_t smallest_size = smallest->first_pass_offsets[i + 1] - smallest->first_pass_offsets[i];
+    uint32_t largest_size = largest->first_pass_offsets[i + 1] - largest->first_pass_offsets[i];
+
+    results[i] = memAlloc(sizeof(JoinRelation), 1, true, NULL);
+    joined_rows_capacity[i] = smallest_size;
+    results[i]->tuples = memAlloc(sizeof(Tuple), joined_rows_capacity[i], true, NULL);
+
+    // A partition that's empty on either side can't produce any results
+    if (smallest_size == 0 || largest_size == 0) {
+      continue;
+    }
+
+    build_probe_jobs[i] = createJob(scheduler, buildProbeJob, sizeof(BuildProbeJobArgs), BUILD_PROBE_JOB);
+    BuildProbeJobArgs *args = build_probe_jobs[i]->args;
+    setJobNode(build_probe_jobs[i], i);
+
+    args->result = results[i];
+    args->smallest_rel = smallest->partitioned_relation;
+    args->largest_rel = largest->partitioned_relation;
+    args->smallest_offsets = smallest->offsets;
+    args->largest_offsets = largest->offsets;
+    args->first_partition = i * num_subpartitions;
+    args->end_partition = (i + 1) * num_subpartitions;
+    args->joined_rows_capacity = &joined_rows_capacity[i];
+    args->relation_R_is_smallest = relation_R_is_smallest;
+    args->smallest_wide_payloads = smallest_wide_payloads;
+    args->largest_wide_payloads = largest_wide_payloads;
+    args->table_pool = table_pool;
+    args->table_pool_size = table_pool_size;
+    args->cancellation = &scheduler->cancellation;
+
+    dependOnPartition(build_probe_jobs[i], smallest, i);
+    dependOnPartition(build_probe_jobs[i], largest, i);
+  }
+
+  submitPartitioningJobs(smallest, scheduler);
+  submitPartitioningJobs(largest, scheduler);
+
+  for (uint32_t i = 0; i < num_partitions; i++) {
+    if (build_probe_jobs[i] != NULL) {
+      submitJob(scheduler, build_probe_jobs[i]);
+    }
+  }
+
+  executeAllJobs(scheduler);
+  waitAllJobs(scheduler);
+
+  for (uint32_t i = 0; i < table_pool_size; i++) {
+    if (table_pool[i] != NULL) {
+      destroyHashTable(table_pool[i]);
+    }
+  }
+
+  free(build_probe_jobs);
+  free(table_pool);
+  free(joined_rows_capacity);
+
+  return mergeResults(results, num_partitions);
 }
 
-JoinRelation *phjoin(JoinRelation *relation_R, JoinRelation *relation_S, JobScheduler *scheduler) {
+// Runs a job on the calling thread if the join engages a single worker, so that small joins don't pay for the
+// scheduler's synchronization, or submits it to the pool (to run on the given NUMA node, unless it's -1) otherwise.
+static void runOrSubmitJob(
+    Job job, void *args, size_t args_size, JobKind kind, int32_t node, uint32_t workers, JobScheduler *scheduler) {
+  if (workers == 1) {
+    job(args);
+    return;
+  }
+
+  JobInfo *job_info = createJob(scheduler, job, args_size, kind);
+  memcpy(job_info->args, args, args_size);
+
+  if (node >= 0) {
+    setJobNode(job_info, (uint32_t)node);
+  }
+
+  submitJob(scheduler, job_info);
+}
+
+// Joins the relations using up to the given number of the scheduler's threads. The partitioning jobs of each relation
+// are split between as many of them as its size warrants. With a single worker, the tables are built and probed on
+// the calling thread, but partitioning (which only happens if the smallest relation doesn't fit in the L2 cache) and
+// the fused mode's graph of jobs still go through the pool.
+static JoinRelation *partitionedHashJoin(JoinRelation *relation_R,
+                                         JoinRelation *relation_S,
+                                         bool fused,
+                                         uint32_t workers,
+                                         JobScheduler *scheduler) {
   uint8_t num_partition_passes = 0;
 
-  // Step 1: (possibly) partition the smallest relation to build an index out of it
   JoinRelation *smallest_rel = relation_R->num_tuples > relation_S->num_tuples ? relation_S : relation_R;
   JoinRelation *largest_rel = relation_R->num_tuples <= relation_S->num_tuples ? relation_S : relation_R;
 
   bool relation_R_is_smallest = smallest_rel == relation_R;
 
-  // Only partition if the smallest relation doesn't fit in the L2 cache
+  // Partitioning creates new relations, so keep a reference to the original wide payloads (if any)
+  uint64_t *smallest_wide_payloads = smallest_rel->wide_payloads;
+  uint64_t *largest_wide_payloads = largest_rel->wide_payloads;
+
+  uint32_t *hist_smallest_rel = NULL;
+  uint32_t *hist_largest_rel = NULL;
+
+  Partitioning smallest, largest;
+
+  // Step 1: only partition if the smallest relation doesn't fit in the L2 cache. Both relations are partitioned
+  // with the same bits, so the histograms of the largest relation are computed at the same time.
   if (smallest_rel->num_tuples * sizeof(Tuple) > l2size) {
-    smallest_rel = partition(smallest_rel, true, false, &num_partition_passes, scheduler);
+    submitHistogramJobs(&smallest, smallest_rel, chooseParallelism(smallest_rel->num_tuples, workers), scheduler);
+    submitHistogramJobs(&largest, largest_rel, chooseParallelism(largest_rel->num_tuples, workers), scheduler);
+    executeAllJobs(scheduler);
+    waitAllJobs(scheduler);
+
+    planPartitioning(&smallest, true, false);
+    planPartitioning(&largest, false, smallest.num_passes == 2);
+    placePartitions(&smallest, scheduler);
+    placePartitions(&largest, scheduler);
+    createPartitioningJobs(&smallest, scheduler);
+    createPartitioningJobs(&largest, scheduler);
+
+    num_partition_passes = smallest.num_passes;
+    smallest_rel = smallest.partitioned_relation;
+    largest_rel = largest.partitioned_relation;
+
+    // In the fused mode, the rest of the join is a single graph of jobs (steps 2 to 6)
+    if (fused) {
+      JoinRelation *result = buildAndProbePartitions(
+          &smallest, &largest, relation_R_is_smallest, smallest_wide_payloads, largest_wide_payloads, scheduler);
+
+      finishPartitioning(&smallest);
+      finishPartitioning(&largest);
+      free(smallest.offsets);
+      free(largest.offsets);
+      destroyJoinRelation(smallest_rel);
+      destroyJoinRelation(largest_rel);
+
+      return result;
+    }
+
+    submitPartitioningJobs(&smallest, scheduler);
+    executeAllJobs(scheduler);
+    waitAllJobs(scheduler);
   }
 
   // How many bits we've used for partitioning the smallest relation
   uint8_t total_nbits = (num_partition_passes != 0) * nbits1 + (num_partition_passes == 2) * nbits2;
 
-  // Step 2: reconstruct the histogram for the smallest relation only if it was partitioned
-  uint32_t *hist_smallest_rel = NULL;
+  uint32_t num_htables = 1 << total_nbits;
 
+  // Step 2: get the histogram for the smallest relation only if it was partitioned
   if (num_partition_passes != 0) {
-    hist_smallest_rel = memAlloc(sizeof(uint32_t), 1 << total_nbits, true, NULL);
-
-    for (uint32_t i = 0; i < smallest_rel->num_tuples; i++) {
-      uint32_t new_hash_val = LSBITS(smallest_rel->tuples[i].payload, total_nbits, 0);
-      hist_smallest_rel[new_hash_val]++;
-    }
+    hist_smallest_rel = offsetsToHistogram(smallest.offsets, num_htables);
   }
 
-  // Step 3: create an index of hash tables from the smallest relation
-  uint32_t num_htables = 1 << total_nbits;
+  // Step 3: create an index of hash tables from the smallest relation. The building jobs create the tables of the
+  // existing partitions (or the whole relation) themselves, so that they're allocated on their own NUMA node.
   HashTable **index = memAlloc(sizeof(HashTable *), num_htables, true, NULL);
 
-  for (uint32_t i = 0; i < num_htables; i++) {
-    // Create a hash table only for existing partitions (or the whole relation)
-    if (num_partition_passes == 0 || hist_smallest_rel[i] != 0) {
-      index[i] = createHashTable(gtePow2(smallest_rel->num_tuples), NEIGHBOURHOOD_SIZE);
-    }
-  }
-
   uint32_t start = 0, end = 0;
   for (uint32_t i = 0; i < num_htables; i++, start = end) {
     if (num_partition_passes == 0) {
@@ -193,76 +671,83 @@ JoinRelation *phjoin(JoinRelation *relation_R, JoinRelation *relation_S, JobSche
       end += hist_smallest_rel[i];
     }
 
-    BuildingJobArgs *args = memAlloc(sizeof(BuildingJobArgs), 1, false, NULL);
-
-    args->index = index[i];
-    args->tuples = smallest_rel->tuples;
-    args->start = start;
-    args->end = end;
+    BuildingJobArgs args;
+    args.index = &index[i];
+    args.capacity = gtePow2(smallest_rel->num_tuples);
+    args.tuples = smallest_rel->tuples;
+    args.start = start;
+    args.end = end;
+    args.cancellation = &scheduler->cancellation;
 
-    JobInfo *job_info = memAlloc(sizeof(JobInfo), 1, false, NULL);
-    job_info->job = buildingJob;
-    job_info->args = args;
-    job_info->kind = BUILDING_JOB;
+    int32_t node = num_partition_passes != 0 ? (int32_t)(i >> (total_nbits - nbits1)) : -1;
+    runOrSubmitJob(buildingJob, &args, sizeof(args), BUILDING_JOB, node, workers, scheduler);
+  }
 
-    submitJob(scheduler, job_info);
+  // Step 5: (possibly) partition the largest relation, while the index is being built
+  if (num_partition_passes != 0) {
+    submitPartitioningJobs(&largest, scheduler);
   }
 
   executeAllJobs(scheduler);
   waitAllJobs(scheduler);
 
-  uint32_t *hist_largest_rel = NULL;
-
-  // Step 5: (possibly) partition the largest relation and reconstruct its histogram
   if (num_partition_passes != 0) {
-    largest_rel = partition(largest_rel, false, num_partition_passes == 2, &num_partition_passes, scheduler);
+    hist_largest_rel = offsetsToHistogram(largest.offsets, num_htables);
+  }
 
-    hist_largest_rel = memAlloc(sizeof(uint32_t), 1 << total_nbits, true, NULL);
+  // Step 6: probing phase. Without partitioning there's a single table, which is only read from this point on, so
+  // we split the largest relation into fixed-size morsels that are probed in parallel, each into its own buffer
+  uint32_t num_results = num_htables;
 
-    for (uint32_t i = 0; i < largest_rel->num_tuples; i++) {
-      uint32_t new_hash_val = LSBITS(largest_rel->tuples[i].payload, total_nbits, 0);
-      hist_largest_rel[new_hash_val]++;
-    }
+  if (num_partition_passes == 0) {
+    num_results = (largest_rel->num_tuples + PROBE_MORSEL_SIZE - 1) / PROBE_MORSEL_SIZE;
   }
 
-  // Step 6: probing phase
-  uint32_t *joined_rows_capacity = memAlloc(sizeof(uint32_t), num_htables, true, NULL);
-  JoinRelation **results = memAlloc(sizeof(JoinRelation *), num_htables, true, NULL);
+  uint32_t *joined_rows_capacity = memAlloc(sizeof(uint32_t), num_results, true, NULL);
+  JoinRelation **results = memAlloc(sizeof(JoinRelation *), num_results, true, NULL);
 
-  for (uint32_t i = 0; i < num_htables; i++) {
+  for (uint32_t i = 0; i < num_results; i++) {
     results[i] = memAlloc(sizeof(JoinRelation), 1, true, NULL);
-    joined_rows_capacity[i] = (index[i] == NULL) ? 0 : index[i]->size;
+
+    if (num_partition_passes == 0) {
+      joined_rows_capacity[i] = i + 1 == num_results ? largest_rel->num_tuples - i * PROBE_MORSEL_SIZE : PROBE_MORSEL_SIZE;
+    } else {
+      joined_rows_capacity[i] = (index[i] == NULL) ? 0 : index[i]->size;
+    }
+
     results[i]->tuples = memAlloc(sizeof(Tuple), joined_rows_capacity[i], true, NULL);
   }
 
   start = end = 0;
-  for (uint32_t i = 0; i < num_htables; i++, start = end) {
+  for (uint32_t i = 0; i < num_results; i++, start = end) {
+    HashTable *table = NULL;
+
     if (num_partition_passes == 0) {
-      end = largest_rel->num_tuples;
+      table = index[0];
+      end += joined_rows_capacity[i];
     } else {
       if (hist_largest_rel[i] == 0) {
         continue;
       }
+
+      table = index[i];
       end += hist_largest_rel[i];
     }
 
-    JoinJobArgs *args = memAlloc(sizeof(JoinJobArgs), 1, false, NULL);
-
-    args->result = results[i];
-    args->largest_rel = largest_rel;
-    args->table = index[i];
-    args->start = start;
-    args->end = end;
-    args->joined_rows_capacity = &joined_rows_capacity[i];
-    args->relation_R_is_smallest = relation_R_is_smallest;
-
-    JobInfo *job_info = memAlloc(sizeof(JobInfo), 1, false, NULL);
-
-    job_info->args = args;
-    job_info->job = joinJob;
-    job_info->kind = JOIN_JOB;
-
-    submitJob(scheduler, job_info);
+    JoinJobArgs args;
+    args.result = results[i];
+    args.largest_rel = largest_rel;
+    args.table = table;
+    args.start = start;
+    args.end = end;
+    args.joined_rows_capacity = &joined_rows_capacity[i];
+    args.relation_R_is_smallest = relation_R_is_smallest;
+    args.smallest_wide_payloads = smallest_wide_payloads;
+    args.largest_wide_payloads = largest_wide_payloads;
+    args.cancellation = &scheduler->cancellation;
+
+    int32_t node = num_partition_passes != 0 ? (int32_t)(i >> (total_nbits - nbits1)) : -1;
+    runOrSubmitJob(joinJob, &args, sizeof(args), JOIN_JOB, node, workers, scheduler);
   }
 
   executeAllJobs(scheduler);
@@ -270,9 +755,13 @@ JoinRelation *phjoin(JoinRelation *relation_R, JoinRelation *relation_S, JobSche
 
   free(joined_rows_capacity);
 
-  JoinRelation *result = mergeResults(results, num_htables);
+  JoinRelation *result = mergeResults(results, num_results);
 
   if (num_partition_passes != 0) {
+    finishPartitioning(&smallest);
+    finishPartitioning(&largest);
+    free(smallest.offsets);
+    free(largest.offsets);
     free(hist_smallest_rel);
     free(hist_largest_rel);
     destroyJoinRelation(smallest_rel);
@@ -288,4 +777,130 @@ JoinRelation *phjoin(JoinRelation *relation_R, JoinRelation *relation_S, JobSche
   free(index);
 
   return result;
-}
\ No newline at end of file
+}
+
+JoinStrategy chooseJoinStrategy(uint32_t num_tuples_R, uint32_t num_tuples_S) {
+  uint32_t smallest = num_tuples_R < num_tuples_S ? num_tuples_R : num_tuples_S;
+  uint32_t largest = num_tuples_R < num_tuples_S ? num_tuples_S : num_tuples_R;
+
+  if ((uint64_t)smallest * largest <= NESTED_LOOP_MAX_COMPARISONS) {
+    return NESTED_LOOP_JOIN;
+  }
+
+  if (smallest <= SMALL_JOIN_MAX_BUILD && largest <= SMALL_JOIN_MAX_PROBE) {
+    return SMALL_HASH_JOIN;
+  }
+
+  return FUSED_PARTITIONED_HASH_JOIN;
+}
+
+uint32_t chooseParallelism(uint64_t cost, uint64_t execution_threads) {
+  uint64_t workers = cost / MIN_WORK_PER_TASK;
+
+  if (workers > execution_threads) {
+    workers = execution_threads;
+  }
+
+  return workers > 1 ? (uint32_t)workers : 1;
+}
+
+// The estimated cost of a hash join: building a table of the smallest relation and probing it with the largest one.
+static uint64_t joinCost(uint32_t num_tuples_R, uint32_t num_tuples_S) {
+  uint32_t smallest = num_tuples_R < num_tuples_S ? num_tuples_R : num_tuples_S;
+  uint32_t largest = num_tuples_R < num_tuples_S ? num_tuples_S : num_tuples_R;
+
+  return (uint64_t)smallest * BUILD_COST_PER_TUPLE + largest;
+}
+
+const char *joinStrategyName(JoinStrategy strategy) {
+  switch (strategy) {
+    case NESTED_LOOP_JOIN:
+      return "nested-loop";
+    case SMALL_HASH_JOIN:
+      return "small-hash";
+    case DENSE_KEY_JOIN:
+      return "dense-key";
+    case PARTITIONED_HASH_JOIN:
+      return "partitioned";
+    case FUSED_PARTITIONED_HASH_JOIN:
+      return "fused-partitioned";
+    default:
+      return "unknown";
+  }
+}
+
+// Runs the join with the given strategy, where dense_key describes the relations' dense key for DENSE_KEY_JOIN
+static JoinRelation *joinWithStrategy(JoinRelation *relation_R,
+                                      JoinRelation *relation_S,
+                                      JoinStrategy strategy,
+                                      const DenseKey *dense_key,
+                                      JobScheduler *scheduler) {
+  // The small-input strategies always run on the calling thread
+  uint32_t workers = 1;
+
+  if (strategy == PARTITIONED_HASH_JOIN || strategy == FUSED_PARTITIONED_HASH_JOIN) {
+    workers = chooseParallelism(joinCost(relation_R->num_tuples, relation_S->num_tuples), scheduler->execution_threads);
+  }
+
+  PROFILE_PRINT("phjoin: |R| = %" PRIu32 ", |S| = %" PRIu32 ", strategy = %s, workers = %" PRIu32 "\n",
+                relation_R->num_tuples, relation_S->num_tuples, joinStrategyName(strategy), workers);
+
+  switch (strategy) {
+    case NESTED_LOOP_JOIN:
+      return nestedLoopJoin(relation_R, relation_S);
+
+    case SMALL_HASH_JOIN:
+      return smallHashJoin(relation_R, relation_S);
+
+    case DENSE_KEY_JOIN:
+      return denseKeyJoin(relation_R, relation_S, dense_key);
+
+    case PARTITIONED_HASH_JOIN:
+    case FUSED_PARTITIONED_HASH_JOIN: {
+      JoinRelation *result =
+          partitionedHashJoin(relation_R, relation_S, strategy == FUSED_PARTITIONED_HASH_JOIN, workers, scheduler);
+
+      // Jobs that were cancelled midway may have left partial results behind
+      if (isCancelled(&scheduler->cancellation)) {
+        result->num_tuples = 0;
+      }
+
+      return result;
+    }
+
+    default:
+      assert(false);  // This shouldn't be called
+      return NULL;
+  }
+}
+
+JoinRelation *phjoinWithStrategy(JoinRelation *relation_R,
+                                 JoinRelation *relation_S,
+                                 JoinStrategy strategy,
+                                 JobScheduler *scheduler) {
+  DenseKey dense_key;
+
+  if (strategy == DENSE_KEY_JOIN) {
+    bool found = findDenseKeyOf(relation_R, relation_S, &dense_key);
+    assert(found);
+    (void)found;
+  }
+
+  return joinWithStrategy(relation_R, relation_S, strategy, &dense_key, scheduler);
+}
+
+JoinRelation *phjoin(JoinRelation *relation_R, JoinRelation *relation_S, JobScheduler *scheduler) {
+  JoinStrategy strategy = chooseJoinStrategy(relation_R->num_tuples, relation_S->num_tuples);
+
+  // Indexing a dense key by value beats hashing it, but only runs on the calling thread, so it's left out of the joins
+  // that are large enough to be spread over several threads
+  DenseKey dense_key;
+  bool single_threaded = chooseParallelism(joinCost(relation_R->num_tuples, relation_S->num_tuples),
+                                           scheduler->execution_threads) == 1;
+
+  if (strategy != NESTED_LOOP_JOIN && single_threaded && findDenseKeyOf(relation_R, relation_S, &dense_key)) {
+    strategy = DENSE_KEY_JOIN;
+  }
+
+  return joinWithStrategy(relation_R, relation_S, strategy, &dense_key, scheduler);
+}
@@ -6,18 +6,21 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "helpers.h"
+#include "index.h"
 #include "phjoin.h"
 #include "relation.h"
 
 static void setFilter(
-    FilterPredicate *filter, uint32_t table, uint32_t alias, uint32_t index, uint32_t value, Operator operator) {
+    FilterPredicate *filter, uint32_t table, uint32_t alias, uint32_t index, uint64_t value, Operator operator) {
   filter->column.table = table;
   filter->column.alias = alias;
   filter->column.index = index;
   filter->value = value;
   filter->operator= operator;
+  filter->selectivity = 1;
 }
 
 Query *parseQuery(FILE *fp) {
@@ -34,7 +37,8 @@ Query *parseQuery(FILE *fp) {
   query->num_relations = num_relations;
 
   uint32_t ch;
-  uint32_t table1, index1, table2, index2, value;
+  uint32_t table1, index1, table2, index2;
+  uint64_t value;
 
   // Scan join / filter predicates
   do {
@@ -43,13 +47,15 @@ Query *parseQuery(FILE *fp) {
       case '>':
         // Fall-through
       case '<':
-        assert(fscanf(fp, "%" SCNu32, &value) == 1);
+        assert(fscanf(fp, "%" SCNu64, &value) == 1);
         setFilter(&query->filters[query->num_filters++], aliases[table1], table1, index1, value, ch == '>' ? GT : LT);
         break;
 
       default:
-        assert(fscanf(fp, "%" SCNu32, &table2) == 1);
+        // This is either a table (join) or a constant (filter), so it's scanned in 64 bits and narrowed if needed
+        assert(fscanf(fp, "%" SCNu64, &value) == 1);
         if ((ch = fgetc(fp)) == '.') {
+          table2 = (uint32_t)value;
           assert(fscanf(fp, "%" SCNu32, &index2) == 1);
           query->joins[query->num_joins].left.table = aliases[table1];
           query->joins[query->num_joins].left.alias = table1;
@@ -60,7 +66,7 @@ Query *parseQuery(FILE *fp) {
           query->num_joins++;
         } else {
           ungetc(ch, fp);
-          setFilter(&query->filters[query->num_filters++], aliases[table1], table1, index1, value = table2, EQ);
+          setFilter(&query->filters[query->num_filters++], aliases[table1], table1, index1, value, EQ);
         }
         break;
     }
@@ -78,72 +84,328 @@ Query *parseQuery(FILE *fp) {
   return query;
 }
 
-static bool predicateHolds(Operator op, uint32_t column, uint32_t value) {
-  if (op == LT) {
-    return column < value;
-  } else if (op == GT) {
-    return column > value;
+// Arguments of a job that evaluates a filter on a morsel: either the rows [first_row + start, first_row + end), or,
+// when refining, the row IDs in positions [start, end) of ids. In both cases, the selected row IDs are written from
+// ids + start onwards.
+typedef struct filter_job_args {
+  const FusedFilter *filter;
+  uint32_t *ids;
+  uint32_t first_row;
+  uint32_t start;
+  uint32_t end;
+  bool refine;
+
+  // Where to write the number of selected rows, and, when not refining, to count the zones (see ZoneMatch)
+  uint32_t *count;
+  uint64_t *zone_counts;
+
+  CancellationToken *cancellation;
+} FilterJobArgs;
+
+static void filterJob(void *args_) {
+  FilterJobArgs *args = args_;
+
+  if (isCancelled(args->cancellation)) {
+    *args->count = 0;
+  } else if (args->refine) {
+    *args->count = refineFusedSelection(args->filter, args->ids + args->start, args->end - args->start,
+                                        args->ids + args->start);
   } else {
-    return column == value;
+    *args->count = selectFusedRowsByZone(args->filter, args->first_row + args->start, args->first_row + args->end,
+                                         args->ids + args->start, args->zone_counts);
   }
 }
 
-RowIDs **applyFilters(Relation **relations, RowIDs **filter_inters, Query *query, bool *empty_result) {
+// Evaluates filter on the rows [first_row, first_row + num_rows) of a relation, or, when refining, on the num_rows row
+// IDs of ids (with first_row 0), and writes the ones that pass to ids, in order. Relations that span several morsels
+// are scanned by the scheduler's threads, each morsel into its own part of ids, and the morsels' selections are then
+// moved next to each other.
+// Scans of whole relations go zone by zone, and add the number of zones of each kind to zone_counts.
+static uint32_t filterMorsels(const FusedFilter *filter,
+                              uint32_t *ids,
+                              uint32_t first_row,
+                              uint32_t num_rows,
+                              bool refine,
+                              uint64_t *zone_counts,
+                              JobScheduler *scheduler) {
+  uint32_t num_morsels = (num_rows + FILTER_MORSEL_SIZE - 1) / FILTER_MORSEL_SIZE;
+
+  if (num_morsels <= 1) {
+    return refine ? refineFusedSelection(filter, ids, num_rows, ids)
+                  : selectFusedRowsByZone(filter, first_row, first_row + num_rows, ids, zone_counts);
+  }
+
+  uint32_t *counts = memAlloc(sizeof(uint32_t), num_morsels, false, NULL);
+  uint64_t *morsel_zone_counts = memAlloc(sizeof(uint64_t), 3 * num_morsels, true, NULL);
+
+  for (uint32_t i = 0; i < num_morsels; i++) {
+    JobInfo *job_info = createJob(scheduler, filterJob, sizeof(FilterJobArgs), FILTER_JOB);
+    FilterJobArgs *args = job_info->args;
+
+    args->filter = filter;
+    args->ids = ids;
+    args->first_row = first_row;
+    args->start = i * FILTER_MORSEL_SIZE;
+    args->end = i + 1 == num_morsels ? num_rows : (i + 1) * FILTER_MORSEL_SIZE;
+    args->refine = refine;
+    args->count = &counts[i];
+    args->zone_counts = &morsel_zone_counts[3 * i];
+    args->cancellation = &scheduler->cancellation;
+
+    submitJob(scheduler, job_info);
+  }
+
+  executeAllJobs(scheduler);
+  waitAllJobs(scheduler);
+
+  // Each morsel's selection starts at the morsel's first position, which is past the end of the previous ones
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < num_morsels; i++) {
+    memmove(ids + count, ids + i * FILTER_MORSEL_SIZE, counts[i] * sizeof(uint32_t));
+    count += counts[i];
+
+    if (zone_counts != NULL) {
+      for (uint32_t match = 0; match < 3; match++) {
+        zone_counts[match] += morsel_zone_counts[3 * i + match];
+      }
+    }
+  }
+
+  free(morsel_zone_counts);
+  free(counts);
+
+  return count;
+}
+
+RowIDs **applyFilters(
+    Relation **relations, RowIDs **filter_inters, Query *query, bool *empty_result, JobScheduler *scheduler) {
+  // The number of zones that the scans skipped, scanned and accepted as a whole (indexed by ZoneMatch)
+  uint64_t zone_counts[3] = {0, 0, 0};
+
   for (uint32_t filter = 0; filter < query->num_filters; filter++) {
-    // The relation to be filtered
     uint32_t relation = query->filters[filter].column.table;
     uint32_t relation_alias = query->filters[filter].column.alias;
 
-    // The relation's column that's referenced in the filter
-    uint64_t *column = relations[relation]->columns[query->filters[filter].column.index];
+    // All the filters on this relation were applied along with the first one
+    bool applied = false;
+    for (uint32_t previous = 0; previous < filter; previous++) {
+      applied |= query->filters[previous].column.alias == relation_alias;
+    }
 
-    // Case: first time we're applying a filter to this relation
-    if (filter_inters[relation_alias] == NULL) {
-      for (uint32_t row_id = 0; row_id < (uint32_t)relations[relation]->num_tuples; row_id++) {
-        if (predicateHolds(query->filters[filter].operator,(uint32_t) column[row_id], query->filters[filter].value)) {
-          addRowID(row_id, &filter_inters[relation_alias]);
-        }
+    if (applied) {
+      continue;
+    }
+
+    assert(filter_inters[relation_alias] == NULL);
+
+    // The filters on one of the relation's sorted columns pass a contiguous range of rows, which is found by binary
+    // search, so that only the rows in it are scanned for the rest of its filters
+    bool *sorted = relations[relation]->sorted;
+    uint32_t sorted_column = UINT32_MAX;
+
+    for (uint32_t next = filter; next < query->num_filters && sorted != NULL; next++) {
+      if (query->filters[next].column.alias == relation_alias && sorted[query->filters[next].column.index]) {
+        sorted_column = query->filters[next].column.index;
+        break;
       }
+    }
 
-      if (filter_inters[relation_alias] == NULL) {
-        *empty_result = true;
-        return filter_inters;
+    // Otherwise, if all its filters are on columns with bitmap indexes, they're answered by combining the bitmaps of
+    // the values they accept, without scanning the columns at all
+    BitmapIndex **bitmap_indexes = relations[relation]->bitmap_indexes;
+    bool use_bitmaps = bitmap_indexes != NULL && sorted_column == UINT32_MAX;
+
+    for (uint32_t next = filter; next < query->num_filters && use_bitmaps; next++) {
+      FilterPredicate *predicate = &query->filters[next];
+      use_bitmaps = predicate->column.alias != relation_alias || bitmap_indexes[predicate->column.index] != NULL;
+    }
+
+    // Otherwise, its most selective equality filter can look its rows up in the point index of its column instead of
+    // scanning it
+    FilterPredicate *lookup = NULL;
+    PointIndex *point_index = NULL;
+    bool use_lookup = !use_bitmaps && sorted_column == UINT32_MAX;
+
+    for (uint32_t next = filter; next < query->num_filters && use_lookup; next++) {
+      if (query->filters[next].column.alias == relation_alias && query->filters[next].operator== EQ) {
+        lookup = &query->filters[next];
+        break;
       }
+    }
 
-      // Case: this relation has been filtered before
-    } else {
-      // The new filtered array
-      RowIDs *filtered_RowIDs = NULL;
+    if (lookup != NULL) {
+      point_index = getPointIndex(relations[relation], lookup->column.index);
+    }
+
+    // Fuse this filter and all the following ones on the same relation into a single predicate, so that the
+    // relation is scanned only once (and the predicates on the same column are checked as a single range). If the
+    // first filter is expected to be very selective though (or the rows were looked up in an index), the predicates
+    // on its column are checked on their own, and the rest only on the rows that pass them.
+    uint32_t lead_column = query->filters[filter].column.index;
+    bool gather_rest = query->filters[filter].selectivity * GATHER_COST < 1;
+    double expected_selectivity = 1;
+
+    FusedFilter lead, rest, sorted_range;
+    initializeFusedFilter(&lead);
+    initializeFusedFilter(&rest);
+    initializeFusedFilter(&sorted_range);
+
+    // The bitmap index of the column of each of the lead's ranges, if they're used
+    BitmapIndex *lead_bitmaps[MAX_FUSED_COLUMNS];
 
-      // Instead of the relation we scan only the filtered row IDs
-      for (uint32_t index = 0; index < filter_inters[relation_alias]->count; index++) {
-        // The actual row ID of the relation
-        uint32_t row_id = filter_inters[relation_alias]->ids[index];
+    for (uint32_t next = filter; next < query->num_filters; next++) {
+      FilterPredicate *predicate = &query->filters[next];
 
-        // The same filtering as the trivial case and adding to the new array
-        if (predicateHolds(query->filters[filter].operator,(uint32_t) column[row_id], query->filters[filter].value)) {
-          addRowID(row_id, &filtered_RowIDs);
+      if (predicate->column.alias == relation_alias) {
+        expected_selectivity *= predicate->selectivity;
+
+        if (point_index != NULL && predicate == lookup) {
+          continue;
+        }
+
+        uint32_t index = predicate->column.index;
+        const Zone *zones = relations[relation]->zones != NULL ? relations[relation]->zones[index] : NULL;
+
+        if (index == sorted_column) {
+          addFilterPredicate(&sorted_range, relations[relation]->columns[index], zones, predicate->operator,
+                             predicate->value);
+          continue;
+        }
+
+        // The rows that pass a sorted column's filters are contiguous, so the rest of the columns are read sequentially
+        bool gathered = !use_bitmaps && sorted_column == UINT32_MAX &&
+                        (point_index != NULL || (gather_rest && predicate->column.index != lead_column));
+
+        uint32_t num_ranges = lead.num_ranges;
+        addFilterPredicate(gathered ? &rest : &lead, relations[relation]->columns[index], zones, predicate->operator,
+                           predicate->value);
+
+        // The predicates on a column that already has a range are merged into it
+        if (use_bitmaps && lead.num_ranges > num_ranges) {
+          lead_bitmaps[num_ranges] = bitmap_indexes[index];
         }
       }
+    }
 
-      if (filtered_RowIDs == NULL) {
-        *empty_result = true;
-        return filter_inters;
+    // Case: the relation's rows are looked up in a point index, so the selection is sized for them alone
+    if (point_index != NULL) {
+      const uint32_t *row_ids;
+      uint32_t count = lookupPointIndex(point_index, lookup->value, &row_ids);
+
+      RowIDs *selection = memAlloc(sizeof(RowIDs), 1, false, NULL);
+      selection->ids = memAlloc(sizeof(uint32_t), count > 0 ? count : 1, false, NULL);
+      memcpy(selection->ids, row_ids, count * sizeof(uint32_t));
+      selection->count = selection->capacity = count;
+
+      filter_inters[relation_alias] = selection;
+
+      // Case: the filters on a sorted column narrow the relation down to a range of rows, so only those are scanned
+    } else if (sorted_column != UINT32_MAX) {
+      uint32_t first_row = 0, end_row = (uint32_t)relations[relation]->num_tuples;
+
+      if (sorted_range.never_holds) {
+        end_row = first_row;
+      } else {
+        findSortedRows(&sorted_range.ranges[0], &first_row, &end_row);
       }
 
-      free(filter_inters[relation_alias]);
-      filter_inters[relation_alias] = filtered_RowIDs;
+      RowIDs *selection = memAlloc(sizeof(RowIDs), 1, false, NULL);
+      selection->ids = memAlloc(sizeof(uint32_t), end_row > first_row ? end_row - first_row : 1, false, NULL);
+      selection->count =
+          filterMorsels(&lead, selection->ids, first_row, end_row - first_row, false, zone_counts, scheduler);
+      selection->capacity = end_row - first_row;
+
+      filter_inters[relation_alias] = selection;
+
+      // Case: the relation's filters are answered by its bitmap indexes, whose rows are converted to IDs at the end
+    } else if (use_bitmaps) {
+      uint32_t num_tuples = (uint32_t)relations[relation]->num_tuples;
+
+      RowIDs *selection = memAlloc(sizeof(RowIDs), 1, false, NULL);
+      selection->ids = memAlloc(sizeof(uint32_t), num_tuples > 0 ? num_tuples : 1, false, NULL);
+      selection->count = selectRowsByBitmaps(&lead, lead_bitmaps, num_tuples, selection->ids);
+      selection->capacity = num_tuples;
+
+      filter_inters[relation_alias] = selection;
+
+      // Case: every row of the relation is scanned, so the selection is sized for all of them
+    } else {
+      // The kernels gather values with signed 32-bit row IDs
+      assert(relations[relation]->num_tuples < ((uint64_t)1 << 31));
+      uint32_t num_tuples = (uint32_t)relations[relation]->num_tuples;
+
+      RowIDs *selection = memAlloc(sizeof(RowIDs), 1, false, NULL);
+      selection->ids = memAlloc(sizeof(uint32_t), num_tuples > 0 ? num_tuples : 1, false, NULL);
+      selection->count = filterMorsels(&lead, selection->ids, 0, num_tuples, false, zone_counts, scheduler);
+      selection->capacity = num_tuples;
+
+      filter_inters[relation_alias] = selection;
+    }
+
+    RowIDs *selection = filter_inters[relation_alias];
+    if (rest.num_ranges > 0) {
+      selection->count = filterMorsels(&rest, selection->ids, 0, selection->count, true, NULL, scheduler);
+    }
+
+    uint64_t num_tuples = relations[relation]->num_tuples;
+    const char *method = point_index != NULL ? " (index)" : use_bitmaps ? " (bitmaps)" : "";
+    method = sorted_column != UINT32_MAX ? " (sorted)" : method;
+    PROFILE_PRINT("filters on %" PRIu32 ": expected selectivity %.4f, actual %.4f%s\n", relation_alias,
+                  expected_selectivity, num_tuples > 0 ? (double)selection->count / num_tuples : 1.0,
+                  rest.num_ranges > 0 ? " (gathered)" : method);
+
+    // A cancelled query's morsels may have been skipped, so its result is reported as empty
+    if (filter_inters[relation_alias]->count == 0 || isCancelled(&scheduler->cancellation)) {
+      *empty_result = true;
+      break;
+    }
+  }
+
+  PROFILE_PRINT("zones: %" PRIu64 " skipped, %" PRIu64 " scanned, %" PRIu64 " accepted\n", zone_counts[ZONE_NONE],
+                zone_counts[ZONE_SOME], zone_counts[ZONE_ALL]);
+
+  if (*empty_result) {
+    return filter_inters;
+  }
+
+  // Give back the space of the rows that were filtered out
+  for (uint32_t alias = 0; alias < query->num_relations; alias++) {
+    RowIDs *selection = filter_inters[alias];
+
+    if (selection != NULL && selection->count < selection->capacity) {
+      selection->ids = memAlloc(sizeof(uint32_t), selection->count, false, selection->ids);
+      selection->capacity = selection->count;
     }
   }
 
   return filter_inters;
 }
 
-JoinRelation *buildJoinRelation(RowIDs *joined_row_ids, RowIDs *filtered_row_ids, Relation *relation, uint32_t column) {
+// Sets the i-th tuple of a JoinRelation, keeping the full value in the relation's wide payloads if it doesn't fit in 32 bits
+static void setJoinTuple(JoinRelation *join_rel, uint32_t i, uint64_t value) {
+  join_rel->tuples[i].key = i;
+  join_rel->tuples[i].payload = FOLD_PAYLOAD(value);
+
+  if (join_rel->wide_payloads == NULL && value > UINT32_MAX) {
+    // All the previous values fit in 32 bits, so they're equal to their payloads
+    join_rel->wide_payloads = memAlloc(sizeof(uint64_t), join_rel->num_tuples, false, NULL);
+    for (uint32_t j = 0; j < i; j++) {
+      join_rel->wide_payloads[j] = join_rel->tuples[j].payload;
+    }
+  }
+
+  if (join_rel->wide_payloads != NULL) {
+    join_rel->wide_payloads[i] = value;
+  }
+}
+
+JoinRelation *buildJoinRelation(const uint32_t *row_ids, uint32_t num_rows, Relation *relation, uint32_t column) {
   uint64_t *column_ = relation->columns[column];
 
   JoinRelation *join_rel = memAlloc(sizeof(JoinRelation), 1, false, NULL);
-  RowIDs *row_ids = (joined_row_ids == NULL) ? filtered_row_ids : joined_row_ids;
+
+  join_rel->wide_payloads = NULL;
+  join_rel->unique = false;
 
   // Case: relation not in intermediate results => build a JoinRelation from scratch
   if (row_ids == NULL) {
@@ -151,31 +413,252 @@ JoinRelation *buildJoinRelation(RowIDs *joined_row_ids, RowIDs *filtered_row_ids
     join_rel->tuples = memAlloc(sizeof(Tuple), join_rel->num_tuples, false, NULL);
 
     for (uint32_t row_id = 0; row_id < (uint32_t)relation->num_tuples; row_id++) {
-      join_rel->tuples[row_id].key = row_id;
-      join_rel->tuples[row_id].payload = (uint32_t)column_[row_id];
+      setJoinTuple(join_rel, row_id, column_[row_id]);
     }
 
     // Case: relation in intermediate results => build a JoinRelation using the corresponding row IDs
   } else {
-    join_rel->num_tuples = row_ids->count;
+    join_rel->num_tuples = num_rows;
     join_rel->tuples = memAlloc(sizeof(Tuple), join_rel->num_tuples, false, NULL);
 
-    for (uint32_t i = 0; i < row_ids->count; i++) {
-      join_rel->tuples[i].key = i;
-      join_rel->tuples[i].payload = (uint32_t)column_[row_ids->ids[i]];
+    for (uint32_t i = 0; i < num_rows; i++) {
+      setJoinTuple(join_rel, i, column_[row_ids[i]]);
     }
   }
 
   return join_rel;
 }
 
-RowIDs **applyJoins(Relation **relations,
-                    RowIDs **join_inters,
-                    RowIDs **filter_inters,
-                    Query *query,
-                    bool *empty_result,
-                    JobScheduler *scheduler) {
+Intermediate *createIntermediate(uint32_t num_aliases, uint32_t aliases, uint32_t num_rows) {
+  assert(num_aliases <= 32);
+
+  uint32_t num_columns = (uint32_t)__builtin_popcount(aliases);
+  uint64_t size = sizeof(Intermediate) + num_aliases * sizeof(uint32_t *) +
+                  (uint64_t)num_columns * num_rows * sizeof(uint32_t);
+  assert(size <= UINT32_MAX);
+
+  // The columns follow the header and its array of pointers to them
+  Intermediate *inter = memAlloc(1, (uint32_t)size, false, NULL);
+  inter->num_rows = num_rows;
+  inter->num_aliases = num_aliases;
+
+  uint32_t *ids = (uint32_t *)&inter->columns[num_aliases];
+  for (uint32_t alias = 0; alias < num_aliases; alias++) {
+    inter->columns[alias] = NULL;
+
+    if (aliases & POW2(alias)) {
+      inter->columns[alias] = ids;
+      ids += num_rows;
+    }
+  }
+
+  return inter;
+}
+
+void gatherRowIDs(uint32_t *target, const uint32_t *source, const uint32_t *positions, uint32_t count) {
+  if (source == NULL) {
+    memcpy(target, positions, count * sizeof(uint32_t));
+    return;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    target[i] = source[positions[i]];
+  }
+}
+
+void gatherJoinedRowIDs(uint32_t *target, const uint32_t *source, const Tuple *tuples, uint32_t count, bool payloads) {
+  // Each case gets a loop of its own, so that none of them branches per tuple
+  if (source == NULL && payloads) {
+    for (uint32_t i = 0; i < count; i++) {
+      target[i] = tuples[i].payload;
+    }
+  } else if (source == NULL) {
+    for (uint32_t i = 0; i < count; i++) {
+      target[i] = tuples[i].key;
+    }
+  } else if (payloads) {
+    for (uint32_t i = 0; i < count; i++) {
+      target[i] = source[tuples[i].payload];
+    }
+  } else {
+    for (uint32_t i = 0; i < count; i++) {
+      target[i] = source[tuples[i].key];
+    }
+  }
+}
+
+// Returns whether an alias has been joined before, i.e. whether it's in the intermediate result
+static bool isJoined(const Intermediate *join_inter, uint32_t alias) {
+  return join_inter != NULL && join_inter->columns[alias] != NULL;
+}
+
+// Returns the aliases of an intermediate result, with the same bits as in createIntermediate
+static uint32_t joinedAliases(const Intermediate *join_inter) {
+  uint32_t aliases = 0;
+
+  for (uint32_t alias = 0; join_inter != NULL && alias < join_inter->num_aliases; alias++) {
+    aliases |= join_inter->columns[alias] != NULL ? POW2(alias) : 0;
+  }
+
+  return aliases;
+}
+
+// Arguments of a job that applies a join on two aliases that have been joined before to the rows [start, end) of an
+// intermediate result. The job first selects the positions of the rows that pass, writing them from positions + start
+// onwards, and then, once every morsel's offset in the new intermediate is known, compacts them into it.
+typedef struct join_filter_job_args {
+  const Intermediate *join_inter;
+  const uint64_t *left_column;
+  const uint64_t *right_column;
+  uint32_t left_alias;
+  uint32_t right_alias;
+  uint32_t *positions;
+  uint32_t start;
+  uint32_t end;
+
+  // Where to write the number of selected rows, and, when compacting, where to write them from (NULL when selecting)
+  uint32_t *count;
+  Intermediate *new_inter;
+  uint32_t offset;
+
+  CancellationToken *cancellation;
+} JoinFilterJobArgs;
+
+// Copies the rows of an intermediate result at the given positions to the rows of another one with the same aliases,
+// from the given offset onwards, a column at a time
+static void compactRows(
+    const Intermediate *join_inter, const uint32_t *positions, uint32_t count, Intermediate *new_inter, uint32_t offset) {
+  for (uint32_t alias = 0; alias < join_inter->num_aliases; alias++) {
+    if (join_inter->columns[alias] != NULL) {
+      gatherRowIDs(new_inter->columns[alias] + offset, join_inter->columns[alias], positions, count);
+    }
+  }
+}
+
+static void joinFilterJob(void *args_) {
+  JoinFilterJobArgs *args = args_;
+
+  if (isCancelled(args->cancellation)) {
+    *args->count = 0;
+  } else if (args->new_inter == NULL) {
+    *args->count = selectEqualRows(args->left_column, args->join_inter->columns[args->left_alias], args->right_column,
+                                   args->join_inter->columns[args->right_alias], args->start, args->end,
+                                   args->positions + args->start);
+  } else {
+    compactRows(args->join_inter, args->positions + args->start, *args->count, args->new_inter, args->offset);
+  }
+}
+
+// Submits a job per morsel of an intermediate result, in the given phase of joinFilterJob, and waits for them
+static void runJoinFilterJobs(const JoinFilterJobArgs *template, uint32_t *counts, JobScheduler *scheduler) {
+  uint32_t num_morsels = (template->join_inter->num_rows + FILTER_MORSEL_SIZE - 1) / FILTER_MORSEL_SIZE;
+
+  for (uint32_t i = 0, offset = 0; i < num_morsels; i++) {
+    JobInfo *job_info = createJob(scheduler, joinFilterJob, sizeof(JoinFilterJobArgs), JOIN_FILTER_JOB);
+    JoinFilterJobArgs *args = job_info->args;
+
+    *args = *template;
+    args->start = i * FILTER_MORSEL_SIZE;
+    args->end = i + 1 == num_morsels ? template->join_inter->num_rows : (i + 1) * FILTER_MORSEL_SIZE;
+    args->count = &counts[i];
+    args->offset = offset;
+
+    // The counts are only known once the morsels have been selected, and are then used to compact them
+    if (template->new_inter != NULL) {
+      offset += counts[i];
+    }
+
+    submitJob(scheduler, job_info);
+  }
+
+  executeAllJobs(scheduler);
+  waitAllJobs(scheduler);
+}
+
+// Applies the join left_column = right_column on two aliases of an intermediate result, which have both been joined
+// before, so the join is a filter on its rows, and returns the new intermediate that holds the rows that pass, or NULL
+// if none of them do. The rows are checked by selectEqualRows, which gathers and compares the two columns' values in
+// batches, and then every column is compacted in one pass over the selected positions. Intermediates that span
+// several morsels (see FILTER_MORSEL_SIZE) are checked, and then compacted, by the scheduler's threads, with each
+// morsel's rows moved to its offset in the new intermediate, so the rows stay in order.
+static Intermediate *applyJoinFilter(const Intermediate *join_inter,
+                                     const uint64_t *left_column,
+                                     uint32_t left_alias,
+                                     const uint64_t *right_column,
+                                     uint32_t right_alias,
+                                     JobScheduler *scheduler) {
+  uint32_t num_rows = join_inter->num_rows;
+  uint32_t num_morsels = (num_rows + FILTER_MORSEL_SIZE - 1) / FILTER_MORSEL_SIZE;
+  uint32_t *positions = memAlloc(sizeof(uint32_t), num_rows > 0 ? num_rows : 1, false, NULL);
+
+  JoinFilterJobArgs template = {.join_inter = join_inter,
+                                .left_column = left_column,
+                                .right_column = right_column,
+                                .left_alias = left_alias,
+                                .right_alias = right_alias,
+                                .positions = positions,
+                                .new_inter = NULL,
+                                .cancellation = &scheduler->cancellation};
+
+  uint32_t count = 0, *counts = NULL;
+
+  if (num_morsels <= 1) {
+    count = selectEqualRows(left_column, join_inter->columns[left_alias], right_column, join_inter->columns[right_alias],
+                            0, num_rows, positions);
+  } else {
+    counts = memAlloc(sizeof(uint32_t), num_morsels, false, NULL);
+    runJoinFilterJobs(&template, counts, scheduler);
+
+    for (uint32_t i = 0; i < num_morsels; i++) {
+      count += counts[i];
+    }
+  }
+
+  Intermediate *new_inter = NULL;
+
+  if (count > 0) {
+    new_inter = createIntermediate(join_inter->num_aliases, joinedAliases(join_inter), count);
+
+    if (num_morsels <= 1) {
+      compactRows(join_inter, positions, count, new_inter, 0);
+    } else {
+      template.new_inter = new_inter;
+      runJoinFilterJobs(&template, counts, scheduler);
+    }
+  }
+
+  free(counts);
+  free(positions);
+
+  return new_inter;
+}
+
+// Builds the JoinRelation of a join's side from the rows of its alias that are in the intermediate result, or the ones
+// that passed its filters if it hasn't been joined yet
+static JoinRelation *buildJoinSide(
+    const Intermediate *join_inter, RowIDs **filter_inters, Relation *relation, uint32_t alias, uint32_t column) {
+  if (isJoined(join_inter, alias)) {
+    return buildJoinRelation(join_inter->columns[alias], join_inter->num_rows, relation, column);
+  }
+
+  if (filter_inters[alias] != NULL) {
+    return buildJoinRelation(filter_inters[alias]->ids, filter_inters[alias]->count, relation, column);
+  }
+
+  return buildJoinRelation(NULL, 0, relation, column);
+}
+
+Intermediate *applyJoins(
+    Relation **relations, RowIDs **filter_inters, Query *query, bool *empty_result, JobScheduler *scheduler) {
+  Intermediate *join_inter = NULL;
+
   for (uint32_t join = 0; join < query->num_joins; join++) {
+    if (isCancelled(&scheduler->cancellation)) {
+      *empty_result = true;
+      destroyIntermediate(join_inter);
+      return NULL;
+    }
+
     // The left relation
     uint32_t left_relation_table = query->joins[join].left.table;
     uint32_t left_relation_alias = query->joins[join].left.alias;
@@ -186,45 +669,37 @@ RowIDs **applyJoins(Relation **relations,
     uint32_t right_relation_alias = query->joins[join].right.alias;
     uint32_t right_column = query->joins[join].right.index;
 
+    bool left_joined = isJoined(join_inter, left_relation_alias);
+    bool right_joined = isJoined(join_inter, right_relation_alias);
+
     // Case: both relations have been joined before, so we actually apply a filter on the intermediate results
-    if (join_inters[left_relation_alias] != NULL && join_inters[right_relation_alias] != NULL) {
-      RowIDs **new_join_inters = memAlloc(sizeof(RowIDs *), query->num_relations, true, NULL);
-
-      uint64_t *left_column_ = relations[left_relation_table]->columns[left_column];
-      uint64_t *right_column_ = relations[right_relation_table]->columns[right_column];
-
-      bool none_remaining = true;
-      for (uint32_t inters_index = 0; inters_index < join_inters[left_relation_alias]->count; inters_index++) {
-        uint32_t row_id_left = join_inters[left_relation_alias]->ids[inters_index];
-        uint32_t row_id_right = join_inters[right_relation_alias]->ids[inters_index];
-
-        if (predicateHolds(EQ, (uint32_t)left_column_[row_id_left], (uint32_t)right_column_[row_id_right])) {
-          for (uint32_t relation_alias = 0; relation_alias < query->num_relations; relation_alias++) {
-            if (join_inters[relation_alias] != NULL) {
-              none_remaining = false;
-              addRowID(join_inters[relation_alias]->ids[inters_index], &new_join_inters[relation_alias]);
-            }
-          }
-        }
-      }
+    if (left_joined && right_joined) {
+      Intermediate *new_inter =
+          applyJoinFilter(join_inter, relations[left_relation_table]->columns[left_column], left_relation_alias,
+                          relations[right_relation_table]->columns[right_column], right_relation_alias, scheduler);
+
+      destroyIntermediate(join_inter);
+      join_inter = new_inter;
 
-      if (none_remaining) {
-        destroyInters(new_join_inters, query->num_relations);
+      // The morsels that were cancelled selected none of their rows (or weren't compacted), so the result is incomplete
+      if (join_inter == NULL || isCancelled(&scheduler->cancellation)) {
+        destroyIntermediate(join_inter);
         *empty_result = true;
-        return join_inters;
+        return NULL;
       }
 
-      destroyInters(join_inters, query->num_relations);
-      join_inters = new_join_inters;
-
       // Case: either relation doesn't appear in the intermediate results, so we need to execute a join
     } else {
       // Prepare for calling phjoin by creating the appropriate JoinRelation objects
-      JoinRelation *join_left_relation = buildJoinRelation(join_inters[left_relation_alias], filter_inters[left_relation_alias],
-                                                           relations[left_relation_table], left_column);
+      JoinRelation *join_left_relation = buildJoinSide(
+          join_inter, filter_inters, relations[left_relation_table], left_relation_alias, left_column);
+
+      JoinRelation *join_right_relation = buildJoinSide(
+          join_inter, filter_inters, relations[right_relation_table], right_relation_alias, right_column);
 
-      JoinRelation *join_right_relation = buildJoinRelation(
-          join_inters[right_relation_alias], filter_inters[right_relation_alias], relations[right_relation_table], right_column);
+      // The rows of a key are distinct until they're joined with another relation, which may repeat them
+      join_left_relation->unique = query->joins[join].left_key && !left_joined;
+      join_right_relation->unique = query->joins[join].right_key && !right_joined;
 
       JoinRelation *join_results = phjoin(join_left_relation, join_right_relation, scheduler);
 
@@ -233,81 +708,59 @@ RowIDs **applyJoins(Relation **relations,
 
       if (join_results->num_tuples == 0) {
         destroyJoinRelation(join_results);
+        destroyIntermediate(join_inter);
         *empty_result = true;
-        return join_inters;
+        return NULL;
       }
 
-      // Case: neither relation exists in the intermediate results
-      if (join_inters[left_relation_alias] == NULL && join_inters[right_relation_alias] == NULL) {
-        for (uint32_t i = 0; i < join_results->num_tuples; i++) {
-          if (filter_inters[left_relation_alias] == NULL) {
-            addRowID(join_results->tuples[i].key, &join_inters[left_relation_alias]);
-          } else {
-            addRowID(filter_inters[left_relation_alias]->ids[join_results->tuples[i].key], &join_inters[left_relation_alias]);
-          }
-        }
+      // The keys of the results are the positions of the left side's rows, and the payloads those of the right side's,
+      // so every column of the new intermediate is gathered from either of them. The rows of the relations that have
+      // been joined before come from the old intermediate, and the rows of the new ones from their filter results.
+      uint32_t aliases = joinedAliases(join_inter) | POW2(left_relation_alias) | POW2(right_relation_alias);
+      Intermediate *new_inter = createIntermediate(query->num_relations, aliases, join_results->num_tuples);
 
-        for (uint32_t i = 0; i < join_results->num_tuples; i++) {
-          if (filter_inters[right_relation_alias] == NULL) {
-            addRowID(join_results->tuples[i].payload, &join_inters[right_relation_alias]);
-          } else {
-            addRowID(filter_inters[right_relation_alias]->ids[join_results->tuples[i].payload],
-                     &join_inters[right_relation_alias]);
-          }
+      for (uint32_t alias = 0; alias < query->num_relations; alias++) {
+        if (isJoined(join_inter, alias)) {
+          gatherJoinedRowIDs(new_inter->columns[alias], join_inter->columns[alias], join_results->tuples,
+                             join_results->num_tuples, right_joined);
         }
+      }
 
-        // Case: one of the two relations exists in the intermediate results
-      } else {
-        // Remember which of the two it is
-        uint32_t old_relation_alias = join_inters[right_relation_alias] == NULL ? left_relation_alias : right_relation_alias;
-        uint32_t new_relation_alias = join_inters[left_relation_alias] == NULL ? left_relation_alias : right_relation_alias;
-
-        RowIDs **new_inters = memAlloc(sizeof(RowIDs *), query->num_relations, true, NULL);
-
-        // Move those row ids of the current intermediate results to the new ones, only if the corresponding entry for the
-        // relation in the results was included in the join table (the "new" relation that didn't appear in the intermediate
-        // results before will be updated in the code after the inner for loop)
-
-        for (uint32_t join_rel_index = 0; join_rel_index < join_results->num_tuples; join_rel_index++) {
-          for (uint32_t relation = 0; relation < query->num_relations; relation++) {
-            if (join_inters[relation] != NULL && relation != new_relation_alias) {
-              if (old_relation_alias == left_relation_alias) {
-                addRowID(join_inters[relation]->ids[join_results->tuples[join_rel_index].key], &new_inters[relation]);
-              } else {
-                addRowID(join_inters[relation]->ids[join_results->tuples[join_rel_index].payload], &new_inters[relation]);
-              }
-            }
-          }
-
-          uint32_t target_index = old_relation_alias == left_relation_alias ? join_results->tuples[join_rel_index].payload
-                                                                            : join_results->tuples[join_rel_index].key;
-          if (filter_inters[new_relation_alias] == NULL) {
-            addRowID(target_index, &new_inters[new_relation_alias]);
-          } else {
-            addRowID(filter_inters[new_relation_alias]->ids[target_index], &new_inters[new_relation_alias]);
-          }
-        }
+      if (!left_joined) {
+        const uint32_t *filtered = filter_inters[left_relation_alias] != NULL ? filter_inters[left_relation_alias]->ids : NULL;
+        gatherJoinedRowIDs(new_inter->columns[left_relation_alias], filtered, join_results->tuples,
+                           join_results->num_tuples, false);
+      }
 
-        destroyInters(join_inters, query->num_relations);
-        join_inters = new_inters;
+      if (!right_joined) {
+        const uint32_t *filtered =
+            filter_inters[right_relation_alias] != NULL ? filter_inters[right_relation_alias]->ids : NULL;
+        gatherJoinedRowIDs(new_inter->columns[right_relation_alias], filtered, join_results->tuples,
+                           join_results->num_tuples, true);
       }
 
+      destroyIntermediate(join_inter);
+      join_inter = new_inter;
+
       destroyJoinRelation(join_results);
     }
   }
-  return join_inters;
+  return join_inter;
 }
 
-uint64_t *calculateChecksums(RowIDs **join_inters, Relation **relations, Query *query, bool empty_result) {
+uint64_t *calculateChecksums(const Intermediate *join_inter, Relation **relations, Query *query, bool empty_result) {
   uint64_t *checksums = memAlloc(sizeof(uint64_t), query->num_projections, true, NULL);
 
   if (!empty_result) {
+    assert(join_inter != NULL);
+
     for (uint32_t projection = 0; projection < query->num_projections; projection++) {
       Relation *current_relation = relations[query->projections[projection].table];
       uint64_t *column = current_relation->columns[query->projections[projection].index];
+      const uint32_t *row_ids = join_inter->columns[query->projections[projection].alias];
 
-      for (uint32_t row_id = 0; row_id < join_inters[query->projections[projection].alias]->count; row_id++) {
-        checksums[projection] += column[join_inters[query->projections[projection].alias]->ids[row_id]];
+      for (uint32_t i = 0; i < join_inter->num_rows; i++) {
+        checksums[projection] += column[row_ids[i]];
       }
     }
   }
@@ -330,4 +783,8 @@ void destroyInters(RowIDs **inters, uint32_t num_relations) {
     destroyRowIDs(inters[i]);
   }
   free(inters);
-}
\ No newline at end of file
+}
+
+void destroyIntermediate(Intermediate *inter) {
+  free(inter);
+}
@@ -9,6 +9,7 @@
 #include <sys/stat.h>
 
 #include "helpers.h"
+#include "index.h"
 
 Relation* loadRelation(char* filename) {
   int infd;
@@ -45,12 +46,82 @@ Relation* loadRelation(char* filename) {
     relation->columns[col] = (uint64_t*)(data + col * bytes_per_column);
   }
 
+  relation->column_copy = NULL;
+  relation->point_indexes = memAlloc(sizeof(*relation->point_indexes), relation->num_columns, true, NULL);
+  relation->bitmap_indexes = NULL;
+  buildZoneMaps(relation);
+
   return relation;
 }
 
+void buildZoneMaps(Relation* relation) {
+  assert(relation->num_columns > 0);
+
+  uint64_t num_zones = (relation->num_tuples + ZONE_SIZE - 1) / ZONE_SIZE;
+
+  // A single allocation for all the columns' zone maps, which starts at zones[0]
+  relation->zones = memAlloc(sizeof(Zone*), relation->num_columns, false, NULL);
+  Zone* zones = memAlloc(sizeof(Zone), num_zones * relation->num_columns + 1, false, NULL);
+  relation->sorted = memAlloc(sizeof(bool), relation->num_columns, false, NULL);
+
+  for (uint64_t col = 0; col < relation->num_columns; col++) {
+    relation->zones[col] = zones + col * num_zones;
+    relation->sorted[col] = true;
+
+    for (uint64_t zone = 0; zone < num_zones; zone++) {
+      uint64_t start = zone * ZONE_SIZE;
+      uint64_t end = start + ZONE_SIZE < relation->num_tuples ? start + ZONE_SIZE : relation->num_tuples;
+      uint64_t min = UINT64_MAX, max = 0;
+      bool sorted = true;
+
+      for (uint64_t i = start; i < end; i++) {
+        uint64_t value = relation->columns[col][i];
+        min = value < min ? value : min;
+        max = value > max ? value : max;
+        sorted &= i == 0 || relation->columns[col][i - 1] <= value;
+      }
+
+      relation->zones[col][zone] = (Zone){.min = min, .max = max};
+      relation->sorted[col] &= sorted;
+    }
+  }
+}
+
+void interleaveRelation(Relation *relation, const CpuTopology *topology) {
+  assert(relation->num_columns > 0);
+
+  uint64_t *columns = memAlloc(sizeof(uint64_t), relation->num_tuples * relation->num_columns, false, NULL);
+
+  // The policy has to be set before the pages are first touched by the copy
+  interleaveMemory(columns, relation->num_tuples * relation->num_columns * sizeof(uint64_t), topology);
+
+  for (uint64_t col = 0; col < relation->num_columns; col++) {
+    memcpy(columns + col * relation->num_tuples, relation->columns[col], relation->num_tuples * sizeof(uint64_t));
+    relation->columns[col] = columns + col * relation->num_tuples;
+  }
+
+  relation->column_copy = columns;
+}
+
+void destroyRelation(Relation* relation) {
+  if (relation != NULL) {
+    if (relation->zones != NULL) {
+      free(relation->zones[0]);
+    }
+
+    destroyRelationIndexes(relation);
+    free(relation->zones);
+    free(relation->sorted);
+    free(relation->column_copy);
+    free(relation->columns);
+    free(relation);
+  }
+}
+
 void destroyJoinRelation(JoinRelation* join_relation) {
   if (join_relation != NULL) {
     free(join_relation->tuples);
+    free(join_relation->wide_payloads);
     free(join_relation);
   }
 }
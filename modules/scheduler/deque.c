@@ -0,0 +1,115 @@
+#include "deque.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "helpers.h"
+
+static DequeArray *createArray(int64_t capacity, DequeArray *previous) {
+  DequeArray *array = memAlloc(sizeof(DequeArray) + capacity * sizeof(array->slots[0]), 1, false, NULL);
+  array->capacity = capacity;
+  array->previous = previous;
+
+  return array;
+}
+
+void initializeDeque(WorkDeque *deque, int64_t capacity) {
+  atomic_init(&deque->top, 0);
+  atomic_init(&deque->bottom, 0);
+  atomic_init(&deque->array, createArray(capacity, NULL));
+}
+
+// Doubles the capacity of the deque's array, copying the jobs in [top, bottom) to the same (modular) positions.
+static DequeArray *growDeque(WorkDeque *deque, DequeArray *array, int64_t top, int64_t bottom) {
+  DequeArray *new_array = createArray(2 * array->capacity, array);
+
+  for (int64_t i = top; i < bottom; i++) {
+    struct job_info *job_info = atomic_load_explicit(&array->slots[i & (array->capacity - 1)], memory_order_relaxed);
+    atomic_store_explicit(&new_array->slots[i & (new_array->capacity - 1)], job_info, memory_order_relaxed);
+  }
+
+  atomic_store_explicit(&deque->array, new_array, memory_order_release);
+  return new_array;
+}
+
+void pushBottom(WorkDeque *deque, struct job_info *job_info) {
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  DequeArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+  if (bottom - top > array->capacity - 1) {
+    array = growDeque(deque, array, top, bottom);
+  }
+
+  // Thieves read the bottom with acquire semantics, so they see the job (and everything it points to) once they see it
+  atomic_store_explicit(&array->slots[bottom & (array->capacity - 1)], job_info, memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+}
+
+struct job_info *takeBottom(WorkDeque *deque) {
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  DequeArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+  atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+  // Empty deque: restore the bottom
+  if (top > bottom) {
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  struct job_info *job_info = atomic_load_explicit(&array->slots[bottom & (array->capacity - 1)], memory_order_relaxed);
+
+  // Last job: race against the thieves for it
+  if (top == bottom) {
+    if (!atomic_compare_exchange_strong_explicit(
+            &deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+      job_info = NULL;
+    }
+
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+  }
+
+  return job_info;
+}
+
+struct job_info *stealTop(WorkDeque *deque) {
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+  if (top >= bottom) {
+    return NULL;
+  }
+
+  DequeArray *array = atomic_load_explicit(&deque->array, memory_order_acquire);
+  struct job_info *job_info = atomic_load_explicit(&array->slots[top & (array->capacity - 1)], memory_order_relaxed);
+
+  if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+    return NULL;
+  }
+
+  return job_info;
+}
+
+bool dequeIsEmpty(WorkDeque *deque) {
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_seq_cst);
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_seq_cst);
+
+  return top >= bottom;
+}
+
+void destroyDeque(WorkDeque *deque) {
+  DequeArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+  while (array != NULL) {
+    DequeArray *previous = array->previous;
+    free(array);
+    array = previous;
+  }
+}
@@ -3,20 +3,46 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "deque.h"
 #include "helpers.h"
 #include "phjoin.h"
+#include "query.h"
+#include "topology.h"
 
 #define INITIAL_CAPACITY 1024
+#define INITIAL_DEQUE_CAPACITY 256
+
+// How many pauses a spinning thread makes between two reads of the clock
+#define SPINS_PER_CLOCK_READ 64
+
+// Index of the scheduler thread that's running the current thread, or -1 for threads not created by a scheduler
+static _Thread_local int64_t worker_id = -1;
+
+// The pool of the scheduler thread that's running the current thread, or NULL
+static _Thread_local JobPool* worker_pool = NULL;
+
+// What each scheduler thread receives as its argument
+typedef struct worker_args {
+  JobPool* pool;
+  int64_t id;
+  uint64_t random_state;  // Used to pick the threads to steal from
+
+  int64_t cpu;    // The CPU the thread is pinned to, or -1
+  uint32_t node;  // The NUMA node of that CPU (0 if the thread isn't pinned)
+} WorkerArgs;
 
 static void initializeQueue(JobQueue* queue, uint64_t capacity) {
   queue->jobs = memAlloc(sizeof(JobInfo*), capacity, true, NULL);
   queue->capacity = capacity;
   queue->front = queue->back = 0;
+  queue->count = 0;
 }
 
 static JobInfo* dequeue(JobQueue* queue) {
@@ -25,158 +51,808 @@ static JobInfo* dequeue(JobQueue* queue) {
   if (ret != NULL) {
     queue->jobs[queue->front] = NULL;
     queue->front = (queue->front + 1) % queue->capacity;
+    queue->count--;
   }
 
   return ret;
 }
 
-static void enqueue(JobQueue* queue, JobInfo* job_info) {
-  int64_t num_jobs = queue->back - queue->front + 1;
+// Same as dequeue, but skips QUERY_JOBs, which stay in the queue in the same order. Returns NULL if there's no other job.
+static JobInfo* dequeueNonQuery(JobQueue* queue) {
+  for (uint64_t i = 0; i < queue->count; i++) {
+    JobInfo* ret = queue->jobs[(queue->front + i) % queue->capacity];
+
+    if (ret->kind == QUERY_JOB) {
+      continue;
+    }
+
+    // Shift the query jobs that were skipped into its slot
+    for (uint64_t j = i; j > 0; j--) {
+      queue->jobs[(queue->front + j) % queue->capacity] = queue->jobs[(queue->front + j - 1) % queue->capacity];
+    }
 
-  if (num_jobs < 0) {
-    num_jobs = -num_jobs;
+    queue->jobs[queue->front] = NULL;
+    queue->front = (queue->front + 1) % queue->capacity;
+    queue->count--;
+
+    return ret;
   }
 
-  if ((uint64_t)num_jobs >= queue->capacity) {
-    queue->capacity *= 2;
-    queue->jobs = memAlloc(sizeof(JobInfo*), queue->capacity, false, queue->jobs);
+  return NULL;
+}
+
+static void enqueue(JobQueue* queue, JobInfo* job_info) {
+  // Dequeued slots are always reset to NULL, so the queue is full iff the slot at its back is still occupied. In that
+  // case, double its capacity and move the jobs to the start of the new array, keeping their order.
+  if (queue->jobs[queue->back] != NULL) {
+    JobInfo** jobs = memAlloc(sizeof(JobInfo*), 2 * queue->capacity, true, NULL);
 
-    memset(&queue->jobs[queue->back + 1], 0, num_jobs);
+    for (uint64_t i = 0; i < queue->capacity; i++) {
+      jobs[i] = queue->jobs[(queue->front + i) % queue->capacity];
+    }
+
+    free(queue->jobs);
+    queue->jobs = jobs;
+    queue->front = 0;
+    queue->back = queue->capacity;
+    queue->capacity *= 2;
   }
 
   uint64_t insert_index = queue->back;
   queue->back = (queue->back + 1) % queue->capacity;
   queue->jobs[insert_index] = job_info;
+  queue->count++;
 }
 
-static void* schedulerLoop(void* scheduler_) {
-  JobScheduler* scheduler = scheduler_;
+// Returns the number of jobs in all of the pool's queues.
+static uint64_t queuedJobs(JobPool* pool) {
+  uint64_t count = pool->jobs.count;
 
-  while (true) {
-    pthread_mutex_lock(&scheduler->queue_mutex);
-    while (!scheduler->is_available && !scheduler->terminate) {
-      pthread_cond_wait(&scheduler->queue_available, &scheduler->queue_mutex);
+  for (uint32_t node = 0; pool->node_jobs != NULL && node < pool->num_nodes; node++) {
+    count += pool->node_jobs[node].count;
+  }
+
+  return count;
+}
+
+// Returns the queue that a thread of the given node should take its next job from: the node's own queue, then the
+// shared one, and finally those of the other nodes. Returns NULL if they're all empty.
+static JobQueue* nextQueue(JobPool* pool, uint32_t node) {
+  if (pool->node_jobs != NULL && pool->node_jobs[node].count > 0) {
+    return &pool->node_jobs[node];
+  }
+
+  if (pool->jobs.count > 0) {
+    return &pool->jobs;
+  }
+
+  for (uint32_t i = 1; pool->node_jobs != NULL && i < pool->num_nodes; i++) {
+    JobQueue* queue = &pool->node_jobs[(node + i) % pool->num_nodes];
+
+    if (queue->count > 0) {
+      return queue;
+    }
+  }
+
+  return NULL;
+}
+
+static bool hasStealableJobs(JobPool* pool) {
+  for (uint64_t i = 0; pool->deques != NULL && i < pool->execution_threads; i++) {
+    if (!dequeIsEmpty(&pool->deques[i])) {
+      return true;
     }
+  }
+
+  return false;
+}
+
+// Tells the CPU that the thread is busy-waiting, so that it saves power and yields to its SMT sibling
+static inline void cpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+static uint64_t nowNanos(void) {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+// Bounds the time a thread busy-waits for something before it goes to sleep (see SchedulerOptions)
+typedef struct spinner {
+  uint64_t deadline;  // 0 once the time is up
+  uint64_t spins;
+} Spinner;
+
+static void startSpinning(Spinner* spinner, uint64_t spin_time_ns) {
+  spinner->deadline = spin_time_ns > 0 ? nowNanos() + spin_time_ns : 0;
+  spinner->spins = 0;
+}
+
+// Pauses for a moment, and returns false once the spin time is up. The clock costs more than a pause, so it's
+// only read every few spins.
+static bool keepSpinning(Spinner* spinner) {
+  if (spinner->deadline == 0) {
+    return false;
+  }
+
+  cpuRelax();
+
+  if (++spinner->spins % SPINS_PER_CLOCK_READ == 0 && nowNanos() >= spinner->deadline) {
+    spinner->deadline = 0;
+  }
+
+  return true;
+}
+
+// Polls the pool for runnable jobs for up to its spin time. Returns false if none showed up, in which case the
+// thread should go to sleep.
+static bool spinForJobs(JobPool* pool) {
+  Spinner spinner;
+  startSpinning(&spinner, pool->spin_time_ns);
+
+  while (keepSpinning(&spinner)) {
+    if (queuedJobs(pool) > 0 || hasStealableJobs(pool)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void runJob(JobInfo* job_info) {
+  switch (job_info->kind) {
+    case HISTOGRAM_JOB:
+      ((HistogramJob)job_info->job)(job_info->args);
+      break;
+
+    case SCATTER_JOB:
+      ((ScatterJob)job_info->job)(job_info->args);
+      break;
+
+    case SUBPARTITION_JOB:
+      ((SubpartitionJob)job_info->job)(job_info->args);
+      break;
+
+    case BUILDING_JOB:
+      ((BuildingJob)job_info->job)(job_info->args);
+      break;
+
+    case JOIN_JOB:
+      ((JoinJob)job_info->job)(job_info->args);
+      break;
+
+    case BUILD_PROBE_JOB:
+      ((BuildProbeJob)job_info->job)(job_info->args);
+      break;
 
-    if (scheduler->terminate) {
-      pthread_mutex_unlock(&scheduler->queue_mutex);
-      pthread_cond_broadcast(&scheduler->queue_available);
+    case QUERY_JOB:
+      ((QueryJob)job_info->job)(job_info->args);
+      break;
+
+    case FILTER_JOB:
+      ((FilterJob)job_info->job)(job_info->args);
+      break;
 
+    case JOIN_FILTER_JOB:
+      ((JoinFilterJob)job_info->job)(job_info->args);
       break;
+
+    default:
+      assert(false);  // This shouldn't be called
+  }
+}
+
+// Marks one of the group's jobs as completed, waking up its waiters if it was the last one
+static void completeJob(JobScheduler* group) {
+  // Jobs that aren't the group's last one complete without any locking
+  uint64_t job_count = atomic_load(&group->job_count);
+  while (job_count > 1) {
+    if (atomic_compare_exchange_weak(&group->job_count, &job_count, job_count - 1)) {
+      return;
     }
+  }
 
-    JobInfo* job_info = dequeue(&scheduler->jobs);
-    bool empty_queue = job_info == NULL;
+  // The last one is counted under the mutex, so that waiters (who may destroy the group) can't return before it's
+  // released. The group isn't accessed after the unlock.
+  pthread_mutex_lock(&group->job_count_mutex);
+
+  if (atomic_fetch_sub(&group->job_count, 1) == 1) {
+    pthread_cond_broadcast(&group->jobs_completed);
+  }
 
-    if (empty_queue) {
-      scheduler->is_available = false;
+  pthread_mutex_unlock(&group->job_count_mutex);
+}
+
+// Queues a job whose predecessors have all completed. If wake is set, an idle thread is woken up to run it.
+static void makeRunnable(JobPool* pool, JobInfo* job_info, bool wake) {
+  bool own_node =
+      job_info->node < 0 || (worker_pool == pool && (int64_t)pool->worker_args[worker_id].node == job_info->node);
+
+  // A thread of a work-stealing pool owns its deque, so it can push to it without locking. Jobs meant for other
+  // nodes go to their node's queue instead, and so do whole queries, which are never moved to the deques (see
+  // helpWithJob).
+  if (pool->backend == WORK_STEALING_SCHEDULER && worker_pool == pool && own_node && job_info->kind != QUERY_JOB) {
+    pushBottom(&pool->deques[worker_id], job_info);
+
+    // Idle threads increment the sleeper count before checking the deques one last time, so either they see
+    // the job or we see them
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (wake && atomic_load(&pool->sleepers) > 0) {
+      pthread_mutex_lock(&pool->queue_mutex);
+      pthread_cond_signal(&pool->queue_available);
+      pthread_mutex_unlock(&pool->queue_mutex);
     }
 
-    pthread_mutex_unlock(&scheduler->queue_mutex);
-    pthread_cond_broadcast(&scheduler->queue_available);
+    return;
+  }
 
-    if (!empty_queue) {
-      switch (job_info->kind) {
-        case HISTOGRAM_JOB:
-          ((HistogramJob)job_info->job)(job_info->args);
-          break;
+  pthread_mutex_lock(&pool->queue_mutex);
+  enqueue(job_info->node < 0 ? &pool->jobs : &pool->node_jobs[job_info->node], job_info);
 
-        case BUILDING_JOB:
-          ((BuildingJob)job_info->job)(job_info->args);
-          break;
+  // Threads only go to sleep under the mutex, after checking the queues, so spinning threads will see the job
+  if (wake && atomic_load(&pool->sleepers) > 0) {
+    pthread_cond_signal(&pool->queue_available);
+  }
 
-        case JOIN_JOB:
-          ((JoinJob)job_info->job)(job_info->args);
-          break;
+  pthread_mutex_unlock(&pool->queue_mutex);
+}
 
-        default:
-          assert(false);  // This shouldn't be called
-      }
+// Returns a completed job to its group. Any thread may do this, so the job is pushed to the returned list without
+// locking; the group's client is the only one that takes jobs off it, and always takes all of them at once.
+static void recycleJob(JobSlab* job_slab, JobInfo* job_info) {
+  JobInfo* head = atomic_load_explicit(&job_slab->returned_jobs, memory_order_relaxed);
+
+  do {
+    job_info->next_free = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &job_slab->returned_jobs, &head, job_info, memory_order_release, memory_order_relaxed));
+}
 
-      pthread_mutex_lock(&scheduler->job_count_mutex);
+static JobInfo* allocateJob(JobSlab* job_slab) {
+  if (job_slab->free_jobs == NULL) {
+    job_slab->free_jobs = atomic_exchange_explicit(&job_slab->returned_jobs, NULL, memory_order_acquire);
+  }
+
+  if (job_slab->free_jobs == NULL) {
+    JobInfo* slab = memAlloc(sizeof(JobInfo), JOBS_PER_SLAB, false, NULL);
+
+    for (uint32_t i = 0; i < JOBS_PER_SLAB; i++) {
+      slab[i].next_free = (i + 1 == JOBS_PER_SLAB) ? NULL : &slab[i + 1];
+    }
+
+    if (job_slab->num_slabs == job_slab->slabs_capacity) {
+      job_slab->slabs_capacity = 2 * job_slab->slabs_capacity + 1;
+      job_slab->slabs = memAlloc(sizeof(JobInfo*), job_slab->slabs_capacity, false, job_slab->slabs);
+    }
+
+    job_slab->slabs[job_slab->num_slabs++] = slab;
+    job_slab->free_jobs = slab;
+  }
+
+  JobInfo* job_info = job_slab->free_jobs;
+  job_slab->free_jobs = job_info->next_free;
+
+  return job_info;
+}
+
+static void finishJob(JobInfo* job_info) {
+  runJob(job_info);
+
+  for (uint32_t i = 0; i < job_info->num_successors; i++) {
+    JobInfo* successor = job_info->successors[i];
+
+    if (atomic_fetch_sub(&successor->pending, 1) == 1) {
+      makeRunnable(successor->group->pool, successor, true);
+    }
+  }
+
+  JobScheduler* group = job_info->group;
+
+  if (job_info->successors != job_info->inline_successors) {
+    free(job_info->successors);
+  }
 
-      if (--(scheduler->job_count) == 0) {
-        scheduler->is_available = false;
+  // The group can't be destroyed before the job is completed, so the job is recycled first
+  recycleJob(&group->job_slab, job_info);
+  completeJob(group);
+}
+
+static void* sharedQueueLoop(WorkerArgs* args) {
+  JobPool* pool = args->pool;
+
+  while (true) {
+    if (queuedJobs(pool) == 0) {
+      spinForJobs(pool);
+    }
+
+    pthread_mutex_lock(&pool->queue_mutex);
+
+    JobQueue* queue;
+    if ((queue = nextQueue(pool, args->node)) == NULL && !pool->terminate) {
+      atomic_fetch_add(&pool->sleepers, 1);
+
+      while ((queue = nextQueue(pool, args->node)) == NULL && !pool->terminate) {
+        pthread_cond_wait(&pool->queue_available, &pool->queue_mutex);
       }
 
-      pthread_mutex_unlock(&scheduler->job_count_mutex);
-      pthread_cond_signal(&scheduler->jobs_completed);
+      atomic_fetch_sub(&pool->sleepers, 1);
+    }
+
+    JobInfo* job_info = queue != NULL ? dequeue(queue) : NULL;
+    pthread_mutex_unlock(&pool->queue_mutex);
+
+    if (job_info == NULL) {
+      break;  // Only reached when the pool is terminated
+    }
+
+    finishJob(job_info);
+  }
+
+  return NULL;
+}
+
+// xorshift64
+static uint64_t nextRandom(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+
+  return *state;
+}
+
+// Moves a fair share of the jobs of the next queue (see nextQueue) to the worker's deque, except for the first one
+// which is returned. Only a single job is taken from the queues of other nodes, as they're meant for their threads.
+// The batch stops at the first QUERY_JOB, so that those are only ever run from the queues (see helpWithJob).
+static JobInfo* takeQueuedJobs(JobPool* pool, WorkerArgs* args) {
+  WorkDeque* deque = &pool->deques[args->id];
+  pthread_mutex_lock(&pool->queue_mutex);
+
+  JobQueue* queue = nextQueue(pool, args->node);
+  if (queue == NULL) {
+    pthread_mutex_unlock(&pool->queue_mutex);
+    return NULL;
+  }
+
+  bool foreign = pool->node_jobs != NULL && queue != &pool->jobs && queue != &pool->node_jobs[args->node];
+  uint64_t batch_size = foreign ? 1 : queue->count / pool->execution_threads + 1;
+  JobInfo* job_info = dequeue(queue);
+
+  uint64_t pushed = 0;
+  for (JobInfo* extra_job_info; job_info != NULL && pushed + 1 < batch_size; pushed++) {
+    if (queue->count == 0 || queue->jobs[queue->front]->kind == QUERY_JOB) {
+      break;
     }
 
+    extra_job_info = dequeue(queue);
+
+    pushBottom(deque, extra_job_info);
+  }
+
+  // Idle threads can now steal the rest of the batch
+  if (pushed > 0 && atomic_load(&pool->sleepers) > 0) {
+    pthread_cond_broadcast(&pool->queue_available);
+  }
+
+  pthread_mutex_unlock(&pool->queue_mutex);
+
+  return job_info;
+}
+
+// Takes the first job of the queues that isn't a QUERY_JOB, looking at them in the same order as nextQueue
+static JobInfo* takeNonQueryJob(JobPool* pool, uint32_t node) {
+  pthread_mutex_lock(&pool->queue_mutex);
+
+  JobInfo* job_info = pool->node_jobs != NULL ? dequeueNonQuery(&pool->node_jobs[node]) : NULL;
+
+  if (job_info == NULL) {
+    job_info = dequeueNonQuery(&pool->jobs);
+  }
+
+  for (uint32_t i = 1; job_info == NULL && pool->node_jobs != NULL && i < pool->num_nodes; i++) {
+    job_info = dequeueNonQuery(&pool->node_jobs[(node + i) % pool->num_nodes]);
+  }
+
+  pthread_mutex_unlock(&pool->queue_mutex);
+
+  return job_info;
+}
+
+// Finds the worker's next job. Threads that are helping while they wait for their group's jobs skip whole queries,
+// which only live in the queues.
+static JobInfo* findJob(WorkerArgs* args, bool helping) {
+  JobPool* pool = args->pool;
+  WorkDeque* deque = &pool->deques[args->id];
+
+  // Own jobs come first, then the queued jobs, and finally the other threads' jobs (those of the same node first)
+  JobInfo* job_info = takeBottom(deque);
+
+  if (job_info == NULL && queuedJobs(pool) > 0) {
+    job_info = helping ? takeNonQueryJob(pool, args->node) : takeQueuedJobs(pool, args);
+  }
+
+  if (job_info == NULL && pool->execution_threads > 1) {
+    uint64_t first_victim = nextRandom(&args->random_state) % pool->execution_threads;
+
+    for (uint32_t pass = 0; job_info == NULL && pass < 2; pass++) {
+      bool same_node = pass == 0;
+
+      for (uint64_t i = 0; job_info == NULL && i < pool->execution_threads; i++) {
+        uint64_t victim = (first_victim + i) % pool->execution_threads;
+
+        if (victim != (uint64_t)args->id && (pool->worker_args[victim].node == args->node) == same_node) {
+          job_info = stealTop(&pool->deques[victim]);
+        }
+      }
+    }
+  }
+
+  return job_info;
+}
+
+static void* workStealingLoop(WorkerArgs* args) {
+  JobPool* pool = args->pool;
+
+  while (true) {
+    JobInfo* job_info = findJob(args, false);
+
     if (job_info != NULL) {
-      free(job_info->args);
-      free(job_info);
+      finishJob(job_info);
+      continue;
+    }
+
+    if (spinForJobs(pool)) {
+      continue;
+    }
+
+    // Jobs are always pushed before the mutex is taken to announce them, so checking for them under the mutex
+    // guarantees that no wake-up is missed
+    pthread_mutex_lock(&pool->queue_mutex);
+
+    atomic_fetch_add(&pool->sleepers, 1);
+
+    while (!pool->terminate && queuedJobs(pool) == 0 && !hasStealableJobs(pool)) {
+      pthread_cond_wait(&pool->queue_available, &pool->queue_mutex);
+    }
+
+    atomic_fetch_sub(&pool->sleepers, 1);
+
+    bool terminate = pool->terminate;
+    pthread_mutex_unlock(&pool->queue_mutex);
+
+    if (terminate) {
+      break;
     }
   }
 
   return NULL;
 }
 
-JobScheduler* initializeScheduler(uint64_t execution_threads) {
-  JobScheduler* scheduler = memAlloc(sizeof(JobScheduler), 1, false, NULL);
-  scheduler->execution_threads = execution_threads;
-  scheduler->thread_ids = memAlloc(sizeof(pthread_t), execution_threads, true, NULL);
+static void* schedulerLoop(void* args_) {
+  WorkerArgs* args = args_;
 
-  initializeQueue(&scheduler->jobs, INITIAL_CAPACITY);
+  worker_id = args->id;
+  worker_pool = args->pool;
 
-  scheduler->job_count = 0;
+  // If the CPU isn't available after all, the thread just stays unpinned
+  if (args->cpu >= 0) {
+    pinCurrentThread((uint32_t)args->cpu);
+  }
 
-  scheduler->terminate = false;
-  scheduler->is_available = false;
+  return args->pool->backend == WORK_STEALING_SCHEDULER ? workStealingLoop(args) : sharedQueueLoop(args);
+}
 
-  pthread_mutex_init(&scheduler->queue_mutex, NULL);
-  pthread_cond_init(&scheduler->queue_available, NULL);
+static JobScheduler* initializeGroup(JobPool* pool, bool owns_pool) {
+  JobScheduler* scheduler = memAlloc(sizeof(JobScheduler), 1, false, NULL);
+  scheduler->pool = pool;
+  scheduler->execution_threads = pool->execution_threads;
+  atomic_init(&scheduler->job_count, 0);
+  scheduler->owns_pool = owns_pool;
+
+  scheduler->job_slab.free_jobs = NULL;
+  atomic_init(&scheduler->job_slab.returned_jobs, NULL);
+  scheduler->job_slab.slabs = NULL;
+  scheduler->job_slab.num_slabs = scheduler->job_slab.slabs_capacity = 0;
+
+  atomic_init(&scheduler->cancellation.cancelled, false);
+  atomic_init(&scheduler->cancellation.deadline_ns, 0);
 
   pthread_mutex_init(&scheduler->job_count_mutex, NULL);
   pthread_cond_init(&scheduler->jobs_completed, NULL);
 
+  return scheduler;
+}
+
+uint64_t defaultSpinTime(void) {
+  return getNumCores() > 1 ? DEFAULT_SPIN_TIME_NS : 0;
+}
+
+JobScheduler* initializeScheduler(uint64_t execution_threads) {
+  SchedulerOptions options = {
+      .execution_threads = execution_threads, .backend = SHARED_QUEUE_SCHEDULER, .spin_time_ns = defaultSpinTime()};
+  return initializeSchedulerWithOptions(&options);
+}
+
+JobScheduler* initializeSchedulerWithOptions(const SchedulerOptions* options) {
+  uint64_t execution_threads = options->execution_threads;
+
+  JobPool* pool = memAlloc(sizeof(JobPool), 1, false, NULL);
+  pool->backend = options->backend;
+  pool->execution_threads = execution_threads;
+  pool->spin_time_ns = options->spin_time_ns;
+  pool->thread_ids = memAlloc(sizeof(pthread_t), execution_threads, true, NULL);
+
+  initializeQueue(&pool->jobs, INITIAL_CAPACITY);
+
+  pool->terminate = false;
+
+  pthread_mutex_init(&pool->queue_mutex, NULL);
+  pthread_cond_init(&pool->queue_available, NULL);
+
+  pool->deques = NULL;
+  atomic_init(&pool->sleepers, 0);
+
+  // Decide where each thread runs, and which node it serves
+  CpuInfo* placement = NULL;
+  pool->num_nodes = 1;
+  pool->node_jobs = NULL;
+  pool->topology = NULL;
+
+  if (options->affinity != AFFINITY_NONE) {
+    pool->topology = options->topology == NULL ? detectTopology() : copyTopology(options->topology);
+
+    placement = memAlloc(sizeof(CpuInfo), execution_threads, false, NULL);
+    placeThreads(pool->topology, options->affinity, execution_threads, placement);
+
+    // Nodes without threads would get jobs (see setJobNode) and memory (see bindMemoryToNode) that no thread of theirs
+    // works on, so only the nodes that did get threads are kept, and numbered after them
+    keepPlacedNodes(pool->topology, placement, (uint32_t)execution_threads);
+    pool->num_nodes = pool->topology->num_nodes;
+  }
+
+  if (pool->num_nodes > 1) {
+    pool->node_jobs = memAlloc(sizeof(JobQueue), pool->num_nodes, false, NULL);
+
+    for (uint32_t node = 0; node < pool->num_nodes; node++) {
+      initializeQueue(&pool->node_jobs[node], INITIAL_CAPACITY);
+    }
+  }
+
+  if (pool->backend == WORK_STEALING_SCHEDULER) {
+    pool->deques = memAlloc(sizeof(WorkDeque), execution_threads, false, NULL);
+
+    for (uint64_t i = 0; i < execution_threads; i++) {
+      initializeDeque(&pool->deques[i], INITIAL_DEQUE_CAPACITY);
+    }
+  }
+
+  pool->worker_args = memAlloc(sizeof(WorkerArgs), execution_threads, false, NULL);
+
   for (uint64_t i = 0; i < execution_threads; i++) {
-    pthread_create(&scheduler->thread_ids[i], NULL, schedulerLoop, scheduler);
+    pool->worker_args[i].pool = pool;
+    pool->worker_args[i].id = (int64_t)i;
+    pool->worker_args[i].random_state = 0x9E3779B97F4A7C15ULL * (i + 1);
+    pool->worker_args[i].cpu = placement != NULL ? (int64_t)placement[i].cpu : -1;
+    pool->worker_args[i].node = placement != NULL ? placement[i].node : 0;
   }
 
-  return scheduler;
+  // The threads may access each other's arguments (e.g. to find the node of a victim), so start them afterwards
+  for (uint64_t i = 0; i < execution_threads; i++) {
+    pthread_create(&pool->thread_ids[i], NULL, schedulerLoop, &pool->worker_args[i]);
+  }
+
+  free(placement);
+
+  return initializeGroup(pool, true);
+}
+
+JobScheduler* createJobGroup(JobScheduler* scheduler) {
+  return initializeGroup(scheduler->pool, false);
+}
+
+JobInfo* createJob(JobScheduler* scheduler, Job job, size_t args_size, JobKind kind) {
+  assert(args_size <= JOB_ARGS_SIZE);
+
+  JobInfo* job_info = allocateJob(&scheduler->job_slab);
+  job_info->job = job;
+  job_info->args = job_info->args_storage;
+  job_info->kind = kind;
+  job_info->group = scheduler;
+  job_info->node = -1;
+
+  atomic_init(&job_info->pending, 1);
+  job_info->successors = job_info->inline_successors;
+  job_info->num_successors = 0;
+  job_info->successors_capacity = INLINE_SUCCESSORS;
+
+  return job_info;
+}
+
+void setJobNode(JobInfo* job_info, uint32_t node) {
+  JobPool* pool = job_info->group->pool;
+
+  if (pool->node_jobs != NULL) {
+    job_info->node = (int32_t)(node % pool->num_nodes);
+  }
+}
+
+void addDependency(JobInfo* predecessor, JobInfo* successor) {
+  if (predecessor->num_successors == predecessor->successors_capacity) {
+    JobInfo** successors = predecessor->successors == predecessor->inline_successors ? NULL : predecessor->successors;
+
+    predecessor->successors_capacity *= 2;
+    predecessor->successors = memAlloc(sizeof(JobInfo*), predecessor->successors_capacity, false, successors);
+
+    if (successors == NULL) {
+      memcpy(predecessor->successors, predecessor->inline_successors, sizeof(predecessor->inline_successors));
+    }
+  }
+
+  predecessor->successors[predecessor->num_successors++] = successor;
+  atomic_fetch_add(&successor->pending, 1);
 }
 
 void submitJob(JobScheduler* scheduler, JobInfo* job_info) {
-  scheduler->job_count++;
-  enqueue(&scheduler->jobs, job_info);
+  assert(job_info->group == scheduler);
+  atomic_fetch_add(&scheduler->job_count, 1);
+
+  // Release the submission's share of the pending count. If predecessors remain, the last of them queues the job.
+  if (atomic_fetch_sub(&job_info->pending, 1) == 1) {
+    makeRunnable(scheduler->pool, job_info, false);
+  }
 }
 
 void executeAllJobs(JobScheduler* scheduler) {
-  scheduler->is_available = true;
-  pthread_cond_broadcast(&scheduler->queue_available);
+  JobPool* pool = scheduler->pool;
+
+  // The jobs were queued before, so threads that aren't asleep yet will find them on their own
+  if (atomic_load(&pool->sleepers) > 0) {
+    pthread_mutex_lock(&pool->queue_mutex);
+    pthread_cond_broadcast(&pool->queue_available);
+    pthread_mutex_unlock(&pool->queue_mutex);
+  }
+}
+
+// Runs one of the pool's pending jobs on the calling pool thread. Returns false if there wasn't any. Whole queries are
+// left for other threads: running one here would nest it on the waiter's stack, and the waiter couldn't resume until
+// that unrelated query finished, while its own deadline (see setJobGroupDeadline) kept running.
+static bool helpWithJob(JobPool* pool) {
+  JobInfo* job_info;
+
+  if (pool->backend == WORK_STEALING_SCHEDULER) {
+    job_info = findJob(&pool->worker_args[worker_id], true);
+  } else {
+    job_info = takeNonQueryJob(pool, pool->worker_args[worker_id].node);
+  }
+
+  if (job_info == NULL) {
+    return false;
+  }
+
+  finishJob(job_info);
+  return true;
 }
 
 void waitAllJobs(JobScheduler* scheduler) {
+  // A pool thread keeps running jobs until its group's jobs are done. If it finds none, they're all being run by
+  // other threads, so it's safe to block until they complete.
+  if (worker_pool == scheduler->pool) {
+    while (atomic_load(&scheduler->job_count) > 0 && helpWithJob(scheduler->pool)) {
+    }
+  }
+
+  // The last jobs are often about to complete, so it's worth polling for a while before sleeping. Returning as
+  // soon as the count drops to 0 is safe, since the last job releases the group under job_count_mutex, which
+  // destroyJobGroup takes before destroying it.
+  Spinner spinner;
+  startSpinning(&spinner, scheduler->pool->spin_time_ns);
+
+  while (atomic_load(&scheduler->job_count) > 0 && keepSpinning(&spinner)) {
+  }
+
   pthread_mutex_lock(&scheduler->job_count_mutex);
-  while (scheduler->job_count > 0) {
+  while (atomic_load(&scheduler->job_count) > 0) {
     pthread_cond_wait(&scheduler->jobs_completed, &scheduler->job_count_mutex);
   }
+  pthread_mutex_unlock(&scheduler->job_count_mutex);
+}
 
-  scheduler->job_count = 0;
-  scheduler->is_available = false;
-  scheduler->jobs.front = scheduler->jobs.back = 0;
+void cancelJobGroup(JobScheduler* scheduler) {
+  atomic_store(&scheduler->cancellation.cancelled, true);
+}
 
-  pthread_mutex_unlock(&scheduler->job_count_mutex);
+void setJobGroupDeadline(JobScheduler* scheduler, uint64_t time_budget_ns) {
+  atomic_store(&scheduler->cancellation.deadline_ns, nowNanos() + time_budget_ns);
 }
 
-void destroyScheduler(JobScheduler* scheduler) {
-  scheduler->terminate = true;
+bool isCancelled(CancellationToken* token) {
+  if (token == NULL) {
+    return false;
+  }
 
-  pthread_cond_broadcast(&scheduler->queue_available);
+  if (atomic_load_explicit(&token->cancelled, memory_order_acquire)) {
+    return true;
+  }
 
-  // Let every thread in the pool know that they can stop working
-  for (uint64_t i = 0; i < scheduler->execution_threads; i++) {
-    pthread_join(scheduler->thread_ids[i], NULL);
+  // Once the deadline has passed, the token stays cancelled, so that later checks don't need the clock
+  uint64_t deadline_ns = atomic_load_explicit(&token->deadline_ns, memory_order_relaxed);
+
+  if (deadline_ns != 0 && nowNanos() >= deadline_ns) {
+    atomic_store_explicit(&token->cancelled, true, memory_order_release);
+    return true;
   }
 
-  pthread_mutex_destroy(&scheduler->queue_mutex);
-  pthread_cond_destroy(&scheduler->queue_available);
+  return false;
+}
+
+int64_t currentWorkerId(void) {
+  return worker_id;
+}
+
+void destroyJobGroup(JobScheduler* scheduler) {
+  // Also waits for the last worker to release the mutex, in case it just signaled the group's completion
+  pthread_mutex_lock(&scheduler->job_count_mutex);
+  assert(atomic_load(&scheduler->job_count) == 0);
+  pthread_mutex_unlock(&scheduler->job_count_mutex);
 
   pthread_mutex_destroy(&scheduler->job_count_mutex);
   pthread_cond_destroy(&scheduler->jobs_completed);
 
-  free((scheduler->jobs).jobs);
-  free(scheduler->thread_ids);
+  for (uint32_t i = 0; i < scheduler->job_slab.num_slabs; i++) {
+    free(scheduler->job_slab.slabs[i]);
+  }
+
+  free(scheduler->job_slab.slabs);
   free(scheduler);
 }
+
+void destroyScheduler(JobScheduler* scheduler) {
+  assert(scheduler->owns_pool);
+  JobPool* pool = scheduler->pool;
+
+  // Let every thread in the pool know that they can stop working
+  pthread_mutex_lock(&pool->queue_mutex);
+  pool->terminate = true;
+  pthread_cond_broadcast(&pool->queue_available);
+  pthread_mutex_unlock(&pool->queue_mutex);
+
+  for (uint64_t i = 0; i < pool->execution_threads; i++) {
+    pthread_join(pool->thread_ids[i], NULL);
+  }
+
+  pthread_mutex_destroy(&pool->queue_mutex);
+  pthread_cond_destroy(&pool->queue_available);
+
+  if (pool->deques != NULL) {
+    for (uint64_t i = 0; i < pool->execution_threads; i++) {
+      destroyDeque(&pool->deques[i]);
+    }
+
+    free(pool->deques);
+  }
+
+  if (pool->node_jobs != NULL) {
+    for (uint32_t node = 0; node < pool->num_nodes; node++) {
+      free(pool->node_jobs[node].jobs);
+    }
+
+    free(pool->node_jobs);
+  }
+
+  if (pool->topology != NULL) {
+    destroyTopology(pool->topology);
+  }
+
+  free(pool->jobs.jobs);
+  free(pool->thread_ids);
+  free(pool->worker_args);
+  free(pool);
+
+  destroyJobGroup(scheduler);
+}
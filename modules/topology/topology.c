@@ -0,0 +1,475 @@
+// Needed for thread affinity (pthread_setaffinity_np, sched_getaffinity and the CPU_* macros)
+#define _GNU_SOURCE
+
+#include "topology.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "helpers.h"
+
+#define MAX_LINE_LENGTH 4096
+#define MAX_PATH_LENGTH 1024
+#define MAX_RELATIVE_PATH_LENGTH 128
+
+// Memory policies of the mbind system call (see mbind(2)). We call it directly, so that we don't depend on libnuma.
+#define MPOL_PREFERRED 1
+#define MPOL_INTERLEAVE 3
+#define MPOL_MF_MOVE (1 << 1)
+
+// The largest node ID we can bind memory to
+#define MAX_NODE_ID 1023
+
+// Reads the first line of the file at root/path into line. Returns false if the file can't be read.
+static bool readLine(const char* root, const char* path, char* line, int size) {
+  char full_path[MAX_PATH_LENGTH];
+  snprintf(full_path, sizeof(full_path), "%s/%s", root, path);
+
+  FILE* fp = fopen(full_path, "r");
+  if (fp == NULL) {
+    return false;
+  }
+
+  bool success = fgets(line, size, fp) != NULL;
+  fclose(fp);
+
+  return success;
+}
+
+static bool readUint(const char* root, const char* path, uint32_t* value) {
+  char line[64];
+  return readLine(root, path, line, sizeof(line)) && sscanf(line, "%" SCNu32, value) == 1;
+}
+
+uint32_t parseCpuList(const char* list, uint32_t* cpus, uint32_t capacity) {
+  uint32_t count = 0;
+
+  for (const char* current = list; *current != '\0' && *current != '\n';) {
+    char* end;
+    unsigned long first = strtoul(current, &end, 10), last = first;
+
+    if (end == current) {
+      break;  // Not a number
+    }
+
+    // A range of CPUs
+    if (*end == '-') {
+      current = end + 1;
+      last = strtoul(current, &end, 10);
+
+      if (end == current) {
+        break;
+      }
+    }
+
+    for (unsigned long cpu = first; cpu <= last; cpu++, count++) {
+      if (count < capacity) {
+        cpus[count] = (uint32_t)cpu;
+      }
+    }
+
+    current = (*end == ',') ? end + 1 : end;
+  }
+
+  return count;
+}
+
+static int compareCpus(const void* a, const void* b) {
+  const CpuInfo* cpu_a = a;
+  const CpuInfo* cpu_b = b;
+
+  return (cpu_a->cpu > cpu_b->cpu) - (cpu_a->cpu < cpu_b->cpu);
+}
+
+// Ranks the SMT siblings of each core and counts the physical cores, once the CPUs are known.
+static void rankSiblings(CpuTopology* topology) {
+  qsort(topology->cpus, topology->num_cpus, sizeof(CpuInfo), compareCpus);
+  topology->num_physical_cores = 0;
+
+  for (uint32_t i = 0; i < topology->num_cpus; i++) {
+    CpuInfo* cpu = &topology->cpus[i];
+    cpu->rank = 0;
+
+    for (uint32_t j = 0; j < i; j++) {
+      cpu->rank += topology->cpus[j].package == cpu->package && topology->cpus[j].core == cpu->core;
+    }
+
+    topology->num_physical_cores += cpu->rank == 0;
+  }
+}
+
+CpuTopology* loadTopology(const char* sysfs_root) {
+  char line[MAX_LINE_LENGTH];
+  char path[MAX_RELATIVE_PATH_LENGTH];
+
+  if (!readLine(sysfs_root, "cpu/online", line, sizeof(line))) {
+    return NULL;
+  }
+
+  uint32_t num_cpus = parseCpuList(line, NULL, 0);
+  if (num_cpus == 0) {
+    return NULL;
+  }
+
+  uint32_t* cpu_ids = memAlloc(sizeof(uint32_t), num_cpus, false, NULL);
+  parseCpuList(line, cpu_ids, num_cpus);
+
+  CpuTopology* topology = memAlloc(sizeof(CpuTopology), 1, false, NULL);
+  topology->num_cpus = num_cpus;
+  topology->cpus = memAlloc(sizeof(CpuInfo), num_cpus, false, NULL);
+  topology->simulated = false;
+
+  for (uint32_t i = 0; i < num_cpus; i++) {
+    CpuInfo* cpu = &topology->cpus[i];
+    cpu->cpu = cpu_ids[i];
+    cpu->node = 0;
+
+    snprintf(path, sizeof(path), "cpu/cpu%" PRIu32 "/topology/physical_package_id", cpu->cpu);
+    if (!readUint(sysfs_root, path, &cpu->package)) {
+      cpu->package = 0;
+    }
+
+    snprintf(path, sizeof(path), "cpu/cpu%" PRIu32 "/topology/core_id", cpu->cpu);
+    if (!readUint(sysfs_root, path, &cpu->core)) {
+      cpu->core = cpu->cpu;
+    }
+  }
+
+  free(cpu_ids);
+
+  // Nodes are numbered by their position in the list of online nodes, which may have gaps
+  topology->num_nodes = 1;
+  topology->node_ids = memAlloc(sizeof(uint32_t), 1, true, NULL);
+
+  if (readLine(sysfs_root, "node/online", line, sizeof(line)) && parseCpuList(line, NULL, 0) > 0) {
+    topology->num_nodes = parseCpuList(line, NULL, 0);
+    topology->node_ids = memAlloc(sizeof(uint32_t), topology->num_nodes, false, topology->node_ids);
+    parseCpuList(line, topology->node_ids, topology->num_nodes);
+
+    uint32_t* node_cpus = memAlloc(sizeof(uint32_t), num_cpus, false, NULL);
+
+    for (uint32_t node = 0; node < topology->num_nodes; node++) {
+      snprintf(path, sizeof(path), "node/node%" PRIu32 "/cpulist", topology->node_ids[node]);
+      if (!readLine(sysfs_root, path, line, sizeof(line))) {
+        continue;
+      }
+
+      uint32_t num_node_cpus = parseCpuList(line, node_cpus, num_cpus);
+
+      for (uint32_t i = 0; i < num_node_cpus && i < num_cpus; i++) {
+        for (uint32_t j = 0; j < num_cpus; j++) {
+          if (topology->cpus[j].cpu == node_cpus[i]) {
+            topology->cpus[j].node = node;
+          }
+        }
+      }
+    }
+
+    free(node_cpus);
+  }
+
+  rankSiblings(topology);
+
+  return topology;
+}
+
+CpuTopology* detectTopology(void) {
+  CpuTopology* topology = loadTopology(SYSFS_SYSTEM_ROOT);
+
+  if (topology == NULL) {
+    topology = memAlloc(sizeof(CpuTopology), 1, false, NULL);
+    topology->num_cpus = getNumCores();
+    topology->simulated = false;
+    topology->num_nodes = 1;
+    topology->node_ids = memAlloc(sizeof(uint32_t), 1, true, NULL);
+    topology->cpus = memAlloc(sizeof(CpuInfo), topology->num_cpus, true, NULL);
+
+    for (uint32_t i = 0; i < topology->num_cpus; i++) {
+      topology->cpus[i].cpu = topology->cpus[i].core = i;
+    }
+  }
+
+#if defined(__linux__)
+  // Leave out the CPUs that the process isn't allowed to run on (e.g. because of taskset or a container's cpuset)
+  cpu_set_t allowed;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    uint32_t num_allowed = 0;
+
+    for (uint32_t i = 0; i < topology->num_cpus; i++) {
+      if (topology->cpus[i].cpu < CPU_SETSIZE && CPU_ISSET(topology->cpus[i].cpu, &allowed)) {
+        topology->cpus[num_allowed++] = topology->cpus[i];
+      }
+    }
+
+    if (num_allowed > 0) {
+      topology->num_cpus = num_allowed;
+    }
+  }
+#endif
+
+  rankSiblings(topology);
+
+  return topology;
+}
+
+CpuTopology* simulateTopology(const CpuTopology* topology, uint32_t num_nodes) {
+  assert(num_nodes > 0);
+
+  CpuTopology* simulated = memAlloc(sizeof(CpuTopology), 1, false, NULL);
+  simulated->num_cpus = topology->num_cpus > num_nodes ? topology->num_cpus : num_nodes;
+  simulated->num_nodes = num_nodes;
+  simulated->simulated = true;
+
+  simulated->node_ids = memAlloc(sizeof(uint32_t), num_nodes, false, NULL);
+  for (uint32_t node = 0; node < num_nodes; node++) {
+    simulated->node_ids[node] = node;
+  }
+
+  // The first num_cpus / num_nodes CPUs go to the first node, and so on
+  simulated->cpus = memAlloc(sizeof(CpuInfo), simulated->num_cpus, false, NULL);
+
+  for (uint32_t i = 0; i < simulated->num_cpus; i++) {
+    uint32_t node = (uint32_t)((uint64_t)i * num_nodes / simulated->num_cpus);
+
+    simulated->cpus[i] = (CpuInfo){
+        .cpu = topology->cpus[i % topology->num_cpus].cpu, .node = node, .package = node, .core = i, .rank = 0};
+  }
+
+  simulated->num_physical_cores = simulated->num_cpus;
+
+  return simulated;
+}
+
+CpuTopology* copyTopology(const CpuTopology* topology) {
+  CpuTopology* copy = memAlloc(sizeof(CpuTopology), 1, false, NULL);
+  *copy = *topology;
+
+  copy->node_ids = memAlloc(sizeof(uint32_t), topology->num_nodes, false, NULL);
+  memcpy(copy->node_ids, topology->node_ids, sizeof(uint32_t) * topology->num_nodes);
+
+  copy->cpus = memAlloc(sizeof(CpuInfo), topology->num_cpus, false, NULL);
+  memcpy(copy->cpus, topology->cpus, sizeof(CpuInfo) * topology->num_cpus);
+
+  return copy;
+}
+
+bool parseAffinityPolicy(const char* name, AffinityPolicy* policy) {
+  static const char* names[] = {"none", "compact", "scatter", "cores"};
+
+  for (uint32_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(name, names[i]) == 0) {
+      *policy = (AffinityPolicy)i;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// A CPU along with the keys it's ordered by, from the most significant to the least significant one
+typedef struct placement_key {
+  uint32_t keys[3];
+  CpuInfo cpu;
+} PlacementKey;
+
+static int comparePlacementKeys(const void* a, const void* b) {
+  const PlacementKey* key_a = a;
+  const PlacementKey* key_b = b;
+
+  for (uint32_t i = 0; i < 3; i++) {
+    if (key_a->keys[i] != key_b->keys[i]) {
+      return key_a->keys[i] < key_b->keys[i] ? -1 : 1;
+    }
+  }
+
+  return compareCpus(&key_a->cpu, &key_b->cpu);
+}
+
+void placeThreads(const CpuTopology* topology, AffinityPolicy policy, uint32_t num_threads, CpuInfo* placement) {
+  PlacementKey* order = memAlloc(sizeof(PlacementKey), topology->num_cpus, false, NULL);
+
+  for (uint32_t i = 0; i < topology->num_cpus; i++) {
+    const CpuInfo* cpu = &topology->cpus[i];
+
+    // The position of the CPU's core among the cores of its node
+    uint32_t core_index = 0;
+
+    for (uint32_t j = 0; j < topology->num_cpus; j++) {
+      const CpuInfo* other = &topology->cpus[j];
+
+      core_index += other->node == cpu->node && other->rank == 0 &&
+                    (other->package < cpu->package || (other->package == cpu->package && other->core < cpu->core));
+    }
+
+    order[i].cpu = *cpu;
+
+    switch (policy) {
+      case AFFINITY_COMPACT:
+        order[i].keys[0] = cpu->node;
+        order[i].keys[1] = core_index;
+        order[i].keys[2] = cpu->rank;
+        break;
+
+      case AFFINITY_SCATTER:
+        order[i].keys[0] = cpu->rank;
+        order[i].keys[1] = core_index;
+        order[i].keys[2] = cpu->node;
+        break;
+
+      case AFFINITY_PHYSICAL_CORES:
+        order[i].keys[0] = cpu->rank;
+        order[i].keys[1] = cpu->node;
+        order[i].keys[2] = core_index;
+        break;
+
+      default:
+        assert(false);  // This shouldn't be called
+    }
+  }
+
+  qsort(order, topology->num_cpus, sizeof(PlacementKey), comparePlacementKeys);
+
+  for (uint32_t i = 0; i < num_threads; i++) {
+    placement[i] = order[i % topology->num_cpus].cpu;
+  }
+
+  free(order);
+}
+
+void keepPlacedNodes(CpuTopology* topology, CpuInfo* placement, uint32_t num_threads) {
+  // The new index of each node that has a thread, or UINT32_MAX for the ones that don't
+  uint32_t* new_nodes = memAlloc(sizeof(uint32_t), topology->num_nodes, false, NULL);
+
+  for (uint32_t node = 0; node < topology->num_nodes; node++) {
+    new_nodes[node] = UINT32_MAX;
+  }
+
+  for (uint32_t i = 0; i < num_threads; i++) {
+    new_nodes[placement[i].node] = 0;
+  }
+
+  uint32_t num_nodes = 0;
+
+  for (uint32_t node = 0; node < topology->num_nodes; node++) {
+    if (new_nodes[node] != UINT32_MAX) {
+      topology->node_ids[num_nodes] = topology->node_ids[node];
+      new_nodes[node] = num_nodes++;
+    }
+  }
+
+  // SMT siblings share a node, so the CPUs that are left keep their ranks
+  uint32_t num_cpus = 0;
+  topology->num_physical_cores = 0;
+
+  for (uint32_t i = 0; i < topology->num_cpus; i++) {
+    CpuInfo cpu = topology->cpus[i];
+
+    if (new_nodes[cpu.node] != UINT32_MAX) {
+      cpu.node = new_nodes[cpu.node];
+      topology->cpus[num_cpus++] = cpu;
+      topology->num_physical_cores += cpu.rank == 0;
+    }
+  }
+
+  for (uint32_t i = 0; i < num_threads; i++) {
+    placement[i].node = new_nodes[placement[i].node];
+  }
+
+  topology->num_nodes = num_nodes;
+  topology->num_cpus = num_cpus;
+
+  free(new_nodes);
+}
+
+// Applies a memory policy to the whole pages in [memory, memory + size), for the nodes set in node_mask.
+static bool setMemoryPolicy(
+    void* memory, size_t size, int mode, const unsigned long* node_mask, unsigned long max_node) {
+#if defined(__linux__) && defined(SYS_mbind)
+  uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uintptr_t start = ((uintptr_t)memory + page_size - 1) & ~(page_size - 1);
+  uintptr_t end = ((uintptr_t)memory + size) & ~(page_size - 1);
+
+  if (start >= end) {
+    return false;  // Not even a single whole page
+  }
+
+  return syscall(SYS_mbind, start, end - start, mode, node_mask, max_node, MPOL_MF_MOVE) == 0;
+#else
+  (void)memory;
+  (void)size;
+  (void)mode;
+  (void)node_mask;
+  (void)max_node;
+
+  return false;
+#endif
+}
+
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+bool bindMemoryToNode(void* memory, size_t size, const CpuTopology* topology, uint32_t node) {
+  uint32_t node_id = topology->node_ids[node % topology->num_nodes];
+
+  if (topology->simulated || node_id > MAX_NODE_ID) {
+    return false;
+  }
+
+  unsigned long node_mask[(MAX_NODE_ID + 1) / BITS_PER_LONG] = {0};
+  node_mask[node_id / BITS_PER_LONG] |= 1UL << (node_id % BITS_PER_LONG);
+
+  return setMemoryPolicy(memory, size, MPOL_PREFERRED, node_mask, MAX_NODE_ID + 1);
+}
+
+bool interleaveMemory(void* memory, size_t size, const CpuTopology* topology) {
+  if (topology->simulated) {
+    return false;
+  }
+
+  unsigned long node_mask[(MAX_NODE_ID + 1) / BITS_PER_LONG] = {0};
+
+  for (uint32_t node = 0; node < topology->num_nodes; node++) {
+    uint32_t node_id = topology->node_ids[node];
+
+    if (node_id <= MAX_NODE_ID) {
+      node_mask[node_id / BITS_PER_LONG] |= 1UL << (node_id % BITS_PER_LONG);
+    }
+  }
+
+  return setMemoryPolicy(memory, size, MPOL_INTERLEAVE, node_mask, MAX_NODE_ID + 1);
+}
+
+bool pinCurrentThread(uint32_t cpu) {
+#if defined(__linux__)
+  if (cpu >= CPU_SETSIZE) {
+    return false;
+  }
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+#else
+  (void)cpu;
+  return false;
+#endif
+}
+
+void destroyTopology(CpuTopology* topology) {
+  free(topology->cpus);
+  free(topology->node_ids);
+  free(topology);
+}
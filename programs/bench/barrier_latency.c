@@ -0,0 +1,84 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "helpers.h"
+#include "scheduler.h"
+
+// Measures the latency of a barrier: submitting a trivial job per thread and waiting for all of them, as the stages
+// of a join do. Both backends are measured with threads that go to sleep right away and with threads that spin for
+// a while first, so that the spin time can be tuned.
+
+#define JOB_THREADS 3
+#define REPETITIONS 20000
+
+uint32_t l2size;
+uint8_t nbits1 = 8;
+uint8_t nbits2 = 10;
+
+typedef struct counter_job_args {
+  _Atomic uint64_t *counter;
+} CounterJobArgs;
+
+static void counterJob(void *args_) {
+  CounterJobArgs *args = args_;
+  (*args->counter)++;
+}
+
+static double elapsedMicros(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1e6 + (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+// Returns the average latency of a barrier in microseconds.
+static double measure(SchedulerBackend backend, uint64_t spin_time_ns) {
+  SchedulerOptions options = {.execution_threads = JOB_THREADS, .backend = backend, .spin_time_ns = spin_time_ns};
+  JobScheduler *scheduler = initializeSchedulerWithOptions(&options);
+
+  _Atomic uint64_t counter = 0;
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t i = 0; i < REPETITIONS; i++) {
+    for (uint32_t j = 0; j < JOB_THREADS; j++) {
+      // The kind only determines how the job is called, which is the same for all kinds
+      JobInfo *job_info = createJob(scheduler, counterJob, sizeof(CounterJobArgs), HISTOGRAM_JOB);
+      CounterJobArgs *args = job_info->args;
+      args->counter = &counter;
+
+      submitJob(scheduler, job_info);
+    }
+
+    executeAllJobs(scheduler);
+    waitAllJobs(scheduler);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  destroyScheduler(scheduler);
+
+  if (counter != (uint64_t)REPETITIONS * JOB_THREADS) {
+    fprintf(stderr, "Lost jobs: %" PRIu64 " of %u ran\n", (uint64_t)counter, REPETITIONS * JOB_THREADS);
+    exit(1);
+  }
+
+  return elapsedMicros(&start, &end) / REPETITIONS;
+}
+
+int main(void) {
+  static const char *backend_names[] = {"shared-queue", "work-stealing"};
+  static const SchedulerBackend backends[] = {SHARED_QUEUE_SCHEDULER, WORK_STEALING_SCHEDULER};
+  static const uint64_t spin_times[] = {0, DEFAULT_SPIN_TIME_NS / 10, DEFAULT_SPIN_TIME_NS};
+
+  printf("%14s %14s %14s\n", "backend", "spin (ns)", "barrier (us)");
+
+  for (uint32_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    for (uint32_t j = 0; j < sizeof(spin_times) / sizeof(spin_times[0]); j++) {
+      printf("%14s %14" PRIu64 " %14.2f\n", backend_names[i], spin_times[j], measure(backends[i], spin_times[j]));
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,88 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "helpers.h"
+#include "phjoin.h"
+#include "relation.h"
+#include "scheduler.h"
+
+// Measures the average latency of a single phjoin call for a range of input sizes, once with the strategy phjoin
+// picks on its own and once forcing the partitioned hash join, so that the small-input thresholds can be tuned.
+
+#define JOB_THREADS 3
+#define MAX_VALUE 4096
+#define MAX_TOTAL_TUPLES 1000000  // Bounds the number of repetitions for each size
+
+uint32_t l2size;
+uint8_t nbits1 = 8;
+uint8_t nbits2 = 10;
+
+static JoinRelation *randomRelation(uint32_t num_tuples) {
+  JoinRelation *relation = memAlloc(sizeof(JoinRelation), 1, false, NULL);
+  relation->num_tuples = num_tuples;
+  relation->tuples = memAlloc(sizeof(Tuple), num_tuples, false, NULL);
+  relation->wide_payloads = NULL;
+  relation->unique = false;
+
+  for (uint32_t i = 0; i < num_tuples; i++) {
+    relation->tuples[i].key = i;
+    relation->tuples[i].payload = (uint32_t)rand() % MAX_VALUE;
+  }
+
+  return relation;
+}
+
+static double elapsedMicros(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1e6 + (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+// Returns the average latency of phjoinWithStrategy in microseconds.
+static double measure(
+    JoinRelation *relation_R, JoinRelation *relation_S, JoinStrategy strategy, uint32_t repetitions, JobScheduler *scheduler) {
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t i = 0; i < repetitions; i++) {
+    destroyJoinRelation(phjoinWithStrategy(relation_R, relation_S, strategy, scheduler));
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return elapsedMicros(&start, &end) / repetitions;
+}
+
+int main(void) {
+  static const uint32_t sizes[][2] = {{8, 64}, {32, 128}, {64, 1024}, {256, 4096}, {1024, 8192}, {1024, 32768}, {4096, 65536}};
+
+  l2size = getL2CacheSize() / JOB_THREADS;
+  srand(42);
+
+  JobScheduler *scheduler = initializeScheduler(JOB_THREADS);
+
+  printf("%8s %8s %18s %14s %14s\n", "|R|", "|S|", "strategy", "chosen (us)", "partitioned (us)");
+
+  for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    JoinRelation *relation_R = randomRelation(sizes[i][0]);
+    JoinRelation *relation_S = randomRelation(sizes[i][1]);
+
+    uint32_t repetitions = MAX_TOTAL_TUPLES / (sizes[i][0] + sizes[i][1]) + 1;
+    JoinStrategy strategy = chooseJoinStrategy(relation_R->num_tuples, relation_S->num_tuples);
+
+    double chosen = measure(relation_R, relation_S, strategy, repetitions, scheduler);
+    double partitioned = measure(relation_R, relation_S, PARTITIONED_HASH_JOIN, repetitions, scheduler);
+
+    printf("%8" PRIu32 " %8" PRIu32 " %18s %14.2f %14.2f\n", sizes[i][0], sizes[i][1], joinStrategyName(strategy), chosen,
+           partitioned);
+
+    destroyJoinRelation(relation_R);
+    destroyJoinRelation(relation_S);
+  }
+
+  destroyScheduler(scheduler);
+
+  return 0;
+}
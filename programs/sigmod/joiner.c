@@ -1,5 +1,4 @@
 #include <assert.h>
-#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -7,165 +6,156 @@
 #include <string.h>
 
 #include "helpers.h"
+#include "index.h"
 #include "optimizer.h"
 #include "phjoin.h"
 #include "query.h"
 #include "relation.h"
 #include "scheduler.h"
+#include "topology.h"
 
 #define WORKLOADS_DIR "./workloads/"
 #define PUBLIC_DIR "./public/"
 
 #define MAX_RESULTS 15
-#define MAX_THREADS 3
-#define JOB_THREADS 3
+
+// What a query that ran out of time prints in place of each of its checksums
+#define TIMEOUT_CHECKSUM "TIMEOUT"
 
 // Wrapper around the checksums of a batch
 typedef struct results {
   uint64_t projections;
   uint64_t *checksums;
-} Results;
-
-// Mutex for queue of queries
-pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-// Condition variable if queue is empty
-pthread_cond_t empty_pool = PTHREAD_COND_INITIALIZER;
 
-// Condition variable if queue is full
-pthread_cond_t full_pool = PTHREAD_COND_INITIALIZER;
+  // Whether the query ran out of time (see query_time_budget_ns), in which case its checksums are meaningless
+  bool timed_out;
+} Results;
 
-// Query job to be passed in args
-typedef struct query_job {
+// Arguments of a query job
+typedef struct query_job_args {
   // The query to be handled
   Query *query;
 
   // Where the checksum results should go
   uint8_t index;
-
-} QueryJob;
-
-// The queue to be used for queries
-typedef struct {
-  QueryJob **pool;
-  int front;
-  int rear;
-  int count;
-} queue;
-
-void initQueue(queue *q) {
-  q->pool = memAlloc(sizeof(QueryJob *), MAX_THREADS, true, NULL);
-  q->front = 0;
-  q->rear = -1;
-  q->count = 0;
-}
-
-void enQueue(queue *q, QueryJob *job) {
-  if (q->count >= MAX_THREADS) {
-    fprintf(stderr, "Overflow o'clock\n");
-  } else {
-    q->rear = (q->rear + 1) % MAX_THREADS;
-    q->pool[q->rear] = job;
-    q->count++;
-  }
-}
-
-QueryJob *deQueue(queue *q) {
-  QueryJob *job;
-  if (q->count <= 0) {
-    fprintf(stderr, "Underflow o'clock\n");
-    return NULL;
-  } else {
-    job = q->pool[q->front];
-    q->front = (q->front + 1) % MAX_THREADS;
-    q->count--;
-    return job;
-  }
-}
-
-queue thread_pool;
+} QueryJobArgs;
 
 RelationStats *data_statistics[NUM_RELATIONS];
 Relation *relations[NUM_RELATIONS];
 Results *batch_results[MAX_RESULTS];
-uint8_t threads;
+
+// A single pool runs both the queries of each batch and their joins' jobs, so idle threads can help any query
+JobScheduler *scheduler;
+
+// How long a query may run before its joins are abandoned, or 0 for no limit. Such queries print TIMEOUT_CHECKSUM
+// instead of their checksums, so that they can't be mistaken for queries whose result is actually empty.
+uint64_t query_time_budget_ns = 0;
 
 uint32_t l2size;
 uint8_t nbits1 = 8;
 uint8_t nbits2 = 10;
 
-static void *query_job(void *args) {
-  uint8_t query_count = *(uint8_t *)args;
-  Query *query;
+static void queryJob(void *args_) {
+  QueryJobArgs *args = args_;
+  Query *query = args->query;
 
-  while (1) {
-    pthread_mutex_lock(&pool_mutex);
-
-    // Wait if there is no jobs yet
-    while (threads >= MAX_THREADS)
-      pthread_cond_wait(&empty_pool, &pool_mutex);
-
-    // Find the current query_count that you need to put the results
-    QueryJob *job = deQueue(&thread_pool);
-    query_count = job->index;
-    query = job->query;
-
-    // Used to know whether to short-circuit in case we get a NULL in the output
-    bool empty_result = false;
-
-    // Apply filters
-    RowIDs **filter_inters = memAlloc(sizeof(RowIDs *), query->num_relations, true, NULL);
-    filter_inters = applyFilters(relations, filter_inters, query, &empty_result);
-
-    // Apply joins
-    RowIDs **join_inters = memAlloc(sizeof(RowIDs *), query->num_relations, true, NULL);
-    if (!empty_result) {
-      // Run through the transformer and optimizer
-      optimizeQuery(query, data_statistics, NUM_RELATIONS, true);
-      JobScheduler *scheduler = initializeScheduler(JOB_THREADS);
-      join_inters = applyJoins(relations, join_inters, filter_inters, query, &empty_result, scheduler);
-      destroyScheduler(scheduler);
-    }
+  // Used to know whether to short-circuit in case we get a NULL in the output
+  bool empty_result = false;
 
-    batch_results[query_count]->checksums = calculateChecksums(join_inters, relations, query, empty_result);
-    batch_results[query_count]->projections = query->num_projections;
+  // The query's jobs go through a group of their own, so that waiting for them (or cancelling them) doesn't affect
+  // other queries
+  JobScheduler *job_group = createJobGroup(scheduler);
 
-    if (join_inters != NULL) {
-      for (uint32_t i = 0; i < query->num_relations; i++) {
-        if (join_inters[i] != NULL) {
-          free(join_inters[i]->ids);
-          free(join_inters[i]);
-        }
-      }
-      free(join_inters);
-    }
+  if (query_time_budget_ns != 0) {
+    setJobGroupDeadline(job_group, query_time_budget_ns);
+  }
 
-    if (filter_inters) {
-      for (uint32_t i = 0; i < query->num_relations; i++) {
-        if (filter_inters[i] != NULL) {
-          free(filter_inters[i]->ids);
-          free(filter_inters[i]);
-        }
-      }
-      free(filter_inters);
-    }
-    free(query);
+  // Apply filters, the most selective ones first, with their morsels spread over the pool
+  orderFilters(query, data_statistics);
+  RowIDs **filter_inters = memAlloc(sizeof(RowIDs *), query->num_relations, true, NULL);
+  filter_inters = applyFilters(relations, filter_inters, query, &empty_result, job_group);
+
+  // Apply joins, waiting only for this query's jobs
+  Intermediate *join_inter = NULL;
+  if (!empty_result) {
+    // Run through the transformer and optimizer
+    optimizeQuery(query, data_statistics, NUM_RELATIONS, true);
+    join_inter = applyJoins(relations, filter_inters, query, &empty_result, job_group);
+  }
+
+  // The deadline is the only way the group gets cancelled, and cancelled operators report their results as empty
+  batch_results[args->index]->timed_out = empty_result && isCancelled(&job_group->cancellation);
+
+  destroyJobGroup(job_group);
 
-    // Make that thread available again
-    threads++;
+  batch_results[args->index]->checksums = calculateChecksums(join_inter, relations, query, empty_result);
+  batch_results[args->index]->projections = query->num_projections;
 
-    // Send signal full pool
-    pthread_cond_signal(&full_pool);
-    pthread_mutex_unlock(&pool_mutex);
+  destroyIntermediate(join_inter);
+
+  if (filter_inters != NULL) {
+    destroyInters(filter_inters, query->num_relations);
   }
 
-  return NULL;
+  free(query);
 }
 
 int main(void) {
-  l2size = getL2CacheSize() / JOB_THREADS;
+  // One thread per core, each of which can use its core's L2 cache
+  l2size = getL2CacheSize();
+
+  SchedulerOptions scheduler_options = {.execution_threads = getNumCores(),
+                                       .backend = WORK_STEALING_SCHEDULER,
+                                       .affinity = AFFINITY_SCATTER,
+                                       .spin_time_ns = defaultSpinTime()};
+
+  // The threads are pinned so that they keep their L2 caches, which can be changed through PHJ_AFFINITY (see
+  // parseAffinityPolicy). With the "cores" policy, there's a thread per physical core instead of one per CPU.
+  const char *affinity = getenv("PHJ_AFFINITY");
+  if (affinity != NULL && !parseAffinityPolicy(affinity, &scheduler_options.affinity)) {
+    fprintf(stderr, "Unknown affinity policy: %s\n", affinity);
+    return 1;
+  }
+
+  // PHJ_QUERY_TIME_BUDGET_MS bounds the time each query may take (see query_time_budget_ns)
+  const char *time_budget = getenv("PHJ_QUERY_TIME_BUDGET_MS");
+  if (time_budget != NULL) {
+    query_time_budget_ns = strtoull(time_budget, NULL, 10) * 1000000;
+  }
+
+  // PHJ_POINT_INDEX_BUDGET_MB bounds the memory of the point indexes built for equality filters (see getPointIndex)
+  const char *index_budget = getenv("PHJ_POINT_INDEX_BUDGET_MB");
+  if (index_budget != NULL) {
+    setPointIndexBudget(strtoull(index_budget, NULL, 10) << 20);
+  }
+
+  // PHJ_BITMAP_MAX_VALUES sets how many distinct values a column may have to get a bitmap index (0 for none)
+  uint32_t bitmap_max_values = DEFAULT_BITMAP_MAX_VALUES;
+  const char *max_values = getenv("PHJ_BITMAP_MAX_VALUES");
+  if (max_values != NULL) {
+    bitmap_max_values = (uint32_t)strtoul(max_values, NULL, 10);
+  }
+
+  CpuTopology *topology = detectTopology();
+
+  // PHJ_NUMA_NODES splits the machine into the given number of simulated NUMA nodes, to exercise the NUMA-aware
+  // scheduling on single-node machines (no memory is actually bound to the simulated nodes)
+  const char *simulated_nodes = getenv("PHJ_NUMA_NODES");
+  if (simulated_nodes != NULL && atoi(simulated_nodes) > 0) {
+    CpuTopology *simulated_topology = simulateTopology(topology, (uint32_t)atoi(simulated_nodes));
+    destroyTopology(topology);
+    topology = simulated_topology;
+  }
+
+  if (scheduler_options.affinity == AFFINITY_PHYSICAL_CORES) {
+    scheduler_options.execution_threads = topology->num_physical_cores;
+  }
+
+  scheduler_options.topology = topology;
+  scheduler = initializeSchedulerWithOptions(&scheduler_options);
 
-  initQueue(&thread_pool);
+  // With PHJ_INTERLEAVE_COLUMNS set, the relations' columns are spread over all the NUMA nodes (see interleaveRelation)
+  bool interleave_columns = getenv("PHJ_INTERLEAVE_COLUMNS") != NULL && topology->num_nodes > 1;
 
   char path[128];
   char *path_end;
@@ -189,39 +179,40 @@ int main(void) {
     // Load the relation
     relations[i] = loadRelation(path);
 
+    if (interleave_columns) {
+      interleaveRelation(relations[i], topology);
+    }
+
     // Gather the statistics in less than 1 second
     data_statistics[i] = gatherStatistics(relations[i]);
+
+    // Index the low-cardinality columns, so that their filters can be answered with bitmaps
+    if (bitmap_max_values > 0) {
+      buildBitmapIndexes(relations[i], bitmap_max_values);
+    }
   }
 
   for (int i = 0; i < MAX_RESULTS; i++) {
-    batch_results[i] = malloc(sizeof(Results *));
+    batch_results[i] = malloc(sizeof(Results));
   }
 
-  // Variables used in the loop
-  threads = MAX_THREADS;
   uint8_t query_count = 0;
 
-  pthread_t *thread_handles;
-  int thread;
-  thread_handles = (pthread_t *)malloc(MAX_THREADS * sizeof(pthread_t));
-  pthread_mutex_init(&pool_mutex, NULL);
-
-  for (thread = 0; thread < MAX_THREADS; thread++)
-    pthread_create(&thread_handles[thread], NULL, query_job, (void *)&thread);
-
   // Then, read all query batches ('F' is used to separate each batch)
   for (int ch = fgetc(stdin); ch != EOF; ch = fgetc(stdin)) {
     if (ch == 'F' || ch == '\n') {
-      pthread_mutex_lock(&pool_mutex);
-
-      // Wait if queue isn't full meaning the threads haven't finished
-      while (threads < MAX_THREADS)
-        pthread_cond_wait(&full_pool, &pool_mutex);
-
-      pthread_mutex_unlock(&pool_mutex);
+      // Wait for the batch's queries (the scheduler's own group is only used for them)
+      waitAllJobs(scheduler);
 
       for (int i = 0; i < query_count; i++) {
-        printChecksums(stdout, batch_results[i]->checksums, batch_results[i]->projections);
+        if (batch_results[i]->timed_out) {
+          for (uint64_t j = 0; j < batch_results[i]->projections; j++) {
+            printf("%s%s", TIMEOUT_CHECKSUM, j + 1 == batch_results[i]->projections ? "\n" : " ");
+          }
+        } else {
+          printChecksums(stdout, batch_results[i]->checksums, batch_results[i]->projections);
+        }
+
         free(batch_results[i]->checksums);
       }
       query_count = 0;
@@ -232,23 +223,16 @@ int main(void) {
     // We push the read character back to the input stream because we need it to parse the query
     ungetc(ch, stdin);
 
-    pthread_mutex_lock(&pool_mutex);
+    assert(query_count < MAX_RESULTS);
 
-    // Wait if there are no available threads
-    while (threads < 1)
-      pthread_cond_wait(&full_pool, &pool_mutex);
+    JobInfo *job_info = createJob(scheduler, queryJob, sizeof(QueryJobArgs), QUERY_JOB);
+    QueryJobArgs *args = job_info->args;
+    args->query = parseQuery(stdin);
+    args->index = query_count++;
 
-    // Add the new query in the queue
-    QueryJob *job = malloc(sizeof(QueryJob));
-    job->query = parseQuery(stdin);
-    job->index = query_count;
-    query_count++;
-    enQueue(&thread_pool, job);
-
-    threads--;
-
-    pthread_cond_signal(&empty_pool);
-    pthread_mutex_unlock(&pool_mutex);
+    // Start the query right away, while the rest of the batch is being parsed
+    submitJob(scheduler, job_info);
+    executeAllJobs(scheduler);
   }
 
   fflush(stdout);
@@ -257,13 +241,11 @@ int main(void) {
   for (int i = 0; i < MAX_RESULTS; i++) {
     free(batch_results[i]);
   }
-  free(thread_pool.pool);
+  destroyScheduler(scheduler);
+  destroyTopology(topology);
   destroyStats(data_statistics, NUM_RELATIONS);
   for (uint32_t i = 0; i < NUM_RELATIONS; i++) {
-    if (relations[i] != NULL) {
-      free(relations[i]->columns);
-      free(relations[i]);
-    }
+    destroyRelation(relations[i]);
   }
 
   return 0;
@@ -0,0 +1,403 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "acutest.h"
+#include "filter.h"
+#include "helpers.h"
+
+#define NUM_ROWS 1003  // Not a multiple of any vector width, so that the scalar tails are exercised too
+#define MAX_VALUE 64
+
+static const FilterIsa isas[] = {FILTER_SCALAR, FILTER_AVX2, FILTER_AVX512};
+static const Operator operators[] = {LT, GT, EQ};
+
+// Values in [0, MAX_VALUE), some of which have their top bit set, so that the comparisons must be unsigned.
+uint64_t* _randomColumn(void) {
+  uint64_t* column = memAlloc(sizeof(uint64_t), NUM_ROWS, false, NULL);
+
+  for (uint32_t i = 0; i < NUM_ROWS; i++) {
+    column[i] = (uint64_t)(rand() % MAX_VALUE);
+
+    if (rand() % 4 == 0) {
+      column[i] |= (uint64_t)1 << 63;
+    }
+  }
+
+  return column;
+}
+
+bool _holds(Operator op, uint64_t value, uint64_t constant) {
+  return op == LT ? value < constant : op == GT ? value > constant : value == constant;
+}
+
+void testSelectRows(void) {
+  uint64_t* column = _randomColumn();
+  uint32_t* selection = memAlloc(sizeof(uint32_t), NUM_ROWS, false, NULL);
+
+  uint64_t constants[] = {0, MAX_VALUE / 2, (uint64_t)1 << 63, ((uint64_t)1 << 63) + MAX_VALUE / 2, UINT64_MAX};
+  uint32_t ranges[][2] = {{0, NUM_ROWS}, {3, NUM_ROWS - 2}, {5, 5}, {7, 10}};
+
+  for (uint32_t i = 0; i < sizeof(isas) / sizeof(isas[0]); i++) {
+    if (!filterIsaSupported(isas[i])) {
+      continue;
+    }
+
+    for (uint32_t op = 0; op < 3; op++) {
+      for (uint32_t c = 0; c < sizeof(constants) / sizeof(constants[0]); c++) {
+        for (uint32_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+          uint32_t start = ranges[r][0], end = ranges[r][1];
+          uint32_t count = selectRowsWith(isas[i], column, start, end, operators[op], constants[c], selection);
+
+          // The selection must hold exactly the qualifying rows, in order
+          uint32_t expected = 0;
+
+          for (uint32_t row_id = start; row_id < end; row_id++) {
+            if (_holds(operators[op], column[row_id], constants[c])) {
+              TEST_ASSERT(expected < count && selection[expected] == row_id);
+              expected++;
+            }
+          }
+
+          TEST_ASSERT(count == expected);
+        }
+      }
+    }
+  }
+
+  free(selection);
+  free(column);
+}
+
+void testRefineSelection(void) {
+  uint64_t* column = _randomColumn();
+  uint32_t* selection = memAlloc(sizeof(uint32_t), NUM_ROWS, false, NULL);
+  uint32_t* refined = memAlloc(sizeof(uint32_t), NUM_ROWS, false, NULL);
+
+  // Every other row, so that the values have to be gathered
+  uint32_t num_selected = 0;
+  for (uint32_t row_id = 0; row_id < NUM_ROWS; row_id += 2) {
+    selection[num_selected++] = row_id;
+  }
+
+  for (uint32_t i = 0; i < sizeof(isas) / sizeof(isas[0]); i++) {
+    if (!filterIsaSupported(isas[i])) {
+      continue;
+    }
+
+    for (uint32_t op = 0; op < 3; op++) {
+      uint64_t constant = ((uint64_t)1 << 63) + MAX_VALUE / 2;
+      uint32_t count = refineSelectionWith(isas[i], column, selection, num_selected, operators[op], constant, refined);
+
+      uint32_t expected = 0;
+      for (uint32_t j = 0; j < num_selected; j++) {
+        if (_holds(operators[op], column[selection[j]], constant)) {
+          TEST_ASSERT(expected < count && refined[expected] == selection[j]);
+          expected++;
+        }
+      }
+
+      TEST_ASSERT(count == expected);
+
+      // Refining in place must give the same result
+      uint32_t* in_place = memAlloc(sizeof(uint32_t), num_selected, false, NULL);
+      memcpy(in_place, selection, num_selected * sizeof(uint32_t));
+
+      TEST_ASSERT(refineSelectionWith(isas[i], column, in_place, num_selected, operators[op], constant, in_place) ==
+                  count);
+      TEST_ASSERT(memcmp(in_place, refined, count * sizeof(uint32_t)) == 0);
+
+      free(in_place);
+    }
+  }
+
+  free(refined);
+  free(selection);
+  free(column);
+}
+
+void testAddFilterPredicate(void) {
+  uint64_t column1[1], column2[1];
+  FusedFilter filter;
+
+  // Predicates on the same column are merged into a single range
+  initializeFusedFilter(&filter);
+  addFilterPredicate(&filter, column1, NULL, GT, 3000);
+  addFilterPredicate(&filter, column2, NULL, EQ, 7);
+  addFilterPredicate(&filter, column1, NULL, LT, 5000);
+  addFilterPredicate(&filter, column1, NULL, GT, 2000);
+
+  TEST_ASSERT(filter.num_ranges == 2 && !filter.never_holds);
+  TEST_ASSERT(filter.ranges[0].column == column1 && filter.ranges[0].low == 3001 && filter.ranges[0].high == 4999);
+  TEST_ASSERT(filter.ranges[1].column == column2 && filter.ranges[1].low == 7 && filter.ranges[1].high == 7);
+
+  // Contradicting predicates can't hold for any row
+  addFilterPredicate(&filter, column2, NULL, GT, 7);
+  TEST_ASSERT(filter.never_holds);
+
+  initializeFusedFilter(&filter);
+  addFilterPredicate(&filter, column1, NULL, LT, 0);
+  TEST_ASSERT(filter.never_holds);
+
+  initializeFusedFilter(&filter);
+  addFilterPredicate(&filter, column1, NULL, GT, UINT64_MAX - 1);
+  TEST_ASSERT(!filter.never_holds && filter.ranges[0].low == UINT64_MAX && filter.ranges[0].high == UINT64_MAX);
+}
+
+void testFusedFilter(void) {
+  uint64_t* columns[3] = {_randomColumn(), _randomColumn(), _randomColumn()};
+  uint32_t* selection = memAlloc(sizeof(uint32_t), NUM_ROWS, false, NULL);
+  uint32_t* refined = memAlloc(sizeof(uint32_t), NUM_ROWS, false, NULL);
+  uint32_t* odd_rows = memAlloc(sizeof(uint32_t), NUM_ROWS, false, NULL);
+
+  uint32_t num_odd_rows = 0;
+  for (uint32_t row_id = 1; row_id < NUM_ROWS; row_id += 2) {
+    odd_rows[num_odd_rows++] = row_id;
+  }
+
+  for (uint32_t round = 0; round < 50; round++) {
+    // Up to 5 random predicates on the 3 columns, so that some of them are on the same column
+    uint32_t num_predicates = 1 + (uint32_t)rand() % 5;
+    uint32_t predicate_columns[5];
+    Operator predicate_operators[5];
+    uint64_t predicate_constants[5];
+
+    FusedFilter filter;
+    initializeFusedFilter(&filter);
+
+    for (uint32_t p = 0; p < num_predicates; p++) {
+      predicate_columns[p] = (uint32_t)rand() % 3;
+      predicate_operators[p] = operators[rand() % 3];
+      predicate_constants[p] = (uint64_t)(rand() % MAX_VALUE) | (rand() % 2 == 0 ? (uint64_t)1 << 63 : 0);
+
+      addFilterPredicate(&filter, columns[predicate_columns[p]], NULL, predicate_operators[p], predicate_constants[p]);
+    }
+
+    for (uint32_t i = 0; i < sizeof(isas) / sizeof(isas[0]); i++) {
+      if (!filterIsaSupported(isas[i])) {
+        continue;
+      }
+
+      uint32_t count = selectFusedRowsWith(isas[i], &filter, 0, NUM_ROWS, selection);
+      uint32_t refined_count = refineFusedSelectionWith(isas[i], &filter, odd_rows, num_odd_rows, refined);
+
+      // Both must hold exactly the rows that satisfy every predicate, in order
+      uint32_t expected = 0, expected_refined = 0;
+
+      for (uint32_t row_id = 0; row_id < NUM_ROWS; row_id++) {
+        bool passes = true;
+        for (uint32_t p = 0; p < num_predicates; p++) {
+          passes &= _holds(predicate_operators[p], columns[predicate_columns[p]][row_id], predicate_constants[p]);
+        }
+
+        if (passes) {
+          TEST_ASSERT(expected < count && selection[expected] == row_id);
+          expected++;
+
+          if (row_id % 2 == 1) {
+            TEST_ASSERT(expected_refined < refined_count && refined[expected_refined] == row_id);
+            expected_refined++;
+          }
+        }
+      }
+
+      TEST_ASSERT(count == expected);
+      TEST_ASSERT(refined_count == expected_refined);
+    }
+  }
+
+  // A filter without predicates selects every row
+  FusedFilter filter;
+  initializeFusedFilter(&filter);
+  TEST_ASSERT(selectFusedRows(&filter, 0, NUM_ROWS, selection) == NUM_ROWS && selection[NUM_ROWS - 1] == NUM_ROWS - 1);
+
+  free(odd_rows);
+  free(refined);
+  free(selection);
+  for (uint32_t c = 0; c < 3; c++) {
+    free(columns[c]);
+  }
+}
+
+void testSelectFusedRowsByZone(void) {
+  // A sorted column and a random one, with 10.5 zones
+  uint32_t num_rows = 10 * ZONE_SIZE + ZONE_SIZE / 2;
+  uint32_t num_zones = 11;
+
+  uint64_t* sorted = memAlloc(sizeof(uint64_t), num_rows, false, NULL);
+  uint64_t* random = memAlloc(sizeof(uint64_t), num_rows, false, NULL);
+  Zone* sorted_zones = memAlloc(sizeof(Zone), num_zones, false, NULL);
+  Zone* random_zones = memAlloc(sizeof(Zone), num_zones, false, NULL);
+
+  for (uint32_t i = 0; i < num_rows; i++) {
+    sorted[i] = i;
+    random[i] = (uint64_t)(rand() % MAX_VALUE);
+  }
+
+  for (uint32_t zone = 0; zone < num_zones; zone++) {
+    sorted_zones[zone] = (Zone){.min = UINT64_MAX, .max = 0};
+    random_zones[zone] = (Zone){.min = UINT64_MAX, .max = 0};
+
+    for (uint32_t i = zone * ZONE_SIZE; i < num_rows && i < (zone + 1) * ZONE_SIZE; i++) {
+      sorted_zones[zone].min = sorted[i] < sorted_zones[zone].min ? sorted[i] : sorted_zones[zone].min;
+      sorted_zones[zone].max = sorted[i] > sorted_zones[zone].max ? sorted[i] : sorted_zones[zone].max;
+      random_zones[zone].min = random[i] < random_zones[zone].min ? random[i] : random_zones[zone].min;
+      random_zones[zone].max = random[i] > random_zones[zone].max ? random[i] : random_zones[zone].max;
+    }
+  }
+
+  uint32_t* selection = memAlloc(sizeof(uint32_t), num_rows, false, NULL);
+  uint64_t zone_counts[3] = {0, 0, 0};
+
+  // Rows in [3.5 zones, 7.5 zones): the first 3 zones are skipped, the next 3 accepted and the 2 at the edges scanned
+  FusedFilter filter;
+  initializeFusedFilter(&filter);
+  addFilterPredicate(&filter, sorted, sorted_zones, GT, 3 * ZONE_SIZE + ZONE_SIZE / 2 - 1);
+  addFilterPredicate(&filter, sorted, sorted_zones, LT, 7 * ZONE_SIZE + ZONE_SIZE / 2);
+
+  TEST_ASSERT(selectFusedRowsByZone(&filter, 0, num_rows, selection, zone_counts) == 4 * ZONE_SIZE);
+  TEST_ASSERT(selection[0] == 3 * ZONE_SIZE + ZONE_SIZE / 2);
+  TEST_ASSERT(selection[4 * ZONE_SIZE - 1] == 7 * ZONE_SIZE + ZONE_SIZE / 2 - 1);
+  TEST_ASSERT(zone_counts[ZONE_NONE] == 6 && zone_counts[ZONE_ALL] == 3 && zone_counts[ZONE_SOME] == 2);
+
+  // Starting and ending within zones, and with a column whose zones can't rule anything out
+  addFilterPredicate(&filter, random, random_zones, LT, MAX_VALUE / 2);
+
+  uint32_t start = ZONE_SIZE / 3, end = num_rows - ZONE_SIZE / 3;
+  uint32_t count = selectFusedRowsByZone(&filter, start, end, selection, NULL);
+  uint32_t expected = 0;
+
+  for (uint32_t i = start; i < end; i++) {
+    if (sorted[i] > 3 * ZONE_SIZE + ZONE_SIZE / 2 - 1 && sorted[i] < 7 * ZONE_SIZE + ZONE_SIZE / 2 &&
+        random[i] < MAX_VALUE / 2) {
+      TEST_ASSERT(expected < count && selection[expected] == i);
+      expected++;
+    }
+  }
+
+  TEST_ASSERT(count == expected);
+
+  // Columns without zone maps never rule out a zone
+  FusedFilter no_zones;
+  initializeFusedFilter(&no_zones);
+  addFilterPredicate(&no_zones, sorted, NULL, GT, UINT64_MAX - 1);
+  TEST_ASSERT(matchZone(&no_zones, 0) == ZONE_SOME);
+
+  free(selection);
+  free(random_zones);
+  free(sorted_zones);
+  free(random);
+  free(sorted);
+}
+
+void testDetectFilterIsa(void) {
+  FilterIsa isa = detectFilterIsa();
+
+  TEST_ASSERT(filterIsaSupported(FILTER_SCALAR));
+  TEST_ASSERT(filterIsaSupported(isa));
+  TEST_ASSERT(isa == FILTER_AVX512 || !filterIsaSupported(FILTER_AVX512));
+}
+
+// Tests whether the rows of a sorted column that fall in a range are the ones that a scan would select.
+void testFindSortedRows(void) {
+  uint64_t* column = _randomColumn();
+  uint32_t* selection = memAlloc(sizeof(uint32_t), NUM_ROWS, false, NULL);
+
+  // Sorted in unsigned order (with duplicates), by counting the values with and without their top bit set
+  uint32_t counts[2][MAX_VALUE] = {{0}};
+  for (uint32_t i = 0; i < NUM_ROWS; i++) {
+    counts[column[i] >> 63][column[i] % MAX_VALUE]++;
+  }
+
+  for (uint32_t top = 0, i = 0; top < 2; top++) {
+    for (uint64_t value = 0; value < MAX_VALUE; value++) {
+      for (uint32_t j = 0; j < counts[top][value]; j++) {
+        column[i++] = value | (uint64_t)top << 63;
+      }
+    }
+  }
+
+  uint64_t constants[] = {0, MAX_VALUE / 2, (uint64_t)1 << 63, ((uint64_t)1 << 63) + MAX_VALUE / 2, UINT64_MAX};
+
+  for (uint32_t o = 0; o < 3; o++) {
+    for (uint32_t c = 0; c < sizeof(constants) / sizeof(constants[0]); c++) {
+      FusedFilter filter;
+      initializeFusedFilter(&filter);
+      addFilterPredicate(&filter, column, NULL, operators[o], constants[c]);
+
+      // Predicates that can't hold don't narrow their range down, so they're left to the caller
+      if (filter.never_holds) {
+        continue;
+      }
+
+      uint32_t count = selectFusedRows(&filter, 0, NUM_ROWS, selection);
+      uint32_t start = 0, end = NUM_ROWS;
+
+      findSortedRows(&filter.ranges[0], &start, &end);
+      TEST_ASSERT(end - start == count);
+      TEST_ASSERT(count == 0 || (selection[0] == start && selection[count - 1] == end - 1));
+    }
+  }
+
+  free(column);
+  free(selection);
+}
+
+void testSelectEqualRows(void) {
+  uint64_t* left_column = _randomColumn();
+  uint64_t* right_column = _randomColumn();
+  uint32_t* left_ids = memAlloc(sizeof(uint32_t), NUM_ROWS, false, NULL);
+  uint32_t* right_ids = memAlloc(sizeof(uint32_t), NUM_ROWS, false, NULL);
+  uint32_t* selection = memAlloc(sizeof(uint32_t), NUM_ROWS, false, NULL);
+
+  // Random rows of each column, like the rows of two relations in an intermediate result
+  for (uint32_t i = 0; i < NUM_ROWS; i++) {
+    left_ids[i] = (uint32_t)rand() % NUM_ROWS;
+    right_ids[i] = (uint32_t)rand() % NUM_ROWS;
+  }
+
+  uint32_t ranges[][2] = {{0, NUM_ROWS}, {3, NUM_ROWS - 2}, {5, 5}, {7, 10}};
+
+  for (uint32_t i = 0; i < sizeof(isas) / sizeof(isas[0]); i++) {
+    if (!filterIsaSupported(isas[i])) {
+      continue;
+    }
+
+    for (uint32_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+      uint32_t start = ranges[r][0], end = ranges[r][1];
+      uint32_t count =
+          selectEqualRowsWith(isas[i], left_column, left_ids, right_column, right_ids, start, end, selection);
+
+      uint32_t expected = 0;
+
+      for (uint32_t position = start; position < end; position++) {
+        if (left_column[left_ids[position]] == right_column[right_ids[position]]) {
+          TEST_ASSERT(expected < count && selection[expected] == position);
+          expected++;
+        }
+      }
+
+      TEST_ASSERT(count == expected);
+    }
+  }
+
+  // A column is always equal to itself
+  TEST_ASSERT(selectEqualRows(left_column, left_ids, left_column, left_ids, 0, NUM_ROWS, selection) == NUM_ROWS);
+
+  free(selection);
+  free(right_ids);
+  free(left_ids);
+  free(right_column);
+  free(left_column);
+}
+
+TEST_LIST = {{"testSelectRows", testSelectRows},
+             {"testRefineSelection", testRefineSelection},
+             {"testAddFilterPredicate", testAddFilterPredicate},
+             {"testFusedFilter", testFusedFilter},
+             {"testSelectFusedRowsByZone", testSelectFusedRowsByZone},
+             {"testDetectFilterIsa", testDetectFilterIsa},
+             {"testFindSortedRows", testFindSortedRows},
+             {"testSelectEqualRows", testSelectEqualRows},
+             {NULL, NULL}};
@@ -22,4 +22,28 @@ void testHelpers(void) {
   }
 }
 
-TEST_LIST = {{"testHelpers", testHelpers}, {NULL, NULL}};
+void testAppendRowIDs(void) {
+  uint32_t ids[1000];
+  for (uint32_t i = 0; i < 1000; i++) {
+    ids[i] = 3 * i;
+  }
+
+  RowIDs *row_ids = NULL;
+  appendRowIDs(ids, 0, &row_ids);
+  TEST_ASSERT(row_ids == NULL);
+
+  // The first append fits in the initial capacity, and the second one outgrows it
+  appendRowIDs(ids, 10, &row_ids);
+  addRowID(7, &row_ids);
+  appendRowIDs(ids + 10, 990, &row_ids);
+
+  TEST_ASSERT(row_ids->count == 1001 && row_ids->capacity >= 1001);
+  TEST_ASSERT(row_ids->ids[9] == 27 && row_ids->ids[10] == 7);
+  for (uint32_t i = 10; i < 1000; i++) {
+    TEST_ASSERT(row_ids->ids[i + 1] == 3 * i);
+  }
+
+  destroyRowIDs(row_ids);
+}
+
+TEST_LIST = {{"testHelpers", testHelpers}, {"testAppendRowIDs", testAppendRowIDs}, {NULL, NULL}};
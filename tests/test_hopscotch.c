@@ -232,10 +232,68 @@ void testSearch(void) {
   destroyHashTable(table);
 }
 
+// Tests that a reset table behaves like a new one, both when it keeps its buckets and when it needs more.
+void testReset(void) {
+  uint32_t neighbourhood_size = 4;
+
+  HashTable *table = createHashTable(16, neighbourhood_size);
+  _testBasicInsert(table, 16);
+
+  // Shrinking keeps the same buckets around
+  Bucket *buckets = table->buckets;
+  resetHashTable(table, 8);
+
+  TEST_ASSERT(table->buckets == buckets);
+  TEST_ASSERT(table->size == 0);
+  TEST_ASSERT(table->capacity == 8);
+
+  for (uint32_t i = 0; i < table->capacity; i++) {
+    TEST_ASSERT(0 == table->buckets[i].bitmap);
+    TEST_ASSERT(NULL == search(table, i));
+  }
+
+  _testBasicInsert(table, 8);
+
+  for (uint32_t i = 0; i < 8; i++) {
+    RowIDs *row_ids = search(table, i);
+
+    TEST_ASSERT(row_ids != NULL && row_ids->count == 1);
+    TEST_ASSERT(row_ids->ids[0] == i);
+
+    destroyRowIDs(row_ids);
+  }
+
+  // Growing past the allocated buckets replaces them
+  resetHashTable(table, 64);
+
+  TEST_ASSERT(table->capacity == 64);
+  TEST_ASSERT(table->num_allocated == 64);
+
+  // Duplicates and rehashing work as usual after a reset
+  for (uint32_t i = 0; i < 100; i++) {
+    Tuple tuple = {.key = i, .payload = 7};
+    insert(table, &tuple);
+  }
+
+  for (uint32_t i = 0; i < 64; i++) {
+    Tuple tuple = {.key = i, .payload = i};
+    insert(table, &tuple);
+  }
+
+  TEST_ASSERT(table->size == 164);
+
+  RowIDs *row_ids = search(table, 7);
+  TEST_ASSERT(row_ids->count == 101);
+
+  destroyRowIDs(row_ids);
+  destroyHashTable(table);
+}
+
 TEST_LIST = {{"testComputeKey", testComputeKey},
              {"testInit", testInit},
              {"testInsert", testInsert},
              {"testCollisions", testCollisions},
              {"testRehash", testRehash},
              {"testSearch", testSearch},
+             {"testReset", testReset},
              {NULL, NULL}};
\ No newline at end of file
@@ -0,0 +1,155 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "acutest.h"
+#include "filter.h"
+#include "helpers.h"
+#include "index.h"
+#include "relation.h"
+
+#define NUM_ROWS 10000
+#define MAX_VALUE 1000
+
+void testBuildPointIndex(void) {
+  uint64_t* column = memAlloc(sizeof(uint64_t), NUM_ROWS, false, NULL);
+
+  // Even values only, so that the odd ones can be looked up without being found, and some with their top bit set
+  for (uint32_t i = 0; i < NUM_ROWS; i++) {
+    column[i] = (uint64_t)(rand() % MAX_VALUE) * 2;
+
+    if (i % 5 == 0) {
+      column[i] |= (uint64_t)1 << 63;
+    }
+  }
+
+  PointIndex* index = buildPointIndex(column, NUM_ROWS);
+
+  for (uint32_t i = 0; i < index->num_values; i++) {
+    TEST_ASSERT(i == 0 || index->values[i - 1] < index->values[i]);
+  }
+
+  TEST_ASSERT(index->offsets[index->num_values] == NUM_ROWS);
+
+  for (uint32_t i = 0; i < NUM_ROWS; i++) {
+    const uint32_t* row_ids;
+    uint32_t count = lookupPointIndex(index, column[i], &row_ids);
+
+    // Every row that holds the value must be found, in order
+    uint32_t expected = 0;
+    for (uint32_t row_id = 0; row_id < NUM_ROWS; row_id++) {
+      if (column[row_id] == column[i]) {
+        TEST_ASSERT(expected < count && row_ids[expected] == row_id);
+        expected++;
+      }
+    }
+
+    TEST_ASSERT(count == expected);
+    TEST_ASSERT(lookupPointIndex(index, column[i] + 1, &row_ids) == 0);
+  }
+
+  TEST_ASSERT(lookupPointIndex(index, UINT64_MAX, &(const uint32_t*){NULL}) == 0);
+
+  destroyPointIndex(index);
+
+  // An empty column
+  index = buildPointIndex(column, 0);
+  TEST_ASSERT(index->num_values == 0 && lookupPointIndex(index, column[0], &(const uint32_t*){NULL}) == 0);
+  destroyPointIndex(index);
+
+  free(column);
+}
+
+void testGetPointIndex(void) {
+  Relation* relation = loadRelation("./fixtures/relation");
+
+  // Indexes that don't fit in the budget aren't built
+  setPointIndexBudget(relation->num_tuples);
+  TEST_ASSERT(getPointIndex(relation, 1) == NULL && relation->point_indexes[1] == NULL);
+  TEST_ASSERT(pointIndexMemory() == 0);
+
+  // Otherwise they're built once, and then reused
+  setPointIndexBudget(DEFAULT_POINT_INDEX_BUDGET);
+  PointIndex* index = getPointIndex(relation, 1);
+
+  TEST_ASSERT(index != NULL && getPointIndex(relation, 1) == index);
+  TEST_ASSERT(pointIndexMemory() == index->size);
+
+  const uint32_t* row_ids;
+  TEST_ASSERT(lookupPointIndex(index, 8463, &row_ids) >= 1 && row_ids[0] == 0);
+
+  // The relation gives their memory back to the budget
+  destroyRelation(relation);
+  TEST_ASSERT(pointIndexMemory() == 0);
+}
+
+void testBuildBitmapIndex(void) {
+  uint64_t* columns[2];
+  for (uint32_t c = 0; c < 2; c++) {
+    columns[c] = memAlloc(sizeof(uint64_t), NUM_ROWS, false, NULL);
+  }
+
+  // A column with 10 distinct values, with their top bit set for some rows, and one with 7
+  for (uint32_t i = 0; i < NUM_ROWS; i++) {
+    columns[0][i] = (uint64_t)(rand() % 5) | (uint64_t)(i % 2) << 63;
+    columns[1][i] = (uint64_t)(rand() % 7) * 3;
+  }
+
+  // Columns with too many distinct values aren't indexed
+  TEST_ASSERT(buildBitmapIndex(columns[0], NUM_ROWS, 9) == NULL);
+
+  BitmapIndex* indexes[2] = {buildBitmapIndex(columns[0], NUM_ROWS, 10), buildBitmapIndex(columns[1], NUM_ROWS, 10)};
+  TEST_ASSERT(indexes[0] != NULL && indexes[0]->num_values == 10);
+  TEST_ASSERT(indexes[1] != NULL && indexes[1]->num_values == 7);
+
+  for (uint32_t i = 0; i < NUM_ROWS; i++) {
+    for (uint32_t value = 0; value < indexes[1]->num_values; value++) {
+      bool set = indexes[1]->bitmaps[value * indexes[1]->num_words + i / 64] >> (i % 64) & 1;
+      TEST_ASSERT(set == (columns[1][i] == indexes[1]->values[value]));
+    }
+  }
+
+  // 0 < c0 < 4 and c1 = 6, as well as c1 in [4, 17], must select the same rows as scanning the columns
+  uint32_t* selection = memAlloc(sizeof(uint32_t), NUM_ROWS, false, NULL);
+  uint32_t* expected = memAlloc(sizeof(uint32_t), NUM_ROWS, false, NULL);
+
+  for (uint32_t round = 0; round < 2; round++) {
+    FusedFilter filter;
+    initializeFusedFilter(&filter);
+
+    if (round == 0) {
+      addFilterPredicate(&filter, columns[0], NULL, GT, 0);
+      addFilterPredicate(&filter, columns[0], NULL, LT, 4);
+      addFilterPredicate(&filter, columns[1], NULL, EQ, 6);
+    } else {
+      addFilterPredicate(&filter, columns[1], NULL, GT, 3);
+      addFilterPredicate(&filter, columns[1], NULL, LT, 18);
+    }
+
+    BitmapIndex* filter_indexes[2] = {indexes[round], indexes[1]};
+    uint32_t count = selectRowsByBitmaps(&filter, filter_indexes, NUM_ROWS, selection);
+
+    TEST_ASSERT(count == selectFusedRows(&filter, 0, NUM_ROWS, expected));
+    TEST_ASSERT(memcmp(selection, expected, count * sizeof(uint32_t)) == 0);
+  }
+
+  // A predicate that can't hold selects no rows
+  FusedFilter filter;
+  initializeFusedFilter(&filter);
+  addFilterPredicate(&filter, columns[1], NULL, LT, 0);
+  TEST_ASSERT(selectRowsByBitmaps(&filter, &indexes[1], NUM_ROWS, selection) == 0);
+
+  for (uint32_t c = 0; c < 2; c++) {
+    destroyBitmapIndex(indexes[c]);
+    free(columns[c]);
+  }
+
+  free(selection);
+  free(expected);
+}
+
+TEST_LIST = {{"testBuildPointIndex", testBuildPointIndex},
+             {"testGetPointIndex", testGetPointIndex},
+             {"testBuildBitmapIndex", testBuildBitmapIndex},
+             {NULL, NULL}};
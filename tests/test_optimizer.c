@@ -47,6 +47,15 @@ void testDistinctCount(void) {
     unique_array[i] = 8829;
   }
   TEST_ASSERT(1 == distinctCount(unique_array, 100000));
+
+  // Values that are 2^31 or more apart, so that their differences don't fit in an int, with a single duplicate
+  uint64_t *wide_array = memAlloc(sizeof(uint64_t), 6000, false, NULL);
+  for (uint64_t i = 0; i < 6000; i++) {
+    wide_array[i] = (i * 2654435761u) % 3000000000u;
+  }
+  wide_array[5999] = wide_array[17];
+  TEST_ASSERT(5999 == distinctCount(wide_array, 6000));
+  free(wide_array);
 }
 
 // Tests the gatherStatistics function
@@ -70,10 +79,14 @@ void testGatherStatistics(void) {
   TEST_ASSERT(relation_stats->column_stats[1].distinct == 1365);
   TEST_ASSERT(relation_stats->column_stats[2].distinct == 1431);
 
+  // The first column is sorted and unique, but it skips some values, so it isn't dense
+  TEST_ASSERT(relation->sorted[0] && relation_stats->column_stats[0].unique);
+  TEST_ASSERT(!relation_stats->column_stats[0].dense);
+  TEST_ASSERT(!relation->sorted[1] && !relation_stats->column_stats[1].unique);
+
   free(relation_stats->column_stats);
   free(relation_stats);
-  free(relation->columns);
-  free(relation);
+  destroyRelation(relation);
 }
 
 // Tests the copyStats function
@@ -133,10 +146,7 @@ void testCopyStats(void) {
   destroyStats(data_statistics, num_relations);
 
   for (uint64_t rel = 0; rel < num_relations; rel++) {
-    if (relations[rel] != NULL) {
-      free(relations[rel]->columns);
-      free(relations[rel]);
-    }
+    destroyRelation(relations[rel]);
   }
 }
 
@@ -180,6 +190,13 @@ void testOptimizeQuery(void) {
     // With simple implementation
     optimizeQuery(query, relation_stats, num_relations, false);
 
+    // The join columns that are unique are marked as keys
+    for (uint32_t i = 0; i < query->num_joins; i++) {
+      JoinPredicate *join = &query->joins[i];
+      TEST_ASSERT(join->left_key == relation_stats[join->left.table]->column_stats[join->left.index].unique);
+      TEST_ASSERT(join->right_key == relation_stats[join->right.table]->column_stats[join->right.index].unique);
+    }
+
     // This should be
     if (query_index == 0) {
       TEST_ASSERT(query->joins[0].right.alias == 2);
@@ -217,10 +234,7 @@ void testOptimizeQuery(void) {
 
   destroyStats(relation_stats, num_relations);
   for (uint32_t rel = 0; rel < num_relations; rel++) {
-    if (relations[rel] != NULL) {
-      free(relations[rel]->columns);
-      free(relations[rel]);
-    }
+    destroyRelation(relations[rel]);
   }
 }
 
@@ -301,11 +315,91 @@ void testOptimizeQueryDynamic(void) {
 
   destroyStats(relation_stats, num_relations);
   for (uint32_t rel = 0; rel < num_relations; rel++) {
-    if (relations[rel] != NULL) {
-      free(relations[rel]->columns);
-      free(relations[rel]);
+    destroyRelation(relations[rel]);
+  }
+}
+
+// Tests the estimateSelectivity function
+void testEstimateSelectivity(void) {
+  ColumnStats stats = {.min = 100, .max = 199, .count = 1000, .distinct = 50};
+
+  TEST_ASSERT(estimateSelectivity(&stats, LT, 150) == 0.5);
+  TEST_ASSERT(estimateSelectivity(&stats, GT, 174) == 0.25);
+  TEST_ASSERT(estimateSelectivity(&stats, EQ, 120) == 1.0 / 50);
+
+  // Constants outside of the column's values
+  TEST_ASSERT(estimateSelectivity(&stats, LT, 100) == 0 && estimateSelectivity(&stats, LT, 500) == 1);
+  TEST_ASSERT(estimateSelectivity(&stats, GT, 199) == 0 && estimateSelectivity(&stats, GT, 50) == 1);
+  TEST_ASSERT(estimateSelectivity(&stats, EQ, 99) == 0 && estimateSelectivity(&stats, EQ, (uint64_t)1 << 40) == 0);
+
+  // A key's values are all distinct
+  stats.unique = true;
+  TEST_ASSERT(estimateSelectivity(&stats, EQ, 120) == 1.0 / 1000);
+
+  stats.count = 0;
+  TEST_ASSERT(estimateSelectivity(&stats, LT, 150) == 0);
+}
+
+// Tests the orderFilters function
+void testOrderFilters(void) {
+  // Two relations of 1000 tuples, with two columns of values in [0, 999]
+  RelationStats *relation_stats[2];
+
+  for (uint32_t i = 0; i < 2; i++) {
+    relation_stats[i] = memAlloc(sizeof(RelationStats), 1, false, NULL);
+    relation_stats[i]->count = 2;
+    relation_stats[i]->column_stats = memAlloc(sizeof(ColumnStats), 2, false, NULL);
+
+    for (uint32_t j = 0; j < 2; j++) {
+      relation_stats[i]->column_stats[j] = (ColumnStats){.min = 0, .max = 999, .count = 1000, .distinct = 1000};
     }
   }
+
+  // 0.1<900&0.0>400 keeps about half of the tuples of "0", and 1.1<100&1.0<100 about 10 of the ones of "1"
+  FILE *infp = fopen("./fixtures/filters.txt", "r");
+  assert(infp != NULL);
+
+  Query *query = parseQuery(infp);
+  fclose(infp);
+
+  orderFilters(query, relation_stats);
+
+  // The most selective relation goes first, and then the filters of each relation from the most selective one
+  TEST_ASSERT(query->filters[0].column.alias == 1 && query->filters[1].column.alias == 1);
+  TEST_ASSERT(query->filters[0].selectivity == 0.1 && query->filters[1].selectivity == 0.1);
+  TEST_ASSERT(query->filters[0].column.index == 1);
+
+  TEST_ASSERT(query->filters[2].column.alias == 0 && query->filters[2].column.index == 0);
+  TEST_ASSERT(query->filters[2].operator== GT && query->filters[2].selectivity == 0.599);
+  TEST_ASSERT(query->filters[3].column.index == 1 && query->filters[3].selectivity == 0.9);
+
+  free(query);
+  destroyStats(relation_stats, 2);
+}
+
+void testEstimateJoinCost(void) {
+  // The left column's values span the right one's, so its min is the smaller one while its max is the larger one
+  RelationStats *relation_stats[2];
+  ColumnStats columns[2] = {{.min = 50, .max = 300, .count = 100, .distinct = 100},
+                            {.min = 100, .max = 200, .count = 1000, .distinct = 1000}};
+
+  for (uint32_t i = 0; i < 2; i++) {
+    relation_stats[i] = memAlloc(sizeof(RelationStats), 1, false, NULL);
+    relation_stats[i]->count = 1;
+    relation_stats[i]->column_stats = memAlloc(sizeof(ColumnStats), 1, false, NULL);
+    relation_stats[i]->column_stats[0] = columns[i];
+  }
+
+  // Both columns are narrowed down to [100, 200], over which the 100 * 1000 pairs are spread
+  uint32_t cost = estimateJoinCost(0, 0, 0, 1, 0, 1, relation_stats);
+  TEST_ASSERT(cost == 100 * 1000 / 101);
+
+  for (uint32_t i = 0; i < 2; i++) {
+    TEST_ASSERT(relation_stats[i]->column_stats[0].min == 100 && relation_stats[i]->column_stats[0].max == 200);
+    TEST_ASSERT(relation_stats[i]->column_stats[0].count == cost);
+  }
+
+  destroyStats(relation_stats, 2);
 }
 
 TEST_LIST = {{"testDistinctCount", testDistinctCount},
@@ -313,4 +407,7 @@ TEST_LIST = {{"testDistinctCount", testDistinctCount},
              {"testCopyStats", testCopyStats},
              {"testOptimizeQuery", testOptimizeQuery},
              {"testOptimizeQueryDynamic", testOptimizeQueryDynamic},
+             {"testEstimateSelectivity", testEstimateSelectivity},
+             {"testOrderFilters", testOrderFilters},
+             {"testEstimateJoinCost", testEstimateJoinCost},
              {NULL, NULL}};
\ No newline at end of file
@@ -10,6 +10,7 @@
 #include "phjoin.h"
 #include "relation.h"
 #include "scheduler.h"
+#include "topology.h"
 
 uint32_t l2size;
 
@@ -20,6 +21,8 @@ void _parseRelation(FILE* infp, JoinRelation* target) {
   assert(fscanf(infp, "%" SCNu32 ", [", &target->num_tuples) == 1);
 
   target->tuples = memAlloc(sizeof(Tuple), target->num_tuples, false, NULL);
+  target->wide_payloads = NULL;
+  target->unique = false;
 
   for (uint32_t i = 0; i < target->num_tuples; i++) {
     assert(fscanf(infp, "(%" SCNu32 ", %" SCNu32 ")", &target->tuples[i].key, &target->tuples[i].payload) == 2);
@@ -49,7 +52,7 @@ bool _consumedComment(FILE* infp) {
   return false;
 }
 
-void _testPhjoin(void) {
+void _testPhjoin(JoinStrategy strategy) {
   FILE* infp = fopen("./fixtures/join.txt", "r");
   assert(infp != NULL);
 
@@ -64,7 +67,7 @@ void _testPhjoin(void) {
 
     _parseTestCase(infp, &relation_R, &relation_S, &expected_relation);
 
-    JoinRelation* join_results = phjoin(&relation_R, &relation_S, scheduler);
+    JoinRelation* join_results = phjoinWithStrategy(&relation_R, &relation_S, strategy, scheduler);
     for (uint32_t i = 0; i < join_results->num_tuples; i++) {
       bool found = false;
 
@@ -79,6 +82,8 @@ void _testPhjoin(void) {
       TEST_ASSERT(found == true);
     }
 
+    TEST_ASSERT(join_results->num_tuples == expected_relation.num_tuples);
+
     free(relation_R.tuples);
     free(relation_S.tuples);
     free(expected_relation.tuples);
@@ -92,20 +97,339 @@ void _testPhjoin(void) {
 
 void testPhjoinTwoPasses(void) {
   l2size = 0;
-  _testPhjoin();
+  _testPhjoin(PARTITIONED_HASH_JOIN);
 }
 
 void testPhjoinNoPartitioning(void) {
   l2size = (uint32_t)-1;
-  _testPhjoin();
+  _testPhjoin(PARTITIONED_HASH_JOIN);
 }
 
 void testPhjoinArbitraryL2Size(void) {
   l2size = 1000;
-  _testPhjoin();
+  _testPhjoin(PARTITIONED_HASH_JOIN);
+}
+
+void testPhjoinFusedTwoPasses(void) {
+  l2size = 0;
+  _testPhjoin(FUSED_PARTITIONED_HASH_JOIN);
+}
+
+void testPhjoinFusedArbitraryL2Size(void) {
+  l2size = 1000;
+  _testPhjoin(FUSED_PARTITIONED_HASH_JOIN);
+}
+
+void testPhjoinNestedLoop(void) {
+  _testPhjoin(NESTED_LOOP_JOIN);
+}
+
+void testPhjoinSmallHash(void) {
+  _testPhjoin(SMALL_HASH_JOIN);
+}
+
+JoinRelation* _randomRelation(uint32_t num_tuples, uint32_t max_value) {
+  JoinRelation* relation = memAlloc(sizeof(JoinRelation), 1, false, NULL);
+  relation->num_tuples = num_tuples;
+  relation->tuples = memAlloc(sizeof(Tuple), num_tuples, false, NULL);
+  relation->wide_payloads = NULL;
+  relation->unique = false;
+
+  for (uint32_t i = 0; i < num_tuples; i++) {
+    relation->tuples[i].key = i;
+    relation->tuples[i].payload = (uint32_t)rand() % max_value;
+  }
+
+  return relation;
+}
+
+// Like _randomRelation, but both halves of each value are random, so different values often fold to the same payload.
+JoinRelation* _randomWideRelation(uint32_t num_tuples, uint32_t max_half) {
+  JoinRelation* relation = _randomRelation(num_tuples, 1);
+  relation->wide_payloads = memAlloc(sizeof(uint64_t), num_tuples, false, NULL);
+
+  for (uint32_t i = 0; i < num_tuples; i++) {
+    relation->wide_payloads[i] = ((uint64_t)((uint32_t)rand() % max_half) << 32) | ((uint32_t)rand() % max_half);
+    relation->tuples[i].payload = FOLD_PAYLOAD(relation->wide_payloads[i]);
+  }
+
+  return relation;
+}
+
+// Orders join result tuples by key, and then by payload.
+int _compareTuples(const void* a, const void* b) {
+  const Tuple *tuple_a = a, *tuple_b = b;
+
+  if (tuple_a->key != tuple_b->key) {
+    return tuple_a->key < tuple_b->key ? -1 : 1;
+  }
+
+  return (tuple_a->payload > tuple_b->payload) - (tuple_a->payload < tuple_b->payload);
+}
+
+// Checks that the given strategy produces the same pairs (in any order) as a nested loop for the given relations.
+void _compareWithNestedLoopOn(JoinRelation* relation_R,
+                              JoinRelation* relation_S,
+                              JoinStrategy strategy,
+                              JobScheduler* scheduler) {
+  JoinRelation* expected = phjoinWithStrategy(relation_R, relation_S, NESTED_LOOP_JOIN, scheduler);
+  JoinRelation* join_results = phjoinWithStrategy(relation_R, relation_S, strategy, scheduler);
+
+  TEST_ASSERT(join_results->num_tuples == expected->num_tuples);
+
+  // Both results are sorted, so that they hold the same pairs iff they're equal element by element
+  qsort(expected->tuples, expected->num_tuples, sizeof(Tuple), _compareTuples);
+  qsort(join_results->tuples, join_results->num_tuples, sizeof(Tuple), _compareTuples);
+
+  uint32_t mismatches = 0;
+  for (uint32_t i = 0; i < expected->num_tuples && i < join_results->num_tuples; i++) {
+    mismatches += expected->tuples[i].key != join_results->tuples[i].key ||
+                  expected->tuples[i].payload != join_results->tuples[i].payload;
+  }
+
+  TEST_ASSERT(mismatches == 0);
+
+  destroyJoinRelation(join_results);
+  destroyJoinRelation(expected);
+}
+
+void _compareWithNestedLoop(JoinRelation* relation_R, JoinRelation* relation_S, JoinStrategy strategy) {
+  JobScheduler* scheduler = initializeScheduler(4);
+  _compareWithNestedLoopOn(relation_R, relation_S, strategy, scheduler);
+  destroyScheduler(scheduler);
+}
+
+void _testAgainstNestedLoop(uint32_t num_tuples_R, uint32_t num_tuples_S, uint32_t max_value, JoinStrategy strategy) {
+  JoinRelation* relation_R = _randomRelation(num_tuples_R, max_value);
+  JoinRelation* relation_S = _randomRelation(num_tuples_S, max_value);
+
+  _compareWithNestedLoop(relation_R, relation_S, strategy);
+
+  destroyJoinRelation(relation_R);
+  destroyJoinRelation(relation_S);
+}
+
+void testPhjoinProbeMorsels(void) {
+  l2size = (uint32_t)-1;
+  _testAgainstNestedLoop(2000, 70000, 50000, PARTITIONED_HASH_JOIN);
+}
+
+void testPhjoinFusedLarge(void) {
+  l2size = 4096;
+  _testAgainstNestedLoop(8000, 20000, 20000, FUSED_PARTITIONED_HASH_JOIN);
+
+  l2size = 0;
+  _testAgainstNestedLoop(8000, 20000, 20000, FUSED_PARTITIONED_HASH_JOIN);
+}
+
+void testPhjoinWidePayloads(void) {
+  JoinRelation* relation_R = _randomWideRelation(3000, 64);
+  JoinRelation* relation_S = _randomWideRelation(5000, 64);
+
+  // The nested loop join is the reference, so first make sure it only matches equal values
+  uint32_t expected_count = 0;
+  for (uint32_t i = 0; i < relation_R->num_tuples; i++) {
+    for (uint32_t j = 0; j < relation_S->num_tuples; j++) {
+      expected_count += relation_R->wide_payloads[i] == relation_S->wide_payloads[j];
+    }
+  }
+
+  JoinRelation* expected = phjoinWithStrategy(relation_R, relation_S, NESTED_LOOP_JOIN, NULL);
+  TEST_ASSERT(expected->num_tuples == expected_count);
+  destroyJoinRelation(expected);
+
+  l2size = 4096;
+  _compareWithNestedLoop(relation_R, relation_S, SMALL_HASH_JOIN);
+  _compareWithNestedLoop(relation_R, relation_S, PARTITIONED_HASH_JOIN);
+  _compareWithNestedLoop(relation_R, relation_S, FUSED_PARTITIONED_HASH_JOIN);
+
+  l2size = (uint32_t)-1;
+  _compareWithNestedLoop(relation_R, relation_S, PARTITIONED_HASH_JOIN);
+
+  // Only one side being wide must work too
+  JoinRelation* narrow_S = _randomRelation(5000, 64);
+  l2size = 4096;
+  _compareWithNestedLoop(relation_R, narrow_S, FUSED_PARTITIONED_HASH_JOIN);
+  _compareWithNestedLoop(narrow_S, relation_R, PARTITIONED_HASH_JOIN);
+
+  destroyJoinRelation(narrow_S);
+  destroyJoinRelation(relation_R);
+  destroyJoinRelation(relation_S);
+}
+
+// The partitions are spread over the NUMA nodes of the scheduler's threads, which are simulated here
+void testPhjoinSimulatedNuma(void) {
+  CpuTopology* topology = detectTopology();
+  CpuTopology* simulated_topology = simulateTopology(topology, 2);
+
+  SchedulerOptions options = {.execution_threads = 4,
+                              .backend = WORK_STEALING_SCHEDULER,
+                              .affinity = AFFINITY_SCATTER,
+                              .topology = simulated_topology};
+  JobScheduler* scheduler = initializeSchedulerWithOptions(&options);
+  TEST_ASSERT(scheduler->pool->num_nodes == 2);
+
+  // Large enough for the largest relation to be partitioned by more than one thread (see chooseParallelism)
+  JoinRelation* relation_R = _randomRelation(2000, 20000);
+  JoinRelation* relation_S = _randomRelation(100000, 20000);
+
+  uint32_t l2sizes[] = {4096, 0};
+
+  for (uint32_t i = 0; i < 2; i++) {
+    l2size = l2sizes[i];
+    _compareWithNestedLoopOn(relation_R, relation_S, PARTITIONED_HASH_JOIN, scheduler);
+    _compareWithNestedLoopOn(relation_R, relation_S, FUSED_PARTITIONED_HASH_JOIN, scheduler);
+  }
+
+  destroyJoinRelation(relation_R);
+  destroyJoinRelation(relation_S);
+  destroyScheduler(scheduler);
+  destroyTopology(simulated_topology);
+  destroyTopology(topology);
+}
+
+// A cancelled join must stop early and return an empty result, without affecting the scheduler's other groups.
+void testPhjoinCancellation(void) {
+  JobScheduler* scheduler = initializeScheduler(4);
+
+  JoinRelation* relation_R = _randomRelation(2000, 5000);
+  JoinRelation* relation_S = _randomRelation(100000, 5000);
+
+  uint32_t l2sizes[] = {(uint32_t)-1, 4096, 0};
+  JoinStrategy strategies[] = {PARTITIONED_HASH_JOIN, FUSED_PARTITIONED_HASH_JOIN};
+
+  for (uint32_t i = 0; i < 3; i++) {
+    l2size = l2sizes[i];
+
+    for (uint32_t j = 0; j < 2; j++) {
+      JobScheduler* cancelled_group = createJobGroup(scheduler);
+      cancelJobGroup(cancelled_group);
+
+      JoinRelation* join_results = phjoinWithStrategy(relation_R, relation_S, strategies[j], cancelled_group);
+      TEST_ASSERT(join_results->num_tuples == 0);
+      destroyJoinRelation(join_results);
+      destroyJobGroup(cancelled_group);
+
+      // A deadline that has already passed works the same
+      JobScheduler* late_group = createJobGroup(scheduler);
+      setJobGroupDeadline(late_group, 0);
+
+      join_results = phjoinWithStrategy(relation_R, relation_S, strategies[j], late_group);
+      TEST_ASSERT(join_results->num_tuples == 0);
+      destroyJoinRelation(join_results);
+      destroyJobGroup(late_group);
+
+      _compareWithNestedLoopOn(relation_R, relation_S, strategies[j], scheduler);
+    }
+  }
+
+  destroyJoinRelation(relation_R);
+  destroyJoinRelation(relation_S);
+  destroyScheduler(scheduler);
+}
+
+void testChooseParallelism(void) {
+  TEST_ASSERT(chooseParallelism(0, 8) == 1);
+  TEST_ASSERT(chooseParallelism(MIN_WORK_PER_TASK - 1, 8) == 1);
+  TEST_ASSERT(chooseParallelism(3 * MIN_WORK_PER_TASK, 8) == 3);
+  TEST_ASSERT(chooseParallelism(100 * (uint64_t)MIN_WORK_PER_TASK, 8) == 8);
+  TEST_ASSERT(chooseParallelism(100 * (uint64_t)MIN_WORK_PER_TASK, 0) == 1);
+
+  // Small joins run on a single thread, and large ones engage every thread, whichever way they're partitioned
+  uint32_t l2sizes[] = {(uint32_t)-1, 0};
+
+  for (uint32_t i = 0; i < 2; i++) {
+    l2size = l2sizes[i];
+    _testAgainstNestedLoop(200, 5000, 1000, PARTITIONED_HASH_JOIN);
+    _testAgainstNestedLoop(2000, 200000, 50000, PARTITIONED_HASH_JOIN);
+    _testAgainstNestedLoop(2000, 200000, 50000, FUSED_PARTITIONED_HASH_JOIN);
+  }
+}
+
+// A key whose values are the even numbers from base on, in shuffled order, possibly beyond 32 bits.
+JoinRelation* _denseKeyRelation(uint32_t num_tuples, uint64_t base) {
+  JoinRelation* relation = _randomRelation(num_tuples, 1);
+  relation->unique = true;
+
+  uint64_t* values = memAlloc(sizeof(uint64_t), num_tuples, false, NULL);
+  for (uint32_t i = 0; i < num_tuples; i++) {
+    values[i] = base + 2 * (uint64_t)i;
+  }
+
+  for (uint32_t i = num_tuples - 1; i > 0; i--) {
+    uint32_t j = (uint32_t)rand() % (i + 1);
+    uint64_t value = values[i];
+    values[i] = values[j];
+    values[j] = value;
+  }
+
+  if (base + 2 * (uint64_t)num_tuples > UINT32_MAX) {
+    relation->wide_payloads = values;
+  }
+
+  for (uint32_t i = 0; i < num_tuples; i++) {
+    relation->tuples[i].payload = FOLD_PAYLOAD(values[i]);
+  }
+
+  if (relation->wide_payloads == NULL) {
+    free(values);
+  }
+
+  return relation;
+}
+
+void testPhjoinDenseKey(void) {
+  // Some of the probing values are below or above the key's, and some fall between them
+  JoinRelation* keys = _denseKeyRelation(3000, 1000);
+  JoinRelation* probes = _randomRelation(20000, 8000);
+
+  _compareWithNestedLoop(keys, probes, DENSE_KEY_JOIN);
+  _compareWithNestedLoop(probes, keys, DENSE_KEY_JOIN);
+
+  // Keys beyond 32 bits, probed by values with the same payloads
+  JoinRelation* wide_keys = _denseKeyRelation(3000, (uint64_t)1 << 40);
+  JoinRelation* wide_probes = _randomWideRelation(20000, 1);
+
+  for (uint32_t i = 0; i < wide_probes->num_tuples; i++) {
+    wide_probes->wide_payloads[i] = ((uint64_t)1 << 40) + (uint32_t)rand() % 8000;
+    wide_probes->tuples[i].payload = FOLD_PAYLOAD(wide_probes->wide_payloads[i]);
+  }
+
+  _compareWithNestedLoop(wide_keys, wide_probes, DENSE_KEY_JOIN);
+
+  // A key that was wrongly estimated to be unique, with a value that's repeated, is hashed instead
+  keys->tuples[0].payload = keys->tuples[1].payload;
+  _compareWithNestedLoop(keys, probes, DENSE_KEY_JOIN);
+  _compareWithNestedLoop(probes, keys, DENSE_KEY_JOIN);
+
+  destroyJoinRelation(keys);
+  destroyJoinRelation(probes);
+  destroyJoinRelation(wide_keys);
+  destroyJoinRelation(wide_probes);
+}
+
+void testChooseJoinStrategy(void) {
+  TEST_ASSERT(chooseJoinStrategy(0, 1000000) == NESTED_LOOP_JOIN);
+  TEST_ASSERT(chooseJoinStrategy(16, 16) == NESTED_LOOP_JOIN);
+  TEST_ASSERT(chooseJoinStrategy(500, 20000) == SMALL_HASH_JOIN);
+  TEST_ASSERT(chooseJoinStrategy(20000, 500) == SMALL_HASH_JOIN);
+  TEST_ASSERT(chooseJoinStrategy(5000, 5000) == FUSED_PARTITIONED_HASH_JOIN);
+  TEST_ASSERT(chooseJoinStrategy(100, 1000000) == FUSED_PARTITIONED_HASH_JOIN);
 }
 
 TEST_LIST = {{"testPhjoinTwoPasses", testPhjoinTwoPasses},
              {"testPhjoinNoPartitioning", testPhjoinNoPartitioning},
              {"testPhjoinArbitraryL2Size", testPhjoinArbitraryL2Size},
+             {"testPhjoinFusedTwoPasses", testPhjoinFusedTwoPasses},
+             {"testPhjoinFusedArbitraryL2Size", testPhjoinFusedArbitraryL2Size},
+             {"testPhjoinNestedLoop", testPhjoinNestedLoop},
+             {"testPhjoinSmallHash", testPhjoinSmallHash},
+             {"testPhjoinProbeMorsels", testPhjoinProbeMorsels},
+             {"testPhjoinFusedLarge", testPhjoinFusedLarge},
+             {"testPhjoinWidePayloads", testPhjoinWidePayloads},
+             {"testPhjoinSimulatedNuma", testPhjoinSimulatedNuma},
+             {"testPhjoinCancellation", testPhjoinCancellation},
+             {"testChooseParallelism", testChooseParallelism},
+             {"testChooseJoinStrategy", testChooseJoinStrategy},
+             {"testPhjoinDenseKey", testPhjoinDenseKey},
              {NULL, NULL}};
\ No newline at end of file
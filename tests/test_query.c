@@ -5,6 +5,7 @@
 
 #include "acutest.h"
 #include "helpers.h"
+#include "index.h"
 #include "phjoin.h"
 #include "query.h"
 #include "relation.h"
@@ -42,6 +43,12 @@ Relation *_parseRelation(FILE *infp) {
   assert(fscanf(infp, "%" SCNu64 ", [", &relation->num_columns) == 1);
 
   relation->columns = memAlloc(sizeof(uint64_t *), relation->num_columns, false, NULL);
+  relation->zones = NULL;
+  relation->sorted = NULL;
+  relation->column_copy = NULL;
+  relation->point_indexes = NULL;
+  relation->bitmap_indexes = NULL;
+
   for (uint64_t i = 0; i < relation->num_columns; i++) {
     relation->columns[i] = memAlloc(sizeof(uint64_t *), relation->num_tuples, false, NULL);
 
@@ -106,26 +113,33 @@ void testBuildJoinRelation(void) {
   fclose(infp);
 
   // Case 1: relation isn't in intermediate results
-  RowIDs **filter_inters = memAlloc(sizeof(RowIDs *), 1, true, NULL);
-  RowIDs **join_inters = memAlloc(sizeof(RowIDs *), 1, true, NULL);
-
-  JoinRelation *join_rel = buildJoinRelation(join_inters[0], filter_inters[0], relation, 0);
+  JoinRelation *join_rel = buildJoinRelation(NULL, 0, relation, 0);
 
   TEST_ASSERT(join_rel->num_tuples == 3);
   TEST_ASSERT(join_rel->tuples[0].key == 0 && join_rel->tuples[0].payload == 19);
   TEST_ASSERT(join_rel->tuples[1].key == 1 && join_rel->tuples[1].payload == 44444);
   TEST_ASSERT(join_rel->tuples[2].key == 2 && join_rel->tuples[2].payload == 30001);
+  TEST_ASSERT(join_rel->wide_payloads == NULL);
 
   destroyJoinRelation(join_rel);
 
-  // Case 2: some IDs of relation exist in intermediate results
-  filter_inters[0] = memAlloc(sizeof(RowIDs), 1, false, NULL);
-  filter_inters[0]->capacity = filter_inters[0]->count = 2;
-  filter_inters[0]->ids = memAlloc(sizeof(uint32_t), 2, false, NULL);
-  filter_inters[0]->ids[0] = 2;
-  filter_inters[0]->ids[1] = 1;
+  // Values that don't fit in 32 bits are folded into the payloads and kept in full in the wide payloads
+  uint64_t wide_value = ((uint64_t)7 << 32) | 19;
+  relation->columns[1][1] = wide_value;
+
+  join_rel = buildJoinRelation(NULL, 0, relation, 1);
 
-  join_rel = buildJoinRelation(join_inters[0], filter_inters[0], relation, 0);
+  TEST_ASSERT(join_rel->wide_payloads != NULL);
+  TEST_ASSERT(join_rel->tuples[1].payload == FOLD_PAYLOAD(wide_value));
+  TEST_ASSERT(join_rel->wide_payloads[0] == relation->columns[1][0]);
+  TEST_ASSERT(join_rel->wide_payloads[1] == wide_value);
+  TEST_ASSERT(join_rel->wide_payloads[2] == relation->columns[1][2]);
+
+  destroyJoinRelation(join_rel);
+
+  // Case 2: some IDs of relation exist in intermediate results
+  uint32_t filtered_row_ids[] = {2, 1};
+  join_rel = buildJoinRelation(filtered_row_ids, 2, relation, 0);
 
   TEST_ASSERT(join_rel->num_tuples == 2);
   TEST_ASSERT(join_rel->tuples[0].key == 0 && join_rel->tuples[0].payload == 30001);
@@ -133,22 +147,14 @@ void testBuildJoinRelation(void) {
 
   destroyJoinRelation(join_rel);
 
-  join_inters[0] = memAlloc(sizeof(RowIDs), 1, false, NULL);
-  join_inters[0]->capacity = join_inters[0]->count = 2;
-  join_inters[0]->ids = memAlloc(sizeof(uint32_t), 2, false, NULL);
-  join_inters[0]->ids[0] = 0;
-  join_inters[0]->ids[1] = 1;
-
-  join_rel = buildJoinRelation(join_inters[0], filter_inters[0], relation, 3);
+  uint32_t joined_row_ids[] = {0, 1};
+  join_rel = buildJoinRelation(joined_row_ids, 2, relation, 3);
   TEST_ASSERT(join_rel->num_tuples == 2);
   TEST_ASSERT(join_rel->tuples[0].key == 0 && join_rel->tuples[0].payload == 45);
   TEST_ASSERT(join_rel->tuples[1].key == 1 && join_rel->tuples[1].payload == 34);
 
   destroyJoinRelation(join_rel);
 
-  destroyInters(filter_inters, 1);
-  destroyInters(join_inters, 1);
-
   for (uint64_t column = 0; column < relation->num_columns; column++) {
     free(relation->columns[column]);
   }
@@ -156,6 +162,171 @@ void testBuildJoinRelation(void) {
   free(relation);
 }
 
+void testIntermediate(void) {
+  Intermediate *inter = createIntermediate(3, POW2(0) | POW2(2), 4);
+
+  TEST_ASSERT(inter->num_rows == 4 && inter->num_aliases == 3);
+  TEST_ASSERT(inter->columns[0] != NULL && inter->columns[1] == NULL && inter->columns[2] != NULL);
+  TEST_ASSERT(inter->columns[2] == inter->columns[0] + 4);
+
+  // The positions of the rows are either gathered through the row IDs of a previous result, or taken as they are
+  uint32_t source[] = {10, 11, 12, 13, 14};
+  uint32_t positions[] = {4, 0, 0, 2};
+
+  gatherRowIDs(inter->columns[0], source, positions, 4);
+  gatherRowIDs(inter->columns[2], NULL, positions, 4);
+
+  for (uint32_t i = 0; i < 4; i++) {
+    TEST_ASSERT(inter->columns[0][i] == source[positions[i]]);
+    TEST_ASSERT(inter->columns[2][i] == positions[i]);
+  }
+
+  // The join results hold the positions of the left side's rows in their keys and those of the right side's in their
+  // payloads
+  Tuple tuples[] = {{.key = 1, .payload = 3}, {.key = 4, .payload = 0}, {.key = 2, .payload = 2}};
+
+  gatherJoinedRowIDs(inter->columns[0], source, tuples, 3, false);
+  gatherJoinedRowIDs(inter->columns[2], source, tuples, 3, true);
+
+  for (uint32_t i = 0; i < 3; i++) {
+    TEST_ASSERT(inter->columns[0][i] == source[tuples[i].key]);
+    TEST_ASSERT(inter->columns[2][i] == source[tuples[i].payload]);
+  }
+
+  gatherJoinedRowIDs(inter->columns[0], NULL, tuples, 3, false);
+  gatherJoinedRowIDs(inter->columns[2], NULL, tuples, 3, true);
+
+  for (uint32_t i = 0; i < 3; i++) {
+    TEST_ASSERT(inter->columns[0][i] == tuples[i].key);
+    TEST_ASSERT(inter->columns[2][i] == tuples[i].payload);
+  }
+
+  destroyIntermediate(inter);
+
+  // An intermediate without rows still has its columns
+  inter = createIntermediate(2, POW2(1), 0);
+  TEST_ASSERT(inter->num_rows == 0 && inter->columns[0] == NULL && inter->columns[1] != NULL);
+  destroyIntermediate(inter);
+}
+
+void testApplyFilters(void) {
+  // A relation of 3 columns, whose i-th row holds i % 100, i % 7 and i
+  Relation *relation = memAlloc(sizeof(Relation), 1, false, NULL);
+  relation->num_tuples = 4 * FILTER_MORSEL_SIZE + 1000;  // So that the filters are split into morsels
+  relation->num_columns = 3;
+  relation->columns = memAlloc(sizeof(uint64_t *), 3, false, NULL);
+
+  for (uint32_t column = 0; column < 3; column++) {
+    relation->columns[column] = memAlloc(sizeof(uint64_t), relation->num_tuples, false, NULL);
+  }
+
+  for (uint32_t i = 0; i < relation->num_tuples; i++) {
+    relation->columns[0][i] = i % 100;
+    relation->columns[1][i] = i % 7;
+    relation->columns[2][i] = i;
+  }
+
+  // The last column is sorted, so its zone map lets 0.2>5000 skip the first zones. Its filters are then answered by
+  // binary search, which is left for the last round, so that the other ways to evaluate them are tested first.
+  relation->column_copy = NULL;
+  buildZoneMaps(relation);
+
+  TEST_ASSERT(relation->sorted[2] && !relation->sorted[0] && !relation->sorted[1]);
+  relation->sorted[2] = false;
+
+  // Without point indexes, so that the equality filter is evaluated by scanning its column, until the last round
+  relation->point_indexes = NULL;
+  relation->bitmap_indexes = NULL;
+
+  JobScheduler *scheduler = initializeScheduler(4);
+
+  // 0.0>10&0.1=3&0.0<13&0.2>5000, i.e. i % 100 in [11, 12], i % 7 == 3 and i > 5000
+  Query *query = memAlloc(sizeof(Query), 1, true, NULL);
+  query->num_relations = 1;
+  query->num_filters = 4;
+
+  uint32_t indices[] = {0, 1, 0, 2};
+  Operator operators[] = {GT, EQ, LT, GT};
+  uint64_t values[] = {10, 3, 13, 5000};
+
+  for (uint32_t i = 0; i < 4; i++) {
+    query->filters[i].column = (Column){.table = 0, .alias = 0, .index = indices[i]};
+    query->filters[i].operator= operators[i];
+    query->filters[i].value = values[i];
+    query->filters[i].selectivity = 1;
+  }
+
+  // Once with all the columns read in a single pass, once with the rest gathered for the rows that pass the first
+  // filter, and once looking the rows of 0.1=3 up in its column's point index, all of which must give the same rows.
+  // Then, without 0.2>5000, once combining the bitmap indexes of the first two columns, and, with it, once binary
+  // searching the last column for the rows of 0.2>5000.
+  for (uint32_t round = 0; round < 5; round++) {
+    query->filters[0].selectivity = round == 1 ? 0.02 : 1;
+
+    if (round == 2) {
+      relation->point_indexes = memAlloc(sizeof(*relation->point_indexes), 3, true, NULL);
+    }
+
+    if (round == 3) {
+      buildBitmapIndexes(relation, 100);
+      TEST_ASSERT(relation->bitmap_indexes[1] != NULL && relation->bitmap_indexes[2] == NULL);
+      query->num_filters = 3;
+    }
+
+    if (round == 4) {
+      relation->sorted[2] = true;
+      query->num_filters = 4;
+    }
+
+    RowIDs **filter_inters = memAlloc(sizeof(RowIDs *), 1, true, NULL);
+    bool empty_result = false;
+
+    filter_inters = applyFilters(&relation, filter_inters, query, &empty_result, scheduler);
+    TEST_ASSERT(!empty_result);
+
+    uint32_t expected = 0;
+    for (uint32_t i = 0; i < relation->num_tuples; i++) {
+      if (i % 100 >= 11 && i % 100 <= 12 && i % 7 == 3 && (i > 5000 || query->num_filters == 3)) {
+        TEST_ASSERT(expected < filter_inters[0]->count && filter_inters[0]->ids[expected] == i);
+        expected++;
+      }
+    }
+
+    TEST_ASSERT(filter_inters[0]->count == expected && expected > 0);
+    destroyInters(filter_inters, 1);
+  }
+
+  TEST_ASSERT(relation->point_indexes[1] != NULL && relation->point_indexes[0] == NULL);
+
+  // Contradicting filters give an empty result
+  query->filters[2].value = 11;
+
+  RowIDs **filter_inters = memAlloc(sizeof(RowIDs *), 1, true, NULL);
+  bool empty_result = false;
+
+  filter_inters = applyFilters(&relation, filter_inters, query, &empty_result, scheduler);
+  TEST_ASSERT(empty_result);
+  destroyInters(filter_inters, 1);
+
+  // So does cancelling the query
+  query->filters[2].value = 13;
+  cancelJobGroup(scheduler);
+
+  filter_inters = memAlloc(sizeof(RowIDs *), 1, true, NULL);
+  empty_result = false;
+
+  filter_inters = applyFilters(&relation, filter_inters, query, &empty_result, scheduler);
+  TEST_ASSERT(empty_result);
+  destroyInters(filter_inters, 1);
+
+  destroyScheduler(scheduler);
+  free(query);
+  for (uint32_t column = 0; column < 3; column++) {
+    free(relation->columns[column]);
+  }
+  destroyRelation(relation);
+}
+
 void testSigmodHarness(void) {
   l2size = getL2CacheSize();
 
@@ -196,22 +367,22 @@ void testSigmodHarness(void) {
       Query *query = parseQuery(infp);
 
       RowIDs **filter_inters = memAlloc(sizeof(RowIDs *), query->num_relations, true, NULL);
-      RowIDs **join_inters = memAlloc(sizeof(RowIDs *), query->num_relations, true, NULL);
+      Intermediate *join_inter = NULL;
 
       bool empty_result = false;
 
-      filter_inters = applyFilters(relations, filter_inters, query, &empty_result);
+      filter_inters = applyFilters(relations, filter_inters, query, &empty_result, scheduler);
       if (empty_result == false) {
-        join_inters = applyJoins(relations, join_inters, filter_inters, query, &empty_result, scheduler);
+        join_inter = applyJoins(relations, filter_inters, query, &empty_result, scheduler);
       }
 
-      uint64_t *checksums = calculateChecksums(join_inters, relations, query, empty_result);
+      uint64_t *checksums = calculateChecksums(join_inter, relations, query, empty_result);
 
       printChecksums(outfp, checksums, query->num_projections);
 
       free(checksums);
 
-      destroyInters(join_inters, query->num_relations);
+      destroyIntermediate(join_inter);
       destroyInters(filter_inters, query->num_relations);
       free(query);
     }
@@ -226,14 +397,13 @@ void testSigmodHarness(void) {
   assert((remove("checksums.txt")) != -1);
 
   for (uint32_t rel = 0; rel < NUM_RELATIONS; rel++) {
-    if (relations[rel] != NULL) {
-      free(relations[rel]->columns);
-      free(relations[rel]);
-    }
+    destroyRelation(relations[rel]);
   }
 }
 
 TEST_LIST = {{"testQueryParsing", testQueryParsing},
              {"testBuildJoinRelation", testBuildJoinRelation},
+             {"testIntermediate", testIntermediate},
+             {"testApplyFilters", testApplyFilters},
              {"testSigmodHarness", testSigmodHarness},
              {NULL, NULL}};
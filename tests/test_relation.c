@@ -21,8 +21,29 @@ void testLoadRelation(void) {
   TEST_ASSERT(*(relation->columns[2] + 1) == 6962);
   TEST_ASSERT(*(relation->columns[0] + 2) == 7);
 
-  free(relation->columns);
-  free(relation);
+  destroyRelation(relation);
 }
 
-TEST_LIST = {{"testLoadRelation", testLoadRelation}, {NULL, NULL}};
+// Tests whether the zone maps hold the min and max of every block of each column.
+void testBuildZoneMaps(void) {
+  Relation *relation = loadRelation("./fixtures/relation");
+
+  TEST_ASSERT(relation->zones != NULL);
+
+  for (uint64_t col = 0; col < relation->num_columns; col++) {
+    for (uint64_t zone = 0; zone * ZONE_SIZE < relation->num_tuples; zone++) {
+      uint64_t min = UINT64_MAX, max = 0;
+
+      for (uint64_t i = zone * ZONE_SIZE; i < relation->num_tuples && i < (zone + 1) * ZONE_SIZE; i++) {
+        min = relation->columns[col][i] < min ? relation->columns[col][i] : min;
+        max = relation->columns[col][i] > max ? relation->columns[col][i] : max;
+      }
+
+      TEST_ASSERT(relation->zones[col][zone].min == min && relation->zones[col][zone].max == max);
+    }
+  }
+
+  destroyRelation(relation);
+}
+
+TEST_LIST = {{"testLoadRelation", testLoadRelation}, {"testBuildZoneMaps", testBuildZoneMaps}, {NULL, NULL}};
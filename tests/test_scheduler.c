@@ -0,0 +1,599 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "acutest.h"
+#include "helpers.h"
+#include "scheduler.h"
+
+#define NUM_JOBS 5000
+#define NUM_CLIENTS 4
+
+typedef struct mark_job_args {
+  int64_t* slot;
+} MarkJobArgs;
+
+// Records which worker ran the job, offset by one so that unmarked slots stay zero
+static void markJob(void* args_) {
+  MarkJobArgs* args = args_;
+  *(args->slot) = currentWorkerId() + 1;
+}
+
+// Submits NUM_JOBS jobs through the given group, each of which marks its own slot.
+void _submitMarkJobs(JobScheduler* scheduler, int64_t* slots) {
+  for (uint32_t i = 0; i < NUM_JOBS; i++) {
+    // The kind only determines how the job is called, which is the same for all kinds
+    JobInfo* job_info = createJob(scheduler, markJob, sizeof(MarkJobArgs), HISTOGRAM_JOB);
+    MarkJobArgs* args = job_info->args;
+    args->slot = &slots[i];
+
+    submitJob(scheduler, job_info);
+  }
+
+  executeAllJobs(scheduler);
+}
+
+typedef struct spawn_job_args {
+  JobScheduler* scheduler;
+  int64_t* slots;
+} SpawnJobArgs;
+
+// Submits the mark jobs from one of the scheduler's own threads
+static void spawnJob(void* args_) {
+  SpawnJobArgs* args = args_;
+  _submitMarkJobs(args->scheduler, args->slots);
+}
+
+// The number of waiting jobs that are running on the current thread, and whether one ever ran within another one
+static _Thread_local uint32_t running_waiting_jobs = 0;
+static atomic_bool nested_waiting_jobs = false;
+
+// Like a query job: submits the mark jobs through a group of its own and waits for them
+static void waitingJob(void* args_) {
+  SpawnJobArgs* args = args_;
+
+  if (++running_waiting_jobs > 1) {
+    atomic_store(&nested_waiting_jobs, true);
+  }
+
+  JobScheduler* group = createJobGroup(args->scheduler);
+  _submitMarkJobs(group, args->slots);
+  waitAllJobs(group);
+  destroyJobGroup(group);
+
+  running_waiting_jobs--;
+}
+
+typedef struct check_job_args {
+  int64_t* slots;
+  uint32_t num_slots;
+  bool* all_marked;
+} CheckJobArgs;
+
+// Records whether the given slots had all been marked when the job ran
+static void checkJob(void* args_) {
+  CheckJobArgs* args = args_;
+  *(args->all_marked) = true;
+
+  for (uint32_t i = 0; i < args->num_slots; i++) {
+    *(args->all_marked) = *(args->all_marked) && args->slots[i] != 0;
+  }
+}
+
+// Checks that every slot was marked by one of the scheduler's threads.
+bool _allMarked(int64_t* slots, uint64_t execution_threads) {
+  for (uint32_t i = 0; i < NUM_JOBS; i++) {
+    if (slots[i] < 1 || slots[i] > (int64_t)execution_threads) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+JobScheduler* _initializeScheduler(uint64_t execution_threads, SchedulerBackend backend) {
+  SchedulerOptions options = {.execution_threads = execution_threads, .backend = backend};
+  return initializeSchedulerWithOptions(&options);
+}
+
+void _testSingleGroup(SchedulerBackend backend) {
+  JobScheduler* scheduler = _initializeScheduler(4, backend);
+  int64_t* slots = memAlloc(sizeof(int64_t), NUM_JOBS, true, NULL);
+
+  // The scheduler must be reusable after waiting
+  for (uint32_t round = 0; round < 3; round++) {
+    _submitMarkJobs(scheduler, slots);
+    waitAllJobs(scheduler);
+
+    TEST_ASSERT(_allMarked(slots, 4));
+    memset(slots, 0, NUM_JOBS * sizeof(int64_t));
+  }
+
+  TEST_ASSERT(currentWorkerId() == -1);
+
+  free(slots);
+  destroyScheduler(scheduler);
+}
+
+void _testSeparateGroups(SchedulerBackend backend) {
+  JobScheduler* scheduler = _initializeScheduler(2, backend);
+  JobScheduler* group = createJobGroup(scheduler);
+
+  int64_t* slots = memAlloc(sizeof(int64_t), NUM_JOBS, true, NULL);
+  int64_t* group_slots = memAlloc(sizeof(int64_t), NUM_JOBS, true, NULL);
+
+  _submitMarkJobs(scheduler, slots);
+  _submitMarkJobs(group, group_slots);
+
+  // Each wait only covers its own group's jobs, but must not return before all of them have run
+  waitAllJobs(group);
+  TEST_ASSERT(_allMarked(group_slots, 2));
+
+  waitAllJobs(scheduler);
+  TEST_ASSERT(_allMarked(slots, 2));
+
+  free(slots);
+  free(group_slots);
+  destroyJobGroup(group);
+  destroyScheduler(scheduler);
+}
+
+static void* clientThread(void* scheduler) {
+  int64_t* slots = memAlloc(sizeof(int64_t), NUM_JOBS, true, NULL);
+  bool* success = memAlloc(sizeof(bool), 1, false, NULL);
+
+  JobScheduler* group = createJobGroup(scheduler);
+
+  _submitMarkJobs(group, slots);
+  waitAllJobs(group);
+
+  *success = _allMarked(slots, group->execution_threads);
+
+  destroyJobGroup(group);
+  free(slots);
+
+  return success;
+}
+
+void _testConcurrentGroups(SchedulerBackend backend) {
+  JobScheduler* scheduler = _initializeScheduler(3, backend);
+  pthread_t clients[NUM_CLIENTS];
+
+  for (uint32_t i = 0; i < NUM_CLIENTS; i++) {
+    pthread_create(&clients[i], NULL, clientThread, scheduler);
+  }
+
+  for (uint32_t i = 0; i < NUM_CLIENTS; i++) {
+    bool* success;
+    pthread_join(clients[i], (void**)&success);
+
+    TEST_ASSERT(*success);
+    free(success);
+  }
+
+  destroyScheduler(scheduler);
+}
+
+// Jobs submitted by a job must be waited for as well, whether they're queued or pushed to a thread's own deque.
+void _testNestedJobs(SchedulerBackend backend) {
+  JobScheduler* scheduler = _initializeScheduler(4, backend);
+  int64_t* slots = memAlloc(sizeof(int64_t), NUM_JOBS, true, NULL);
+
+  JobInfo* job_info = createJob(scheduler, spawnJob, sizeof(SpawnJobArgs), HISTOGRAM_JOB);
+  SpawnJobArgs* args = job_info->args;
+  args->scheduler = scheduler;
+  args->slots = slots;
+
+  submitJob(scheduler, job_info);
+  executeAllJobs(scheduler);
+  waitAllJobs(scheduler);
+
+  TEST_ASSERT(_allMarked(slots, 4));
+
+  free(slots);
+  destroyScheduler(scheduler);
+}
+
+// Jobs that wait for jobs must not deadlock, even if there are more of them than threads. The threads that wait help
+// with other jobs, but never start another query while they're at it.
+void _testWaitingJobs(SchedulerBackend backend, uint64_t execution_threads) {
+  JobScheduler* scheduler = _initializeScheduler(execution_threads, backend);
+  int64_t* slots[NUM_CLIENTS];
+  atomic_store(&nested_waiting_jobs, false);
+
+  for (uint32_t i = 0; i < NUM_CLIENTS; i++) {
+    slots[i] = memAlloc(sizeof(int64_t), NUM_JOBS, true, NULL);
+
+    JobInfo* job_info = createJob(scheduler, waitingJob, sizeof(SpawnJobArgs), QUERY_JOB);
+    SpawnJobArgs* args = job_info->args;
+    args->scheduler = scheduler;
+    args->slots = slots[i];
+
+    submitJob(scheduler, job_info);
+  }
+
+  executeAllJobs(scheduler);
+  waitAllJobs(scheduler);
+
+  for (uint32_t i = 0; i < NUM_CLIENTS; i++) {
+    TEST_ASSERT(_allMarked(slots[i], execution_threads));
+    free(slots[i]);
+  }
+
+  TEST_ASSERT(!atomic_load(&nested_waiting_jobs));
+
+  destroyScheduler(scheduler);
+}
+
+// Jobs must only start after all of their predecessors have completed.
+void _testDependencies(SchedulerBackend backend) {
+  JobScheduler* scheduler = _initializeScheduler(4, backend);
+
+  uint32_t num_marks = 64, num_checks = 16;
+  int64_t* slots = memAlloc(sizeof(int64_t), num_marks, true, NULL);
+  bool* all_marked = memAlloc(sizeof(bool), num_checks, true, NULL);
+
+  JobInfo** mark_jobs = memAlloc(sizeof(JobInfo*), num_marks, false, NULL);
+  JobInfo** check_jobs = memAlloc(sizeof(JobInfo*), num_checks, false, NULL);
+
+  for (uint32_t i = 0; i < num_checks; i++) {
+    check_jobs[i] = createJob(scheduler, checkJob, sizeof(CheckJobArgs), HISTOGRAM_JOB);
+
+    CheckJobArgs* args = check_jobs[i]->args;
+    args->slots = slots;
+    args->num_slots = num_marks;
+    args->all_marked = &all_marked[i];
+  }
+
+  for (uint32_t i = 0; i < num_marks; i++) {
+    mark_jobs[i] = createJob(scheduler, markJob, sizeof(MarkJobArgs), HISTOGRAM_JOB);
+
+    MarkJobArgs* args = mark_jobs[i]->args;
+    args->slot = &slots[i];
+
+    for (uint32_t j = 0; j < num_checks; j++) {
+      addDependency(mark_jobs[i], check_jobs[j]);
+    }
+  }
+
+  // Submit the dependent jobs first, so that they'd run early if they weren't held back
+  for (uint32_t i = 0; i < num_checks; i++) {
+    submitJob(scheduler, check_jobs[i]);
+  }
+
+  for (uint32_t i = 0; i < num_marks; i++) {
+    submitJob(scheduler, mark_jobs[i]);
+  }
+
+  executeAllJobs(scheduler);
+  waitAllJobs(scheduler);
+
+  for (uint32_t i = 0; i < num_checks; i++) {
+    TEST_ASSERT(all_marked[i]);
+  }
+
+  free(slots);
+  free(all_marked);
+  free(mark_jobs);
+  free(check_jobs);
+  destroyScheduler(scheduler);
+}
+
+typedef struct cancellable_job_args {
+  JobScheduler* group;
+  int64_t* slot;
+} CancellableJobArgs;
+
+// Cancels its group, like a query job that finds out its result is empty
+static void cancelJob(void* args_) {
+  CancellableJobArgs* args = args_;
+  cancelJobGroup(args->group);
+}
+
+// Only marks its slot if its group hasn't been cancelled
+static void cancellableMarkJob(void* args_) {
+  CancellableJobArgs* args = args_;
+
+  if (!isCancelled(&args->group->cancellation)) {
+    *(args->slot) = 1;
+  }
+}
+
+// Jobs of a cancelled group must see the cancellation, and still complete, without affecting other groups.
+void _testCancellation(SchedulerBackend backend) {
+  JobScheduler* scheduler = _initializeScheduler(4, backend);
+  JobScheduler* cancelled_group = createJobGroup(scheduler);
+  JobScheduler* group = createJobGroup(scheduler);
+
+  int64_t* slots = memAlloc(sizeof(int64_t), NUM_JOBS, true, NULL);
+  int64_t* group_slots = memAlloc(sizeof(int64_t), NUM_JOBS, true, NULL);
+
+  // All the marking jobs wait for the one that cancels their group
+  JobInfo* cancel_job = createJob(cancelled_group, cancelJob, sizeof(CancellableJobArgs), HISTOGRAM_JOB);
+  ((CancellableJobArgs*)cancel_job->args)->group = cancelled_group;
+
+  for (uint32_t i = 0; i < NUM_JOBS; i++) {
+    JobInfo* job_info = createJob(cancelled_group, cancellableMarkJob, sizeof(CancellableJobArgs), HISTOGRAM_JOB);
+    CancellableJobArgs* args = job_info->args;
+    args->group = cancelled_group;
+    args->slot = &slots[i];
+
+    addDependency(cancel_job, job_info);
+    submitJob(cancelled_group, job_info);
+
+    job_info = createJob(group, cancellableMarkJob, sizeof(CancellableJobArgs), HISTOGRAM_JOB);
+    args = job_info->args;
+    args->group = group;
+    args->slot = &group_slots[i];
+
+    submitJob(group, job_info);
+  }
+
+  submitJob(cancelled_group, cancel_job);
+  executeAllJobs(scheduler);
+  waitAllJobs(cancelled_group);
+  waitAllJobs(group);
+
+  for (uint32_t i = 0; i < NUM_JOBS; i++) {
+    TEST_ASSERT(slots[i] == 0 && group_slots[i] == 1);
+  }
+
+  TEST_ASSERT(isCancelled(&cancelled_group->cancellation));
+  TEST_ASSERT(!isCancelled(&group->cancellation));
+  TEST_ASSERT(!isCancelled(NULL));
+
+  // Deadlines cancel the group on their own, once they pass
+  setJobGroupDeadline(group, 3600 * (uint64_t)1000000000);
+  TEST_ASSERT(!isCancelled(&group->cancellation));
+
+  setJobGroupDeadline(group, 0);
+  TEST_ASSERT(isCancelled(&group->cancellation));
+
+  free(slots);
+  free(group_slots);
+  destroyJobGroup(cancelled_group);
+  destroyJobGroup(group);
+  destroyScheduler(scheduler);
+}
+
+// Completed jobs must be reused by their group, instead of allocating new ones for every round.
+void _testJobRecycling(SchedulerBackend backend) {
+  JobScheduler* scheduler = _initializeScheduler(3, backend);
+  int64_t* slots = memAlloc(sizeof(int64_t), NUM_JOBS, true, NULL);
+
+  for (uint32_t round = 0; round < 3; round++) {
+    memset(slots, 0, NUM_JOBS * sizeof(int64_t));
+
+    // Hold the jobs back until they've all been created, so that every round needs the same number of jobs at once
+    bool all_marked = false;
+    JobInfo* gate_job = createJob(scheduler, checkJob, sizeof(CheckJobArgs), HISTOGRAM_JOB);
+
+    CheckJobArgs* gate_args = gate_job->args;
+    gate_args->slots = slots;
+    gate_args->num_slots = 0;
+    gate_args->all_marked = &all_marked;
+
+    for (uint32_t i = 0; i < NUM_JOBS; i++) {
+      JobInfo* job_info = createJob(scheduler, markJob, sizeof(MarkJobArgs), HISTOGRAM_JOB);
+      MarkJobArgs* args = job_info->args;
+      args->slot = &slots[i];
+
+      addDependency(gate_job, job_info);
+      submitJob(scheduler, job_info);
+    }
+
+    submitJob(scheduler, gate_job);
+    executeAllJobs(scheduler);
+    waitAllJobs(scheduler);
+
+    TEST_ASSERT(_allMarked(slots, 3));
+    TEST_ASSERT(scheduler->job_slab.num_slabs == (NUM_JOBS + 1 + JOBS_PER_SLAB - 1) / JOBS_PER_SLAB);
+  }
+
+  free(slots);
+  destroyScheduler(scheduler);
+}
+
+// Jobs meant for the NUMA nodes of the pool must all run, wherever they're submitted from.
+void _testNodeJobs(SchedulerBackend backend) {
+  // Two nodes of two CPUs each (the threads can't be pinned to CPUs that don't exist, but they still serve a node)
+  CpuInfo cpus[4] = {{.cpu = 0, .node = 0, .core = 0},
+                     {.cpu = 1, .node = 0, .core = 1},
+                     {.cpu = 2, .node = 1, .core = 0, .package = 1},
+                     {.cpu = 3, .node = 1, .core = 1, .package = 1}};
+  uint32_t node_ids[2] = {0, 1};
+  CpuTopology topology = {.num_cpus = 4, .num_physical_cores = 4, .num_nodes = 2, .node_ids = node_ids, .cpus = cpus};
+
+  SchedulerOptions options = {
+      .execution_threads = 4, .backend = backend, .affinity = AFFINITY_SCATTER, .topology = &topology};
+  JobScheduler* scheduler = initializeSchedulerWithOptions(&options);
+  TEST_ASSERT(scheduler->pool->num_nodes == 2);
+
+  int64_t* slots = memAlloc(sizeof(int64_t), NUM_JOBS, true, NULL);
+
+  for (uint32_t i = 0; i < NUM_JOBS; i++) {
+    JobInfo* job_info = createJob(scheduler, markJob, sizeof(MarkJobArgs), HISTOGRAM_JOB);
+    MarkJobArgs* args = job_info->args;
+    args->slot = &slots[i];
+
+    // Leave some of the jobs to any node
+    if (i % 3 != 0) {
+      setJobNode(job_info, i);
+    }
+
+    submitJob(scheduler, job_info);
+  }
+
+  executeAllJobs(scheduler);
+  waitAllJobs(scheduler);
+
+  TEST_ASSERT(_allMarked(slots, 4));
+
+  // Jobs submitted by the pool's own threads go either to their deques or to the queues of the other node
+  memset(slots, 0, NUM_JOBS * sizeof(int64_t));
+
+  JobInfo* job_info = createJob(scheduler, waitingJob, sizeof(SpawnJobArgs), QUERY_JOB);
+  SpawnJobArgs* args = job_info->args;
+  args->scheduler = scheduler;
+  args->slots = slots;
+
+  setJobNode(job_info, 1);
+  submitJob(scheduler, job_info);
+  executeAllJobs(scheduler);
+  waitAllJobs(scheduler);
+
+  TEST_ASSERT(_allMarked(slots, 4));
+
+  free(slots);
+  destroyScheduler(scheduler);
+
+  // Two threads packed onto the first node leave the second one without any, so the pool only serves the first one
+  options.execution_threads = 2;
+  options.affinity = AFFINITY_COMPACT;
+  scheduler = initializeSchedulerWithOptions(&options);
+  TEST_ASSERT(scheduler->pool->num_nodes == 1 && scheduler->pool->node_jobs == NULL);
+  TEST_ASSERT(scheduler->pool->topology->num_nodes == 1);
+  destroyScheduler(scheduler);
+}
+
+// Threads that spin before sleeping must still pick up every job, whether they're still spinning when the jobs are
+// submitted or have gone to sleep by then (as they do right away with the shortest spin time).
+void _testSpinning(SchedulerBackend backend) {
+  uint64_t spin_times[] = {1, DEFAULT_SPIN_TIME_NS, 10 * DEFAULT_SPIN_TIME_NS};
+
+  for (uint32_t i = 0; i < sizeof(spin_times) / sizeof(spin_times[0]); i++) {
+    SchedulerOptions options = {.execution_threads = 3, .backend = backend, .spin_time_ns = spin_times[i]};
+    JobScheduler* scheduler = initializeSchedulerWithOptions(&options);
+
+    int64_t* slots = memAlloc(sizeof(int64_t), NUM_JOBS, true, NULL);
+    int64_t* waiting_slots = memAlloc(sizeof(int64_t), NUM_JOBS, true, NULL);
+
+    for (uint32_t round = 0; round < 3; round++) {
+      // Pool threads spin in waitAllJobs too
+      JobInfo* job_info = createJob(scheduler, waitingJob, sizeof(SpawnJobArgs), QUERY_JOB);
+      SpawnJobArgs* args = job_info->args;
+      args->scheduler = scheduler;
+      args->slots = waiting_slots;
+
+      submitJob(scheduler, job_info);
+      _submitMarkJobs(scheduler, slots);
+      waitAllJobs(scheduler);
+
+      TEST_ASSERT(_allMarked(slots, 3));
+      TEST_ASSERT(_allMarked(waiting_slots, 3));
+      memset(slots, 0, NUM_JOBS * sizeof(int64_t));
+      memset(waiting_slots, 0, NUM_JOBS * sizeof(int64_t));
+    }
+
+    free(slots);
+    free(waiting_slots);
+    destroyScheduler(scheduler);
+  }
+}
+
+void testSingleGroup(void) {
+  _testSingleGroup(SHARED_QUEUE_SCHEDULER);
+}
+
+void testSeparateGroups(void) {
+  _testSeparateGroups(SHARED_QUEUE_SCHEDULER);
+}
+
+void testConcurrentGroups(void) {
+  _testConcurrentGroups(SHARED_QUEUE_SCHEDULER);
+}
+
+void testNestedJobs(void) {
+  _testNestedJobs(SHARED_QUEUE_SCHEDULER);
+}
+
+void testWaitingJobs(void) {
+  _testWaitingJobs(SHARED_QUEUE_SCHEDULER, 1);
+  _testWaitingJobs(SHARED_QUEUE_SCHEDULER, 3);
+}
+
+void testDependencies(void) {
+  _testDependencies(SHARED_QUEUE_SCHEDULER);
+}
+
+void testJobRecycling(void) {
+  _testJobRecycling(SHARED_QUEUE_SCHEDULER);
+}
+
+void testNodeJobs(void) {
+  _testNodeJobs(SHARED_QUEUE_SCHEDULER);
+}
+
+void testCancellation(void) {
+  _testCancellation(SHARED_QUEUE_SCHEDULER);
+}
+
+void testSpinning(void) {
+  _testSpinning(SHARED_QUEUE_SCHEDULER);
+}
+
+void testWorkStealingSingleGroup(void) {
+  _testSingleGroup(WORK_STEALING_SCHEDULER);
+}
+
+void testWorkStealingSeparateGroups(void) {
+  _testSeparateGroups(WORK_STEALING_SCHEDULER);
+}
+
+void testWorkStealingConcurrentGroups(void) {
+  _testConcurrentGroups(WORK_STEALING_SCHEDULER);
+}
+
+void testWorkStealingNestedJobs(void) {
+  _testNestedJobs(WORK_STEALING_SCHEDULER);
+}
+
+void testWorkStealingWaitingJobs(void) {
+  _testWaitingJobs(WORK_STEALING_SCHEDULER, 1);
+  _testWaitingJobs(WORK_STEALING_SCHEDULER, 3);
+}
+
+void testWorkStealingDependencies(void) {
+  _testDependencies(WORK_STEALING_SCHEDULER);
+}
+
+void testWorkStealingJobRecycling(void) {
+  _testJobRecycling(WORK_STEALING_SCHEDULER);
+}
+
+void testWorkStealingNodeJobs(void) {
+  _testNodeJobs(WORK_STEALING_SCHEDULER);
+}
+
+void testWorkStealingCancellation(void) {
+  _testCancellation(WORK_STEALING_SCHEDULER);
+}
+
+void testWorkStealingSpinning(void) {
+  _testSpinning(WORK_STEALING_SCHEDULER);
+}
+
+TEST_LIST = {{"testSingleGroup", testSingleGroup},
+             {"testSeparateGroups", testSeparateGroups},
+             {"testConcurrentGroups", testConcurrentGroups},
+             {"testNestedJobs", testNestedJobs},
+             {"testWaitingJobs", testWaitingJobs},
+             {"testDependencies", testDependencies},
+             {"testJobRecycling", testJobRecycling},
+             {"testNodeJobs", testNodeJobs},
+             {"testCancellation", testCancellation},
+             {"testSpinning", testSpinning},
+             {"testWorkStealingSingleGroup", testWorkStealingSingleGroup},
+             {"testWorkStealingSeparateGroups", testWorkStealingSeparateGroups},
+             {"testWorkStealingConcurrentGroups", testWorkStealingConcurrentGroups},
+             {"testWorkStealingNestedJobs", testWorkStealingNestedJobs},
+             {"testWorkStealingWaitingJobs", testWorkStealingWaitingJobs},
+             {"testWorkStealingDependencies", testWorkStealingDependencies},
+             {"testWorkStealingJobRecycling", testWorkStealingJobRecycling},
+             {"testWorkStealingNodeJobs", testWorkStealingNodeJobs},
+             {"testWorkStealingCancellation", testWorkStealingCancellation},
+             {"testWorkStealingSpinning", testWorkStealingSpinning},
+             {NULL, NULL}};
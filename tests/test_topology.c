@@ -0,0 +1,279 @@
+// Needed for mkdtemp
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "acutest.h"
+#include "helpers.h"
+#include "topology.h"
+
+// Writes contents to root/path, creating any missing directories along the way.
+void _writeFile(const char* root, const char* path, const char* contents) {
+  char full_path[512];
+  snprintf(full_path, sizeof(full_path), "%s/%s", root, path);
+
+  for (char* slash = strchr(full_path + strlen(root) + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    mkdir(full_path, 0700);
+    *slash = '/';
+  }
+
+  FILE* fp = fopen(full_path, "w");
+  TEST_ASSERT(fp != NULL);
+
+  fprintf(fp, "%s\n", contents);
+  fclose(fp);
+}
+
+// Creates a fake sysfs tree of a dual-socket machine, with a NUMA node per socket (whose IDs have a gap), two cores
+// per socket and two SMT threads per core. Like on Linux, the first thread of every core comes before any second one.
+//
+//     CPU      0  1  2  3  4  5  6  7
+//     package  0  0  1  1  0  0  1  1
+//     core     0  1  0  1  0  1  0  1
+//     node     0  0  2  2  0  0  2  2
+char* _createFakeSysfs(void) {
+  char* root = memAlloc(sizeof(char), 64, false, NULL);
+  strcpy(root, "/tmp/phj_topologyXXXXXX");
+  TEST_ASSERT(mkdtemp(root) != NULL);
+
+  _writeFile(root, "cpu/online", "0-7");
+  _writeFile(root, "node/online", "0,2");
+  _writeFile(root, "node/node0/cpulist", "0-1,4-5");
+  _writeFile(root, "node/node2/cpulist", "2-3,6-7");
+
+  for (uint32_t cpu = 0; cpu < 8; cpu++) {
+    char path[128], value[16];
+
+    snprintf(path, sizeof(path), "cpu/cpu%u/topology/physical_package_id", cpu);
+    snprintf(value, sizeof(value), "%u", (cpu % 4) / 2);
+    _writeFile(root, path, value);
+
+    snprintf(path, sizeof(path), "cpu/cpu%u/topology/core_id", cpu);
+    snprintf(value, sizeof(value), "%u", cpu % 2);
+    _writeFile(root, path, value);
+  }
+
+  return root;
+}
+
+void _destroyFakeSysfs(char* root) {
+  char command[128];
+  snprintf(command, sizeof(command), "rm -rf %s", root);
+  TEST_ASSERT(system(command) == 0);
+
+  free(root);
+}
+
+// Checks that the given threads were placed on the expected CPUs.
+bool _placedOn(CpuInfo* placement, const uint32_t* expected_cpus, uint32_t num_threads) {
+  for (uint32_t i = 0; i < num_threads; i++) {
+    if (placement[i].cpu != expected_cpus[i]) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void testParseCpuList(void) {
+  uint32_t cpus[8];
+
+  TEST_ASSERT(parseCpuList("0-3,8,10-11\n", cpus, 8) == 7);
+  TEST_ASSERT(cpus[0] == 0 && cpus[3] == 3 && cpus[4] == 8 && cpus[5] == 10 && cpus[6] == 11);
+
+  // CPUs that don't fit are still counted
+  TEST_ASSERT(parseCpuList("0-15", cpus, 8) == 16);
+  TEST_ASSERT(cpus[7] == 7);
+
+  TEST_ASSERT(parseCpuList("5", cpus, 8) == 1);
+  TEST_ASSERT(cpus[0] == 5);
+
+  TEST_ASSERT(parseCpuList("", cpus, 8) == 0);
+  TEST_ASSERT(parseCpuList("\n", cpus, 8) == 0);
+}
+
+void testLoadTopology(void) {
+  char* root = _createFakeSysfs();
+  CpuTopology* topology = loadTopology(root);
+
+  TEST_ASSERT(topology != NULL);
+  TEST_ASSERT(topology->num_cpus == 8);
+  TEST_ASSERT(topology->num_physical_cores == 4);
+  TEST_ASSERT(topology->num_nodes == 2);
+  TEST_ASSERT(topology->node_ids[0] == 0 && topology->node_ids[1] == 2);
+
+  for (uint32_t cpu = 0; cpu < 8; cpu++) {
+    TEST_ASSERT(topology->cpus[cpu].cpu == cpu);
+    TEST_ASSERT(topology->cpus[cpu].package == (cpu % 4) / 2);
+    TEST_ASSERT(topology->cpus[cpu].core == cpu % 2);
+    TEST_ASSERT(topology->cpus[cpu].rank == cpu / 4);
+    TEST_ASSERT(topology->cpus[cpu].node == (cpu % 4) / 2);
+  }
+
+  destroyTopology(topology);
+
+  // Without NUMA information, everything is on a single node
+  char path[128];
+  snprintf(path, sizeof(path), "rm -rf %s/node", root);
+  TEST_ASSERT(system(path) == 0);
+
+  topology = loadTopology(root);
+  TEST_ASSERT(topology->num_nodes == 1);
+  TEST_ASSERT(topology->cpus[7].node == 0);
+  destroyTopology(topology);
+
+  _destroyFakeSysfs(root);
+
+  TEST_ASSERT(loadTopology("/nonexistent") == NULL);
+
+  // The detected topology must at least have a CPU, whether sysfs is available or not
+  topology = detectTopology();
+  TEST_ASSERT(topology->num_cpus >= 1 && topology->num_nodes >= 1 && topology->num_physical_cores >= 1);
+  destroyTopology(topology);
+}
+
+void testPlaceThreads(void) {
+  char* root = _createFakeSysfs();
+  CpuTopology* topology = loadTopology(root);
+  CpuInfo placement[10];
+
+  // Both threads of a core, then the next core, then the next node
+  placeThreads(topology, AFFINITY_COMPACT, 8, placement);
+  TEST_ASSERT(_placedOn(placement, (uint32_t[]){0, 4, 1, 5, 2, 6, 3, 7}, 8));
+
+  // Alternate between the nodes, and only use SMT siblings once every core has a thread
+  placeThreads(topology, AFFINITY_SCATTER, 8, placement);
+  TEST_ASSERT(_placedOn(placement, (uint32_t[]){0, 2, 1, 3, 4, 6, 5, 7}, 8));
+  TEST_ASSERT(placement[1].node == 1);
+
+  // A thread per physical core, and the CPUs are reused once there are more threads than them
+  placeThreads(topology, AFFINITY_PHYSICAL_CORES, 4, placement);
+  TEST_ASSERT(_placedOn(placement, (uint32_t[]){0, 1, 2, 3}, 4));
+
+  placeThreads(topology, AFFINITY_PHYSICAL_CORES, 10, placement);
+  TEST_ASSERT(_placedOn(placement, (uint32_t[]){0, 1, 2, 3, 4, 5, 6, 7, 0, 1}, 10));
+
+  destroyTopology(topology);
+  _destroyFakeSysfs(root);
+}
+
+void testKeepPlacedNodes(void) {
+  char* root = _createFakeSysfs();
+  CpuTopology* topology = loadTopology(root);
+  CpuInfo placement[8];
+
+  // Four threads fill the first node, so the second one is dropped
+  placeThreads(topology, AFFINITY_COMPACT, 8, placement);
+  keepPlacedNodes(topology, placement, 4);
+  TEST_ASSERT(topology->num_nodes == 1 && topology->node_ids[0] == 0);
+  TEST_ASSERT(topology->num_cpus == 4 && topology->num_physical_cores == 2);
+  destroyTopology(topology);
+
+  // Only the second node has threads, so it becomes the first one, in both the topology and the placement
+  topology = loadTopology(root);
+  placeThreads(topology, AFFINITY_COMPACT, 8, placement);
+  keepPlacedNodes(topology, placement + 4, 4);
+  TEST_ASSERT(topology->num_nodes == 1 && topology->node_ids[0] == 2);
+  TEST_ASSERT(_placedOn(topology->cpus, (uint32_t[]){2, 3, 6, 7}, 4));
+
+  for (uint32_t i = 0; i < 4; i++) {
+    TEST_ASSERT(topology->cpus[i].node == 0 && placement[4 + i].node == 0);
+  }
+
+  destroyTopology(topology);
+
+  // Nodes that all have threads are left as they are
+  topology = loadTopology(root);
+  placeThreads(topology, AFFINITY_SCATTER, 2, placement);
+  keepPlacedNodes(topology, placement, 2);
+  TEST_ASSERT(topology->num_nodes == 2 && topology->num_cpus == 8 && topology->node_ids[1] == 2);
+  TEST_ASSERT(placement[0].node == 0 && placement[1].node == 1);
+
+  destroyTopology(topology);
+  _destroyFakeSysfs(root);
+}
+
+void testSimulateTopology(void) {
+  char* root = _createFakeSysfs();
+  CpuTopology* topology = loadTopology(root);
+
+  // The CPUs are split evenly between the nodes
+  CpuTopology* simulated = simulateTopology(topology, 4);
+  TEST_ASSERT(simulated->simulated && !topology->simulated);
+  TEST_ASSERT(simulated->num_cpus == 8 && simulated->num_nodes == 4 && simulated->num_physical_cores == 8);
+
+  for (uint32_t i = 0; i < 8; i++) {
+    TEST_ASSERT(simulated->cpus[i].cpu == i && simulated->cpus[i].node == i / 2);
+  }
+
+  CpuInfo placement[4];
+  placeThreads(simulated, AFFINITY_SCATTER, 4, placement);
+
+  for (uint32_t i = 0; i < 4; i++) {
+    TEST_ASSERT(placement[i].node == i);
+  }
+
+  destroyTopology(simulated);
+
+  // With fewer CPUs than nodes, the CPUs are reused
+  simulated = simulateTopology(topology, 16);
+  TEST_ASSERT(simulated->num_cpus == 16);
+  TEST_ASSERT(simulated->cpus[15].node == 15 && simulated->cpus[15].cpu == 7);
+
+  CpuTopology* copy = copyTopology(simulated);
+  TEST_ASSERT(copy->num_cpus == 16 && copy->simulated && copy->cpus[15].cpu == 7 && copy->node_ids[15] == 15);
+
+  destroyTopology(copy);
+  destroyTopology(simulated);
+  destroyTopology(topology);
+  _destroyFakeSysfs(root);
+}
+
+void testBindMemory(void) {
+  CpuTopology* topology = detectTopology();
+  CpuTopology* simulated = simulateTopology(topology, 2);
+
+  uint32_t size = 1 << 20;
+  uint8_t* memory = memAlloc(sizeof(uint8_t), size, false, NULL);
+
+  // Memory is never bound to simulated nodes, and ranges without a whole page can't be bound
+  TEST_ASSERT(!bindMemoryToNode(memory, size, simulated, 1));
+  TEST_ASSERT(!interleaveMemory(memory, size, simulated));
+  TEST_ASSERT(!bindMemoryToNode(memory, 1, topology, 0));
+
+  // Binding may not be allowed (e.g. in containers), but it must never affect the memory's contents
+  bindMemoryToNode(memory, size / 2, topology, 0);
+  interleaveMemory(memory + size / 2, size / 2, topology);
+
+  memset(memory, 0x5A, size);
+  TEST_ASSERT(memory[0] == 0x5A && memory[size - 1] == 0x5A);
+
+  free(memory);
+  destroyTopology(simulated);
+  destroyTopology(topology);
+}
+
+void testParseAffinityPolicy(void) {
+  AffinityPolicy policy = AFFINITY_NONE;
+
+  TEST_ASSERT(parseAffinityPolicy("scatter", &policy) && policy == AFFINITY_SCATTER);
+  TEST_ASSERT(parseAffinityPolicy("cores", &policy) && policy == AFFINITY_PHYSICAL_CORES);
+  TEST_ASSERT(parseAffinityPolicy("compact", &policy) && policy == AFFINITY_COMPACT);
+  TEST_ASSERT(parseAffinityPolicy("none", &policy) && policy == AFFINITY_NONE);
+  TEST_ASSERT(!parseAffinityPolicy("everywhere", &policy) && policy == AFFINITY_NONE);
+}
+
+TEST_LIST = {{"testParseCpuList", testParseCpuList},
+             {"testLoadTopology", testLoadTopology},
+             {"testPlaceThreads", testPlaceThreads},
+             {"testKeepPlacedNodes", testKeepPlacedNodes},
+             {"testSimulateTopology", testSimulateTopology},
+             {"testBindMemory", testBindMemory},
+             {"testParseAffinityPolicy", testParseAffinityPolicy},
+             {NULL, NULL}};